@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <romfs.h>
+
+/* RomfsVerifyImage scaling benchmark.
+ *
+ * Builds a synthetic image in memory: a tree of directories `fanout` wide and `depth` deep,
+ * each with `files` files of `size` bytes. Then scans it with 1, 2, 4, ... threads and
+ * prints the best time of a few runs for each thread count.
+ *
+ * usage: romfs-bench-verify [fanout depth files size maxthreads]
+ */
+
+#define RUNS 5
+
+typedef struct {
+    uint8_t  *img;
+    size_t   len;
+    size_t   cap;
+    uint32_t *hdr;      ///> Header offsets, for checksums
+    size_t   hdrCount;
+    size_t   hdrCap;
+} image_t;
+
+static void Put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static uint32_t Get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint32_t Sum(const uint8_t *p, size_t len)
+{
+    uint32_t s = 0;
+
+    for (size_t i = 0; i < len; i += 4) s += Get32(p + i);
+
+    return s;
+}
+
+static uint32_t Alloc(image_t *im, size_t len)
+{
+    uint32_t off = (uint32_t)im->len;
+
+    len = (len + 15) & ~(size_t)15;
+    while (im->len + len > im->cap) {
+        im->cap = im->cap ? im->cap * 2 : 1 << 20;
+        im->img = realloc(im->img, im->cap);
+        if (NULL == im->img) { perror("realloc"); exit(1); }
+    }
+
+    memset(im->img + off, 0, len);
+    im->len += len;
+
+    return off;
+}
+
+static uint32_t Header(image_t *im, const char *name, uint8_t mode, uint32_t info, uint32_t size)
+{
+    size_t nameLen = (strlen(name) + 16) & ~(size_t)15;
+    uint32_t off = Alloc(im, 16 + nameLen + size);
+
+    Put32(im->img + off, mode);
+    Put32(im->img + off + 4, info);
+    Put32(im->img + off + 8, size);
+    memcpy(im->img + off + 16, name, strlen(name));
+    memset(im->img + off + 16 + nameLen, 'x', size);
+
+    if (im->hdrCount == im->hdrCap) {
+        im->hdrCap = im->hdrCap ? im->hdrCap * 2 : 1024;
+        im->hdr = realloc(im->hdr, im->hdrCap * sizeof(uint32_t));
+        if (NULL == im->hdr) { perror("realloc"); exit(1); }
+    }
+    im->hdr[im->hdrCount++] = off;
+
+    return off;
+}
+
+static void Link(image_t *im, uint32_t prev, uint32_t next)
+{
+    Put32(im->img + prev, next | (Get32(im->img + prev) & 0xF));
+}
+
+static void Dir(image_t *im, uint32_t head, uint32_t self, uint32_t parent,
+                int fanout, int depth, int files, uint32_t size)
+{
+    uint32_t prev, cur;
+    char name[16];
+
+    prev = Header(im, "..", ROMFS_TYPE_HARDLINK, parent, 0);
+    Link(im, head, prev);
+
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        cur = Header(im, name, ROMFS_TYPE_FILE, 0, size);
+        Link(im, prev, cur);
+        prev = cur;
+    }
+
+    for (int i = 0; depth > 0 && i < fanout; i++) {
+        uint32_t dot;
+
+        snprintf(name, sizeof(name), "d%d", i);
+        cur = Header(im, name, ROMFS_TYPE_DIRECTORY, 0, 0);
+        Link(im, prev, cur);
+        prev = cur;
+
+        dot = Header(im, ".", ROMFS_TYPE_HARDLINK, cur, 0);
+        Put32(im->img + cur + 4, dot);
+        Dir(im, dot, cur, self, fanout, depth - 1, files, size);
+    }
+}
+
+static void Build(image_t *im, int fanout, int depth, int files, uint32_t size)
+{
+    uint32_t root;
+
+    Alloc(im, 32);
+    memcpy(im->img, "-rom1fs-", 8);
+    memcpy(im->img + 16, "bench", 5);
+
+    // root chain starts with "." directory pointing to the chain itself, like genromfs does
+    root = Header(im, ".", ROMFS_TYPE_DIRECTORY, 0, 0);
+    Put32(im->img + root + 4, root);
+    Dir(im, root, root, root, fanout, depth, files, size);
+
+    for (size_t i = 0; i < im->hdrCount; i++) {
+        uint8_t *h = im->img + im->hdr[i];
+        size_t len = 16 + ((strlen((const char *)h + 16) + 16) & ~(size_t)15);
+
+        Put32(h + 12, -Sum(h, len));
+    }
+
+    Put32(im->img + 8, (uint32_t)im->len);
+    Put32(im->img + 12, -Sum(im->img, im->len < 512 ? im->len : 512));
+}
+
+static double Now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    int fanout   = argc > 1 ? atoi(argv[1]) : 16;
+    int depth    = argc > 2 ? atoi(argv[2]) : 3;
+    int files    = argc > 3 ? atoi(argv[3]) : 32;
+    int size     = argc > 4 ? atoi(argv[4]) : 64;
+    int maxThr   = argc > 5 ? atoi(argv[5]) : 8;
+    image_t im = { 0 };
+    double base = 0;
+    romfs_t r;
+    int ret;
+
+    Build(&im, fanout, depth, files, (uint32_t)size);
+
+    ret = RomfsLoad(im.img, im.len, &r);
+    if (ret < 0) { fprintf(stderr, "RomfsLoad: %d\n", ret); return 1; }
+
+    printf("image: %zu bytes, %zu headers\n", im.len, im.hdrCount);
+    printf("%8s %10s %8s\n", "threads", "ms", "speedup");
+
+    for (int t = 1; t <= maxThr; t *= 2) {
+        double best = 0;
+
+        for (int run = 0; run < RUNS; run++) {
+            double start = Now();
+
+            ret = RomfsVerifyImage(r, t, NULL, NULL);
+            if (ret != 0) { fprintf(stderr, "RomfsVerifyImage: %d\n", ret); return 1; }
+
+            double ms = Now() - start;
+            if (run == 0 || ms < best) best = ms;
+        }
+
+        if (t == 1) base = best;
+        printf("%8d %10.2f %8.2f\n", t, best, base / best);
+    }
+
+    RomfsUnload(&r);
+    free(im.hdr);
+    free(im.img);
+
+    return 0;
+}
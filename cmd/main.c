@@ -1,5 +1,9 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/mman.h>
 #include <argp.h>
 #include <stdbool.h>
@@ -17,13 +21,29 @@ static struct argp_option options[] = {
     { "list", 'l', 0, OPTION_ARG_OPTIONAL, "List files in given path. If no path given, list files in root. Default mode."},
     { "read", 'r', 0, OPTION_ARG_OPTIONAL, "Read contents of the file specified in path."},
     { "path", 'p', "PATH", OPTION_ARG_OPTIONAL, "Path in romfs."},
+    { "index", 'i', 0, OPTION_ARG_OPTIONAL, "Build directory index at load."},
+    { "nodes", 'n', 0, OPTION_ARG_OPTIONAL, "Decode all file headers at load."},
+    { "bloom", 'b', 0, OPTION_ARG_OPTIONAL, "Build directory Bloom filters at load."},
+    { "verify", 'c', 0, OPTION_ARG_OPTIONAL, "Verify volume and header checksums at load."},
+    { "hash-tree", 'H', "FILE", 0, "Write hash tree of all files to FILE and print its root hash."},
+    { "verity", 'v', "FILE", 0, "Check every read against hash tree from FILE."},
+    { "device", 'd', 0, OPTION_ARG_OPTIONAL, "Read the image through a callback instead of mapping it."},
+    { "async", 'a', 0, OPTION_ARG_OPTIONAL, "Read the image file with many reads in flight, through io_uring where it works."},
+    { "pread", 'P', 0, OPTION_ARG_OPTIONAL, "With --async, use the pread thread pool instead of io_uring."},
+    { "direct", 'D', 0, OPTION_ARG_OPTIONAL, "With --async, read the image with O_DIRECT, past the page cache."},
+    { "stats", 's', 0, OPTION_ARG_OPTIONAL, "Print library statistics at exit."},
     { 0 }
 };
 
 struct arguments {
-    enum { LIST_MODE, READ_MODE } mode;
+    enum { LIST_MODE, READ_MODE, HASH_MODE } mode;
     char *path;
     char *file;
+    char *tree;
+    romfs_opts_t opts;
+    bool stats;
+    bool device;
+    bool async;
 };
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
@@ -33,6 +53,17 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 'l': arguments->mode = LIST_MODE; break;
         case 'r': arguments->mode = READ_MODE; break;
         case 'p': arguments->path = arg; break;
+        case 'i': arguments->opts.flags |= ROMFS_OPT_DIR_INDEX; break;
+        case 'n': arguments->opts.flags |= ROMFS_OPT_NODE_TABLE; break;
+        case 'b': arguments->opts.flags |= ROMFS_OPT_DIR_BLOOM; break;
+        case 'c': arguments->opts.flags |= ROMFS_OPT_VERIFY; break;
+        case 'H': arguments->mode = HASH_MODE; arguments->tree = arg; break;
+        case 'v': arguments->opts.flags |= ROMFS_OPT_VERITY; arguments->tree = arg; break;
+        case 'd': arguments->device = true; break;
+        case 'a': arguments->async = true; break;
+        case 'P': arguments->opts.flags |= ROMFS_OPT_FD_NO_URING; break;
+        case 'D': arguments->opts.flags |= ROMFS_OPT_FD_DIRECT; break;
+        case 's': arguments->stats = true; break;
         case ARGP_KEY_ARG: return 0;
     default:
         return ARGP_ERR_UNKNOWN;
@@ -63,38 +94,46 @@ int OpenRomfs(const char * filename, uint8_t **romfs, size_t *romfs_size) {
     return 0;
 }
 
+static
+int DevRead(void *ctx, uint32_t off, void *buf, size_t len) {
+    ssize_t ret = pread(*(int *)ctx, buf, len, off);
+
+    if (ret < 0) return -errno;
+    if ((size_t)ret != len) return -EIO;
+
+    return 0;
+}
+
 #define DIR_BUF_LEN 100
 
 static
 int ListDir(romfs_t r, const char *path) {
     int f, ret;
-    romfs_dirent_t dir[DIR_BUF_LEN];
+    romfs_direntplus_t dir[DIR_BUF_LEN];
     uint32_t cookie = 0;
     size_t used = DIR_BUF_LEN;
-    romfs_stat_t stat;
     size_t total = 0;
 
     f = RomfsOpenRoot(r, path, 0);
     if (f < 0) return f;
 
     do {
-        ret = RomfsReadDir(r, f, dir, DIR_BUF_LEN, &cookie, &used);
+        ret = RomfsReadDirPlus(r, f, dir, DIR_BUF_LEN, &cookie, &used);
         if (ret < 0) return ret;
 
         printf("[%-10s] [%-20s] [%-4s] [%-4s] [%-10s]\n", "Offset", "Name", "Mode", "Size", "Check");
         for (size_t i = 0; i < used; i++) {
-            printf("[0x%08x] %20s", dir[i].inode, dir[i].name);
-            if (IS_DIRECTORY(dir[i].type)) putchar('/');
-            else if (IS_FILE(dir[i].type) && IS_EXEC(dir[i].type)) putchar('*');
+            const romfs_dirent_t *ent = &dir[i].ent;
+
+            printf("[0x%08x] %20s", ent->inode, ent->name);
+            if (IS_DIRECTORY(ent->type)) putchar('/');
+            else if (IS_FILE(ent->type) && IS_EXEC(ent->type)) putchar('*');
             else putchar(' ');
-            printf("   0x%02x", dir[i].type);
-
-            if (IS_FILE(dir[i].type)) {
-                ret = RomfsFdStatAt(r, f, dir[i].name, &stat);
-                if (ret >= 0) {
-                    printf("   %4d   0x%x", stat.size, stat.chksum);
-                    total += stat.size;
-                }
+            printf("   0x%02x", ent->type);
+
+            if (IS_FILE(ent->type)) {
+                printf("   %4d   0x%x", dir[i].stat.size, dir[i].stat.chksum);
+                total += dir[i].stat.size;
             }
             putchar('\n');
         }
@@ -130,16 +169,78 @@ int ReadFile(romfs_t r, const char *path) {
     return 0;
 }
 
+static
+int WriteTree(romfs_t r, const char *filename) {
+    uint8_t root[32];
+    uint8_t *buf;
+    size_t len;
+    FILE *f;
+    int ret;
+
+    ret = RomfsVerityBuild(r, NULL, &len, NULL);
+    if (ret < 0) return ret;
+
+    buf = malloc(len);
+    if (NULL == buf) return -ENOMEM;
+
+    ret = RomfsVerityBuild(r, buf, &len, root);
+    if (ret < 0) { free(buf); return ret; }
+
+    f = fopen(filename, "wb");
+    if (NULL == f || fwrite(buf, 1, len, f) != len) ret = -EIO;
+    if (NULL != f) fclose(f);
+    free(buf);
+    if (ret < 0) return ret;
+
+    for (int i = 0; i < 32; i++) printf("%02x", root[i]);
+    putchar('\n');
+
+    return 0;
+}
+
+static
+void PrintStats(romfs_t r) {
+    romfs_stats_t st;
+
+    if (RomfsGetStats(r, &st) != 0) return;
+
+    fprintf(stderr, "index: %u dirs, %zu bytes, built in %u us\n", st.indexDirs, st.indexBytes, st.indexBuildUs);
+    fprintf(stderr, "nodes: %u headers, %zu bytes\n", st.nodeCount, st.nodeTableBytes);
+    fprintf(stderr, "path cache: %u hits, %u misses\n", st.pathCacheHits, st.pathCacheMisses);
+    fprintf(stderr, "bloom: %u dirs, %zu bytes, %u negatives, %u false positives (%.1f%%)\n",
+            st.bloomDirs, st.bloomBytes, st.bloomNegatives, st.bloomFalsePositives,
+            st.bloomNegatives + st.bloomFalsePositives ?
+                100.0 * st.bloomFalsePositives / (st.bloomNegatives + st.bloomFalsePositives) : 0.0);
+    fprintf(stderr, "verify: %u headers, %u bad\n", st.verifiedNodes, st.verifyFailures);
+    fprintf(stderr, "verity: %u files, %u blocks hashed, %zu bytes, %u failed reads\n",
+            st.verityFiles, st.verityHashed, st.verityBytes, st.verityFailures);
+    fprintf(stderr, "device: %u reads in %u rounds%s, %zu bytes of headers\n",
+            st.devReads, st.devRounds, st.fdUring ? " (io_uring)" : "", st.devHeaderBytes);
+    if (st.fdDirectAlign != 0) {
+        fprintf(stderr, "direct: %u byte alignment, %llu bytes bounced\n",
+                st.fdDirectAlign, (unsigned long long)st.fdBounceBytes);
+    }
+    fprintf(stderr, "block cache: %u hits, %u misses (%.1f%%), %llu bytes read ahead, %llu wasted\n",
+            st.devCacheHits, st.devCacheMisses,
+            st.devCacheHits + st.devCacheMisses ? 100.0 * st.devCacheHits / (st.devCacheHits + st.devCacheMisses) : 0.0,
+            (unsigned long long)st.devReadaheadBytes, (unsigned long long)st.devReadaheadWasted);
+}
+
 int main(int argc, char *argv[])
 {
     struct arguments arguments;
-    uint8_t *romfs_img;
-    size_t romfs_size;
+    uint8_t *romfs_img, *tree;
+    size_t romfs_size, tree_size;
     romfs_t romfs;
-    int ret;
+    int ret, fd = -1;
 
     arguments.path = "/";
+    arguments.tree = NULL;
     arguments.mode = LIST_MODE;
+    arguments.opts = (romfs_opts_t){ 0 };
+    arguments.stats = false;
+    arguments.device = false;
+    arguments.async = false;
 
     argp_parse(&argp, argc, argv, ARGP_NO_ARGS, &ret, &arguments);
 
@@ -149,9 +250,25 @@ int main(int argc, char *argv[])
         arguments.file = argv[ret];
     }
 
-    if (OpenRomfs(arguments.file, &romfs_img, &romfs_size) != 0) FATAL("can't open file: %s", arguments.file);
+    if (arguments.device || arguments.async) {
+        fd = open(arguments.file, O_RDONLY);
+        if (fd < 0) FATAL("can't open file: %s", arguments.file);
+        romfs_size = lseek(fd, 0, SEEK_END);
+    } else if (OpenRomfs(arguments.file, &romfs_img, &romfs_size) != 0) FATAL("can't open file: %s", arguments.file);
+
+    if (arguments.opts.flags & ROMFS_OPT_VERITY) {
+        if (OpenRomfs(arguments.tree, &tree, &tree_size) != 0) FATAL("can't open file: %s", arguments.tree);
+        arguments.opts.verity = tree;
+        arguments.opts.verityLen = tree_size;
+    }
 
-    ret = RomfsLoad(romfs_img, romfs_size, &romfs);
+    if (arguments.async) {
+        ret = RomfsLoadFd(fd, romfs_size, &arguments.opts, &romfs);
+    } else if (arguments.device) {
+        ret = RomfsLoadDev(DevRead, &fd, romfs_size, &arguments.opts, &romfs);
+    } else {
+        ret = RomfsLoadOpts(romfs_img, romfs_size, &arguments.opts, &romfs);
+    }
     if (ret < 0) { errno = -ret; perror("RomfsLoad"); return 1; }
 
     switch (arguments.mode)
@@ -165,11 +282,18 @@ int main(int argc, char *argv[])
         ret = ReadFile(romfs, arguments.path);
         if (ret < 0) { errno = -ret; perror("ReadFile"); return 1; }
         break;
+    case HASH_MODE:
+        ret = WriteTree(romfs, arguments.tree);
+        if (ret < 0) { errno = -ret; perror("WriteTree"); return 1; }
+        break;
     default:
         break;
     }
 
+    if (arguments.stats) PrintStats(romfs);
+
     RomfsUnload(&romfs);
+    if (fd >= 0) close(fd);
 
     return 0;
 }
@@ -14,5 +14,15 @@
 
 typedef char path_t[MAX_PATH_LEN];
 
+/* Path walker, splits the path in place into (pointer, length) components */
+typedef struct {
+    const char *name;   ///> Current component, not NUL terminated
+    size_t     len;     ///> Length of current component
+    const char *next;   ///> Rest of the path
+    const char *end;
+} path_walk_t;
+
 char *UtilsParsePathGetNext(const char *path, path_t buf, char **state);
 int UtilsCheckPath(const char *path);
+int UtilsPathWalkInit(path_walk_t *w, const char *path, size_t len);
+int UtilsPathWalkNext(path_walk_t *w);
@@ -35,11 +35,79 @@ void RomfsFree(void* ptr);
 #define IS_FILE(mode)          IS_TYPE(ROMFS_TYPE_FILE, (mode))
 #define IS_EXEC(mode)          (((mode)&(~ROMFS_TYPE_MASK)) == ROMFS_MODE_EXEC)
 
-#define ROMFS_O_FLAGS_NONBLOCK  (1 << 0)
+#define ROMFS_O_FLAGS_NONBLOCK  (1 << 0)   ///> Reads of device images return -EAGAIN instead of waiting for the device, see RomfsEventFd
 
 #define ROMFS_COOKIE_START      0
 #define ROMFS_COOKIE_LAST       0xFFFFFFFF
 
+#define ROMFS_OPT_DIR_INDEX      (1 << 0)   ///> Build hash index of every directory at load
+#define ROMFS_OPT_DIR_INDEX_LAZY (1 << 1)   ///> Index directory on its first search, evict cold ones over indexMemLimit
+#define ROMFS_OPT_NODE_TABLE     (1 << 2)   ///> Decode all file headers into a table at load
+#define ROMFS_OPT_DIR_BLOOM      (1 << 3)   ///> Build Bloom filter of names of every directory at load
+#define ROMFS_OPT_DIR_BLOOM_LAZY (1 << 4)   ///> Build directory's Bloom filter on its first search
+#define ROMFS_OPT_LINK_TABLE     (1 << 5)   ///> Resolve all hardlinks at load, looped links fail the load
+#define ROMFS_OPT_VERIFY         (1 << 6)   ///> Verify volume and every header checksum at load, bad image fails the load
+#define ROMFS_OPT_VERIFY_LAZY    (1 << 7)   ///> Verify volume checksum at load and each header on its first open
+#define ROMFS_OPT_VERITY         (1 << 8)   ///> Check every read against the hash tree, see RomfsVerityBuild
+#define ROMFS_OPT_DEV_NO_READAHEAD (1 << 9) ///> RomfsLoadDev: fetch only the blocks that are read
+#define ROMFS_OPT_FD_NO_URING    (1 << 10)  ///> RomfsLoadFd: read with the pread thread pool even where io_uring works
+#define ROMFS_OPT_FD_DIRECT      (1 << 11)  ///> RomfsLoadFd: read the file with O_DIRECT, past the page cache
+
+typedef struct {
+    uint32_t flags;         ///> ROMFS_OPT_* flags
+    size_t   indexMemLimit; ///> Lazy index memory cap in bytes, 0 means no limit
+    uint32_t pathCacheSize; ///> Number of resolved paths to cache, 0 disables the cache
+    uint32_t bloomBits;     ///> Bloom filter bits per name, 0 means default (10, ~1% false positives)
+    const uint8_t *verity;  ///> Hash tree for ROMFS_OPT_VERITY, NULL if it is appended to the image
+    size_t   verityLen;
+    const uint8_t *verityRoot; ///> Expected 32 byte root hash of the tree, NULL trusts the tree as is
+    uint32_t devBlockSize;  ///> RomfsLoadDev: cache block size, power of two, 0 means 512
+    uint32_t devCacheBlocks;///> RomfsLoadDev: number of cached blocks, 0 means 64
+    uint32_t devReadahead;  ///> RomfsLoadDev: largest readahead window in bytes, 0 means a quarter of the cache
+    uint32_t fdQueueDepth;  ///> RomfsLoadFd: reads in flight at once, 0 means 32
+    uint32_t fdThreads;     ///> RomfsLoadFd: pread threads when io_uring is not used, 0 means 4
+    void     (*ready)(void *ctx, uint32_t ino, int err); ///> Fetch queued by a non-blocking read of file ino finished
+    void     *readyCtx;
+} romfs_opts_t;
+
+typedef struct {
+    size_t   indexBytes;    ///> Memory used by directory indexes
+    uint32_t indexDirs;     ///> Number of indexed directories
+    uint32_t indexBuildUs;  ///> Time spent building indexes, in microseconds
+    uint32_t indexEvictions;///> Directory indexes dropped to stay under indexMemLimit
+    uint32_t indexSkipped;  ///> Directories the lazy index left to the linear search
+    size_t   nodeTableBytes;///> Memory used by decoded node table
+    uint32_t nodeCount;     ///> Number of decoded headers
+    uint32_t pathCacheHits;
+    uint32_t pathCacheMisses;
+    uint32_t pathCacheEntries;
+    uint32_t pathCacheEvictions;
+    size_t   bloomBytes;    ///> Memory used by Bloom filters
+    uint32_t bloomDirs;     ///> Number of directories with a filter
+    uint32_t bloomNegatives;///> Searches answered by a filter without touching the directory
+    uint32_t bloomFalsePositives; ///> Searches the filter let through that found nothing
+    size_t   linkTableBytes;///> Memory used by resolved hardlink table
+    uint32_t linkCount;     ///> Number of resolved hardlinks
+    uint32_t verifiedNodes; ///> Headers whose checksum was computed
+    uint32_t verifyFailures;///> Headers with bad checksum
+    size_t   verityBytes;   ///> Memory used by verified block bitmaps
+    uint32_t verityFiles;   ///> Files read with verification so far
+    uint32_t verityHashed;  ///> Data and tree blocks hashed
+    uint32_t verityFailures;///> Reads refused, block or file did not match the tree
+    uint32_t devReads;      ///> Reads issued to the device
+    size_t   devHeaderBytes;///> Memory used by headers and names read from the device
+    uint32_t devCacheHits;  ///> Block lookups served from the cache
+    uint32_t devCacheMisses;///> Block lookups that went to the device
+    uint64_t devReadaheadBytes;  ///> Bytes read ahead of sequential readers
+    uint64_t devReadaheadWasted; ///> Bytes read ahead and evicted before anyone read them
+    uint32_t devRounds;     ///> Submission rounds, each carries one or more device reads
+    uint32_t fdUring;       ///> RomfsLoadFd: 1 if the image is read through io_uring
+    uint32_t fdDirectAlign; ///> RomfsLoadFd: alignment of O_DIRECT reads, 0 if reads are buffered
+    uint64_t fdBounceBytes; ///> RomfsLoadFd: bytes of unaligned O_DIRECT reads copied from bounce buffers
+    uint32_t asyncAgain;    ///> Non-blocking reads answered with -EAGAIN
+    uint32_t asyncFetches;  ///> Fetches done in the background for them, readahead included
+} romfs_stats_t;
+
 typedef struct {
     uint32_t ino;
     uint32_t size;
@@ -61,17 +129,108 @@ typedef struct {
     const char  *name;
 } romfs_dirent_t;
 
+/* Directory entry with the stat of its target, hardlinks are followed. */
+typedef struct {
+    romfs_dirent_t  ent;        ///> Entry itself, as returned by RomfsReadDir
+    romfs_stat_t    stat;       ///> Target of the entry, same as entry unless it is a hardlink
+    uint32_t        dataOff;    ///> Offset of target data in the image
+} romfs_direntplus_t;
+
+/* Caller owned open file. Filled by RomfsFileOpen, fields are read-only for the caller,
+   except that a copy of a handle is an independent handle with its own position. Handle
+   calls use no descriptor, but lazy caches, verity and device images still share state
+   behind locks; only a memory image with none of them is lock-free. */
+typedef struct {
+    uint32_t    ino;        ///> File header offset, hardlinks followed
+    uint32_t    info;
+    uint32_t    size;
+    uint32_t    chksum;
+    uint32_t    dataOff;    ///> Offset of file data in the image
+    uint32_t    pos;        ///> Read position
+    uint32_t    raNext;     ///> Device images: position a sequential read continues from
+    uint32_t    raEnd;      ///> Device images: end of data read ahead
+    uint32_t    raWindow;   ///> Device images: readahead window in bytes, grows on sequential reads
+    uint8_t     mode;
+    uint8_t     flags;      ///> ROMFS_O_FLAGS_* given at open
+} romfs_file_t;
+
+typedef struct {
+    void        *base;
+    size_t      len;
+} romfs_iovec_t;
+
+/* One read of RomfsReadMany. File is given by descriptor, or by inode when fd is negative. */
+typedef struct {
+    int         fd;
+    uint32_t    ino;
+    uint32_t    off;        ///> Offset in the file, position of fd is not used nor changed
+    void        *buf;
+    size_t      len;
+    int         ret;        ///> Bytes read or -errno, filled by RomfsReadMany
+} romfs_readreq_t;
+
 typedef struct romfs_t *romfs_t;
+typedef struct romfs_path_t *romfs_path_t;     ///> Compiled path, see RomfsPathCompile
+
+/* Problem found by RomfsVerifyImage. ino is the header offset, 0 for the volume header. err
+   is -EIO for bad checksum, -EFAULT for offset or data outside the volume, -ELOOP for looped
+   directory chains or hardlinks. Calls are serialized. */
+typedef void (*romfs_report_t)(void *ctx, uint32_t ino, int err);
+
+/* Reads len bytes at off of the image into buf, all of them. Returns 0 or -errno. Calls are
+   serialized. */
+typedef int (*romfs_devread_t)(void *ctx, uint32_t off, void *buf, size_t len);
 
 int RomfsLoad(uint8_t * img, size_t imgSize, romfs_t *romfs);
+int RomfsLoadOpts(uint8_t * img, size_t imgSize, const romfs_opts_t *opts, romfs_t *romfs);
+int RomfsLoadDev(romfs_devread_t read, void *ctx, size_t size, const romfs_opts_t *opts, romfs_t *romfs);
+/* Device image read from an open file, many reads in flight at once. size 0 means the size
+   of the file. fd stays open and owned by the caller. */
+int RomfsLoadFd(int fd, size_t size, const romfs_opts_t *opts, romfs_t *romfs);
 void RomfsUnload(romfs_t *romfs);
 int RomfsOpenAt(romfs_t t, int fd, const char *path, int flags);
+int RomfsOpenAtN(romfs_t t, int fd, const char *path, size_t pathLen, int flags);
 int RomfsOpenRoot(romfs_t t, const char *path, int flags);
+int RomfsOpenIno(romfs_t t, uint32_t ino, int flags);
 int RomfsClose(romfs_t t, int fd);
 int RomfsFdStat(romfs_t t, int fd, romfs_stat_t *stat);
 int RomfsFdStatAt(romfs_t t, int fd, const char *path, romfs_stat_t *stat);
+int RomfsFdStatAtN(romfs_t t, int fd, const char *path, size_t pathLen, romfs_stat_t *stat);
+int RomfsStatIno(romfs_t t, uint32_t ino, romfs_stat_t *stat);
+int RomfsPathCompile(const char *path, size_t pathLen, romfs_path_t *cp);
+void RomfsPathFree(romfs_path_t *cp);
+int RomfsOpenAtCompiled(romfs_t t, int fd, romfs_path_t cp, int flags);
+int RomfsStatAtCompiled(romfs_t t, int fd, romfs_path_t cp, romfs_stat_t *stat);
 int RomfsRead(romfs_t t, int fd, void *buf, size_t nbyte);
+int RomfsReadv(romfs_t t, int fd, const romfs_iovec_t *iov, int iovcnt);
+int RomfsPread(romfs_t t, int fd, void *buf, size_t nbyte, uint32_t off);
+int RomfsPreadv(romfs_t t, int fd, const romfs_iovec_t *iov, int iovcnt, uint32_t off);
 int RomfsSeek(romfs_t t, int fd, long off, romfs_seek_t whence);
 int RomfsTell(romfs_t t, int fd, long *off);
 int RomfsReadDir(romfs_t t, int fd, romfs_dirent_t *buf, size_t bufLen, uint32_t *cookie, size_t *bufUsed);
+int RomfsReadDirPlus(romfs_t t, int fd, romfs_direntplus_t *buf, size_t bufLen, uint32_t *cookie, size_t *bufUsed);
 int RomfsMapFile(romfs_t t, void **addr, size_t *len, int fd, uint32_t off);
+int RomfsGetStats(romfs_t t, romfs_stats_t *stats);
+int RomfsStatMany(romfs_t t, int fd, const char *const *paths, size_t count, romfs_stat_t *stats, int *results);
+int RomfsOpenMany(romfs_t t, int fd, const char *const *paths, size_t count, int flags, int *fds);
+int RomfsReadMany(romfs_t t, romfs_readreq_t *reqs, size_t count);
+int RomfsVerifyImage(romfs_t t, int nthreads, romfs_report_t report, void *ctx);
+/* Descriptor that turns readable when fetches queued by non-blocking reads finish, for poll
+   or epoll. Read it to clear, it stays open until unload. -ENOTSUP for images in memory and
+   builds without threads, their reads never return -EAGAIN. */
+int RomfsEventFd(romfs_t t);
+/* Builds hash tree of all files for ROMFS_OPT_VERITY into buf and its root hash. With buf
+   NULL only sets len to the size needed. */
+int RomfsVerityBuild(romfs_t t, uint8_t *buf, size_t *len, uint8_t root[32]);
+
+int RomfsFileOpen(romfs_t t, const romfs_file_t *dir, const char *path, int flags, romfs_file_t *file);
+int RomfsFileStat(romfs_t t, const romfs_file_t *file, romfs_stat_t *stat);
+int RomfsFileRead(romfs_t t, romfs_file_t *file, void *buf, size_t nbyte);
+int RomfsFileReadv(romfs_t t, romfs_file_t *file, const romfs_iovec_t *iov, int iovcnt);
+int RomfsFilePread(romfs_t t, const romfs_file_t *file, void *buf, size_t nbyte, uint32_t off);
+int RomfsFilePreadv(romfs_t t, const romfs_file_t *file, const romfs_iovec_t *iov, int iovcnt, uint32_t off);
+int RomfsFileSeek(romfs_t t, romfs_file_t *file, long off, romfs_seek_t whence);
+int RomfsFileTell(romfs_t t, const romfs_file_t *file, long *off);
+int RomfsFileReadDir(romfs_t t, const romfs_file_t *dir, romfs_dirent_t *buf, size_t bufLen, uint32_t *cookie, size_t *bufUsed);
+int RomfsFileReadDirPlus(romfs_t t, const romfs_file_t *dir, romfs_direntplus_t *buf, size_t bufLen, uint32_t *cookie, size_t *bufUsed);
+int RomfsFileMap(romfs_t t, const romfs_file_t *file, void **addr, size_t *len, uint32_t off);
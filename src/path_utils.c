@@ -38,28 +38,72 @@ char *UtilsParsePathGetNext(const char *path, path_t buf, char **state) {
 int UtilsCheckPath(const char *path)
 {
     int ret = 0;
-    path_t buf;
-    char *state;
-    char *p;
+    int d;
+    path_walk_t w;
 
     if (path == NULL) {
         return -EINVAL;
     }
 
-    if (strnlen(path, MAX_PATH_LEN) == MAX_PATH_LEN) {
+    d = UtilsPathWalkInit(&w, path, MAX_PATH_LEN);
+    if (d < 0) return d;
+
+    while ((d = UtilsPathWalkNext(&w)) > 0) {
+        ret++;
+    }
+
+    return d < 0 ? d : ret;
+}
+
+/* Components are produced with the same rules as UtilsParsePathGetNext: leading slashes give
+ * "." (lookup starts in the directory itself), repeated slashes are skipped. The path is never
+ * copied and doesn't have to be NUL terminated, at most len bytes are read, first NUL ends it.
+ */
+int UtilsPathWalkInit(path_walk_t *w, const char *path, size_t len)
+{
+    if (path == NULL || w == NULL) {
+        return -EINVAL;
+    }
+
+    len = strnlen(path, len);
+    if (len >= MAX_PATH_LEN) {
         return -ENAMETOOLONG;
     }
 
-    p = UtilsParsePathGetNext(path, buf, &state);
-    while (p != NULL) {
-        if (strnlen(p, MAX_NAME_LEN) == MAX_NAME_LEN) {
-            ret = -ENAMETOOLONG;
-            break;
-        }
+    w->name = NULL;
+    w->len = 0;
+    w->next = path;
+    w->end = path + len;
 
-        ret++;
-        p = UtilsParsePathGetNext(NULL, buf, &state);
+    return 0;
+}
+
+int UtilsPathWalkNext(path_walk_t *w)
+{
+    const char *p = w->next;
+
+    if (w->name == NULL && p < w->end && *p == '/') {
+        while (p < w->end && *p == '/') { p++; }
+        w->next = p;
+        w->name = ".";
+        w->len = 1;
+        return 1;
+    }
+
+    while (p < w->end && *p == '/') { p++; }
+    if (p == w->end) {
+        w->next = p;
+        return 0;
+    }
+
+    w->name = p;
+    while (p < w->end && *p != '/') { p++; }
+    w->len = (size_t)(p - w->name);
+    w->next = p;
+
+    if (w->len >= MAX_NAME_LEN) {
+        return -ENAMETOOLONG;
     }
 
-    return ret;
+    return 1;
 }
@@ -0,0 +1,794 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "romfs-internal.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#   include <stdio.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/stat.h>
+#   include <sys/uio.h>
+#   define AIO_POSIX 1
+#endif
+
+#if AIO_POSIX && defined(__linux__) && defined(O_DIRECT)
+#   include <sys/ioctl.h>
+#   include <linux/fs.h>
+#   define AIO_DIRECT 1
+#endif
+
+#if AIO_POSIX && ROMFS_URING
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#   include <linux/io_uring.h>
+#   define AIO_URING 1
+#endif
+
+#if AIO_POSIX && ROMFS_THREADS && defined(__GNUC__)
+#   include <pthread.h>
+#   define AIO_THREADS 1
+#endif
+
+/* Image file reader.
+ *
+ * Batches of device reads are kept in flight together. On Linux they go through an io_uring
+ * set up with raw syscalls, no liburing: every free slot of the ring gets a read, the ring is
+ * entered once per round to submit all queued reads and wait for at least one, completions
+ * free slots for the reads still waiting. Short reads are queued again for the rest. If the
+ * ring fails, the reads the kernel took are waited for, so none lands in a buffer after the
+ * batch returns, then the ring is dropped for good and the rest is read the pread way.
+ *
+ * Where io_uring is missing, refused (seccomp, old kernel) or turned off with
+ * ROMFS_OPT_FD_NO_URING, a pool of threads does pread, the submitting thread takes reads too.
+ * Without threads it is plain pread one after another.
+ *
+ * With ROMFS_OPT_FD_DIRECT the file is opened again with O_DIRECT, so reads bypass the page
+ * cache and only the library's own cache keeps what was read. Offset, length and memory of
+ * such reads must be aligned to the logical block of the device. Reads that are not, e.g.
+ * into a caller's buffer or of a short last block, go through a bounce buffer covering their
+ * aligned span and are copied out. The bounce buffer has a fixed size, a batch whose
+ * unaligned reads don't fit is read in rounds and a read longer than the buffer in pieces.
+ * The block cache is laid out aligned, its fills need no copy.
+ */
+
+#define AIO_QUEUE_DEPTH     32
+#define AIO_THREADS_DEFAULT 4
+#define AIO_MAX_THREADS     64
+#define AIO_DIRECT_ALIGN    4096    ///> O_DIRECT alignment when the device does not tell
+#define AIO_BOUNCE_MAX      (128u << 10)    ///> Bounce buffer size, longer reads go in pieces
+
+#if AIO_URING
+typedef struct {
+    devio_t     *io;
+    size_t      done;       ///> Bytes read so far
+    struct iovec iov;       ///> Rest of the read, must stay put until it completes
+} uslot_t;
+
+typedef struct {
+    int         fd;         ///> Ring, -1 if not set up
+    uint32_t    depth;      ///> Slots, never over the ring's entries
+    uint32_t    *sqHead;
+    uint32_t    *sqTail;
+    uint32_t    *sqMask;
+    uint32_t    *sqArray;
+    uint32_t    *cqHead;
+    uint32_t    *cqTail;
+    uint32_t    *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void        *sqMap;
+    size_t      sqLen;
+    void        *cqMap;
+    size_t      cqLen;
+    size_t      sqesLen;
+    uslot_t     *slot;
+    uint32_t    *free;      ///> Stack of free slots
+    uint32_t    nfree;
+} uring_t;
+#endif
+
+#if AIO_THREADS
+typedef struct {
+    pthread_t   tid[AIO_MAX_THREADS];
+    uint32_t    threads;    ///> Started
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    devio_t     *io;        ///> Batch being read
+    size_t      n;
+    size_t      next;       ///> First read nobody took yet
+    size_t      left;       ///> Reads not finished
+    int         stop;
+} pool_t;
+#endif
+
+/* Where the bytes of one aligned read of a bounced batch go. */
+typedef struct {
+    size_t      k;          ///> Read of the batch the piece belongs to
+    uint8_t     *dst;       ///> Caller's buffer, NULL if the read went there itself
+    size_t      skip;       ///> Bytes of the aligned read before the wanted ones
+    size_t      len;        ///> Bytes wanted
+} piece_t;
+
+struct romfs_aio_t {
+    int         fd;         ///> Descriptor reads go to, own O_DIRECT one if direct is set
+    int         direct;
+    uint32_t    align;      ///> Offset, length and memory alignment reads need, 1 if buffered
+    uint64_t    fileSize;
+    devio_t     *shadow;    ///> Aligned reads standing in for the batch being read
+    piece_t     *piece;     ///> Where each of them goes
+    size_t      shadowCap;
+    void        *bounceMem;
+    uint8_t     *bounce;    ///> Aligned start of bounceMem
+    size_t      bounceLen;  ///> Fixed, AIO_BOUNCE_MAX rounded up to the alignment
+    uint64_t    bounced;    ///> Bytes copied out of bounce buffers
+#if AIO_URING
+    uring_t     ring;
+#endif
+#if AIO_THREADS
+    pool_t      pool;
+    int         pooled;     ///> Pool is set up
+    uint32_t    threads;    ///> Pool size, also for falling back from a failed ring
+#endif
+};
+
+#if AIO_POSIX
+/* Bytes a read must get. Aligned reads may reach past the end of the file, the request they
+   stand in for does not. */
+static inline
+size_t Want(const romfs_aio_t *a, const devio_t *io)
+{
+    if (a->align > 1 && io->off < a->fileSize && a->fileSize - io->off < io->len) {
+        return (size_t)(a->fileSize - io->off);
+    }
+
+    return io->len;
+}
+
+static
+int PreadAll(const romfs_aio_t *a, devio_t *io)
+{
+    size_t done = 0, want = Want(a, io);
+
+    while (done < want) {
+        ssize_t ret = pread(a->fd, io->buf + done, io->len - done, (off_t)io->off + (off_t)done);
+
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) return -errno;
+        if (ret == 0) return -EIO;      // file is shorter than the image
+
+        done += (size_t)ret;
+    }
+
+    return 0;
+}
+#endif
+
+#if AIO_URING
+static
+void UringQueue(uring_t *r, int fd, uint32_t k)
+{
+    uslot_t *s = &r->slot[k];
+    uint32_t tail = *r->sqTail;
+    uint32_t idx = tail & *r->sqMask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    s->iov.iov_base = s->io->buf + s->done;
+    s->iov.iov_len = s->io->len - s->done;
+
+    // READV is there since the first io_uring kernels, READ came later
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)&s->iov;
+    sqe->len = 1;
+    sqe->off = (uint64_t)s->io->off + s->done;
+    sqe->user_data = k;
+
+    r->sqArray[idx] = idx;
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Takes all completions there are. Returns the number of reads finished. Short reads are
+   queued again, or with queued NULL left not done, ret 1. */
+static
+uint32_t UringReap(romfs_aio_t *a, uint32_t *queued)
+{
+    uring_t *r = &a->ring;
+    uint32_t head = *r->cqHead;
+    uint32_t tail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+    uint32_t finished = 0;
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cqMask];
+        uint32_t k = (uint32_t)cqe->user_data;
+        uslot_t *s = &r->slot[k];
+
+        if (cqe->res > 0) s->done += (size_t)cqe->res;
+
+        if (cqe->res > 0 && s->done < Want(a, s->io)) {
+            if (NULL == queued) {
+                s->io->ret = 1;
+            } else {
+                UringQueue(r, a->fd, k);
+                (*queued)++;
+                continue;
+            }
+        } else {
+            s->io->ret = cqe->res < 0 ? cqe->res : s->done < Want(a, s->io) ? -EIO : 0;
+        }
+
+        r->free[r->nfree++] = k;
+        finished++;
+    }
+
+    __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+
+    return finished;
+}
+
+static
+void UringFree(uring_t *r)
+{
+    if (r->sqes != NULL) munmap(r->sqes, r->sqesLen);
+    if (r->cqMap != NULL) munmap(r->cqMap, r->cqLen);
+    if (r->sqMap != NULL) munmap(r->sqMap, r->sqLen);
+    if (r->fd >= 0) close(r->fd);
+
+    RomfsFree(r->slot);
+    RomfsFree(r->free);
+
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+/* Ring failed: waits until the kernel is done with every read it took, then drops the ring.
+   Reads still in its submission queue never start. */
+static
+void UringAbort(romfs_aio_t *a, uint32_t inflight)
+{
+    uring_t *r = &a->ring;
+    uint32_t pending = inflight - (*r->sqTail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE));
+
+    while (pending != 0) {
+        pending -= UringReap(a, NULL);
+        if (pending == 0) break;
+
+        if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            ROMFS_TRACE("io_uring wait failed: %d, %u reads left", -errno, pending);
+            break;
+        }
+    }
+
+    UringFree(r);
+}
+
+/* Reads a batch through the ring. -errno if the ring failed and is gone, reads it did not
+   finish are left with ret 1. */
+static
+int UringSubmit(romfs_aio_t *a, devio_t *io, size_t n)
+{
+    uring_t *r = &a->ring;
+    uint32_t queued = 0, inflight = 0;
+    size_t next = 0;
+
+    for (size_t k = 0; k < n; k++) io[k].ret = 1;   // not done
+
+    while (next < n || inflight != 0) {
+        long ret;
+
+        while (next < n && r->nfree != 0) {
+            uint32_t k = r->free[--r->nfree];
+
+            r->slot[k].io = &io[next++];
+            r->slot[k].done = 0;
+            UringQueue(r, a->fd, k);
+            queued++;
+            inflight++;
+        }
+
+        ret = syscall(__NR_io_uring_enter, r->fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            int err = -errno;
+
+            ROMFS_TRACE("io_uring_enter failed: %d", err);
+            UringAbort(a, inflight);
+            return err;
+        }
+
+        if (ret > 0) queued -= (uint32_t)ret;
+
+        inflight -= UringReap(a, &queued);
+    }
+
+    return 0;
+}
+
+static
+int UringInit(uring_t *r, uint32_t depth)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+
+    r->fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+    if (r->fd < 0) return -errno;
+
+    r->sqLen = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    r->cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    // newer kernels map both rings at once
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqLen > r->sqLen) r->sqLen = r->cqLen;
+        r->cqLen = 0;
+    }
+
+    r->sqMap = mmap(NULL, r->sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == r->sqMap) { r->sqMap = NULL; return -errno; }
+
+    if (r->cqLen != 0) {
+        r->cqMap = mmap(NULL, r->cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == r->cqMap) { r->cqMap = NULL; return -errno; }
+    }
+
+    r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == (void *)r->sqes) { r->sqes = NULL; return -errno; }
+
+    uint8_t *sq = (uint8_t *)r->sqMap;
+    uint8_t *cq = r->cqMap != NULL ? (uint8_t *)r->cqMap : sq;
+
+    r->sqHead  = (uint32_t *)(sq + p.sq_off.head);
+    r->sqTail  = (uint32_t *)(sq + p.sq_off.tail);
+    r->sqMask  = (uint32_t *)(sq + p.sq_off.ring_mask);
+    r->sqArray = (uint32_t *)(sq + p.sq_off.array);
+    r->cqHead  = (uint32_t *)(cq + p.cq_off.head);
+    r->cqTail  = (uint32_t *)(cq + p.cq_off.tail);
+    r->cqMask  = (uint32_t *)(cq + p.cq_off.ring_mask);
+    r->cqes    = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    r->depth = depth < p.sq_entries ? depth : p.sq_entries;
+    r->slot = (uslot_t *)RomfsMalloc(r->depth * sizeof(uslot_t));
+    r->free = (uint32_t *)RomfsMalloc(r->depth * sizeof(uint32_t));
+    if (NULL == r->slot || NULL == r->free) return -ENOMEM;
+
+    for (r->nfree = 0; r->nfree < r->depth; r->nfree++) {
+        r->free[r->nfree] = r->depth - 1 - r->nfree;
+    }
+
+    return 0;
+}
+
+#endif
+
+#if AIO_THREADS
+/* Takes reads of the current batch until none is left. Called with the mutex held. */
+static
+void PoolWork(romfs_aio_t *a)
+{
+    pool_t *p = &a->pool;
+
+    while (p->next < p->n) {
+        devio_t *io = &p->io[p->next++];
+
+        pthread_mutex_unlock(&p->mutex);
+        io->ret = PreadAll(a, io);
+        pthread_mutex_lock(&p->mutex);
+
+        if (--p->left == 0) pthread_cond_signal(&p->done);
+    }
+}
+
+static
+void *PoolWorker(void *arg)
+{
+    romfs_aio_t *a = (romfs_aio_t *)arg;
+    pool_t *p = &a->pool;
+
+    pthread_mutex_lock(&p->mutex);
+
+    while (!p->stop) {
+        if (p->next < p->n) {
+            PoolWork(a);
+        } else {
+            pthread_cond_wait(&p->work, &p->mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&p->mutex);
+
+    return NULL;
+}
+
+static
+void PoolSubmit(romfs_aio_t *a, devio_t *io, size_t n)
+{
+    pool_t *p = &a->pool;
+
+    pthread_mutex_lock(&p->mutex);
+
+    p->io = io;
+    p->n = n;
+    p->next = 0;
+    p->left = n;
+    pthread_cond_broadcast(&p->work);
+
+    PoolWork(a);
+    while (p->left != 0) pthread_cond_wait(&p->done, &p->mutex);
+
+    p->n = 0;
+
+    pthread_mutex_unlock(&p->mutex);
+}
+
+static
+int PoolInit(romfs_aio_t *a, uint32_t threads)
+{
+    pool_t *p = &a->pool;
+
+    if (pthread_mutex_init(&p->mutex, NULL) != 0) return -ENOMEM;
+    if (pthread_cond_init(&p->work, NULL) != 0) { pthread_mutex_destroy(&p->mutex); return -ENOMEM; }
+    if (pthread_cond_init(&p->done, NULL) != 0) {
+        pthread_cond_destroy(&p->work);
+        pthread_mutex_destroy(&p->mutex);
+        return -ENOMEM;
+    }
+
+    a->pooled = 1;
+
+    // submitting thread reads too, a pool that can't start threads still works
+    if (threads > AIO_MAX_THREADS) threads = AIO_MAX_THREADS;
+    while (p->threads < threads && pthread_create(&p->tid[p->threads], NULL, PoolWorker, a) == 0) {
+        p->threads++;
+    }
+
+    return 0;
+}
+
+static
+void PoolFree(romfs_aio_t *a)
+{
+    pool_t *p = &a->pool;
+
+    if (!a->pooled) return;
+
+    pthread_mutex_lock(&p->mutex);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->mutex);
+
+    for (uint32_t i = 0; i < p->threads; i++) {
+        pthread_join(p->tid[i], NULL);
+    }
+
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->work);
+    pthread_mutex_destroy(&p->mutex);
+    a->pooled = 0;
+}
+#endif
+
+#if AIO_DIRECT
+/* Logical block of the device holding the file, what O_DIRECT reads are aligned to. */
+static
+uint32_t DirectAlign(int fd)
+{
+    uint32_t align = AIO_DIRECT_ALIGN;
+    struct stat st;
+    int sector;
+
+    if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &sector) == 0 && sector > 0) {
+        return (uint32_t)sector;
+    }
+
+#if defined(STATX_DIOALIGN)
+    struct statx stx;
+
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN) &&
+        stx.stx_dio_offset_align != 0) {
+        align = stx.stx_dio_offset_align > stx.stx_dio_mem_align ? stx.stx_dio_offset_align : stx.stx_dio_mem_align;
+    }
+#endif
+
+    return align;
+}
+
+/* Own O_DIRECT descriptor of the file, the caller's one keeps its flags. */
+static
+int DirectOpen(int fd)
+{
+    char path[32];
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+    return open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+}
+#endif
+
+#if AIO_POSIX
+static
+uint64_t FileSize(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) return 0;
+
+#if defined(BLKGETSIZE64)
+    uint64_t bytes;
+
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &bytes) == 0) return bytes;
+#endif
+
+    return (uint64_t)st.st_size;
+}
+#endif
+
+static
+void Issue(romfs_aio_t *aio, devio_t *io, size_t n)
+{
+#if AIO_URING
+    if (aio->ring.fd >= 0) {
+        if (UringSubmit(aio, io, n) == 0) return;
+
+        // ring is gone, this batch and all later ones go the pread way
+#if AIO_THREADS
+        if (!aio->pooled) PoolInit(aio, aio->threads);
+#endif
+        for (size_t k = 0; k < n; k++) {
+            if (io[k].ret == 1) io[k].ret = PreadAll(aio, &io[k]);
+        }
+        return;
+    }
+#endif
+
+#if AIO_THREADS
+    if (aio->pooled && aio->pool.threads != 0 && n > 1) {
+        PoolSubmit(aio, io, n);
+        return;
+    }
+#endif
+
+#if AIO_POSIX
+    for (size_t k = 0; k < n; k++) {
+        io[k].ret = PreadAll(aio, &io[k]);
+    }
+#else
+    (void)aio; (void)io; (void)n;
+#endif
+}
+
+static inline
+int Aligned(const romfs_aio_t *a, const devio_t *io)
+{
+    return ((io->off | io->len | (uintptr_t)io->buf) & (a->align - 1)) == 0;
+}
+
+/* O_DIRECT reads, unaligned ones stand in for by aligned reads into the bounce buffer. Rounds
+   take reads until the bounce buffer or the shadow array is full, a read longer than what is
+   left of the buffer goes in pieces over several rounds. */
+static
+void DirectSubmit(romfs_aio_t *a, devio_t *io, size_t n)
+{
+    size_t k = 0, pos = 0;      // read being taken and bytes of it already taken
+
+    if (NULL == a->bounceMem) {
+        a->bounceLen = (AIO_BOUNCE_MAX + a->align - 1) & ~(size_t)(a->align - 1);
+        a->bounceMem = RomfsMalloc(a->bounceLen + a->align - 1);
+        if (NULL == a->bounceMem) {
+            for (k = 0; k < n; k++) io[k].ret = -ENOMEM;
+            return;
+        }
+
+        a->bounce = (uint8_t *)(((uintptr_t)a->bounceMem + a->align - 1) & ~(uintptr_t)(a->align - 1));
+    }
+
+    if (n > a->shadowCap) {
+        RomfsFree(a->shadow);
+        RomfsFree(a->piece);
+
+        a->shadowCap = n;
+        a->shadow = (devio_t *)RomfsMalloc(n * sizeof(devio_t));
+        a->piece = (piece_t *)RomfsMalloc(n * sizeof(piece_t));
+
+        if (NULL == a->shadow || NULL == a->piece) {
+            RomfsFree(a->shadow);
+            RomfsFree(a->piece);
+            a->shadow = NULL;
+            a->piece = NULL;
+            a->shadowCap = 0;
+
+            for (k = 0; k < n; k++) io[k].ret = -ENOMEM;
+            return;
+        }
+    }
+
+    for (size_t j = 0; j < n; j++) io[j].ret = 0;
+
+    while (k < n) {
+        size_t m = 0, used = 0;
+
+        while (k < n && m < a->shadowCap) {
+            devio_t *s = &a->shadow[m];
+            piece_t *p = &a->piece[m];
+            uint64_t at = (uint64_t)io[k].off + pos;
+            uint64_t end = ((uint64_t)io[k].off + io[k].len + a->align - 1) & ~(uint64_t)(a->align - 1);
+
+            // aligned read would come back short instead of failing, nothing to read then
+            if ((uint64_t)io[k].off + io[k].len > a->fileSize) {
+                io[k++].ret = -EIO;
+                continue;
+            }
+
+            if (Aligned(a, &io[k])) {
+                *s = io[k];
+                p->k = k++;
+                p->dst = NULL;
+                m++;
+                continue;
+            }
+
+            if (used == a->bounceLen) break;
+
+            s->off = (uint32_t)(at & ~(uint64_t)(a->align - 1));
+            s->len = (size_t)(end - s->off);
+            if (s->len > a->bounceLen - used) s->len = a->bounceLen - used;
+            s->buf = a->bounce + used;
+            s->ret = 0;
+
+            p->k = k;
+            p->dst = io[k].buf + pos;
+            p->skip = (size_t)(at - s->off);
+            p->len = s->len - p->skip;
+            if (p->len > io[k].len - pos) p->len = io[k].len - pos;
+
+            used += s->len;
+            pos += p->len;
+            m++;
+
+            if (pos == io[k].len) {
+                k++;
+                pos = 0;
+            }
+        }
+
+        if (m != 0) Issue(a, a->shadow, m);
+
+        for (size_t j = 0; j < m; j++) {
+            const piece_t *p = &a->piece[j];
+            devio_t *r = &io[p->k];
+
+            if (r->ret < 0) continue;
+            if (a->shadow[j].ret < 0) {
+                r->ret = a->shadow[j].ret;
+                continue;
+            }
+            if (NULL == p->dst) continue;
+
+            memcpy(p->dst, a->shadow[j].buf + p->skip, p->len);
+            a->bounced += p->len;
+        }
+    }
+}
+
+/** public functions **/
+
+int RomfsAioInit(int fd, const romfs_opts_t *opts, size_t *size, romfs_aio_t **aio)
+{
+#if AIO_POSIX
+    uint32_t depth = opts->fdQueueDepth != 0 ? opts->fdQueueDepth : AIO_QUEUE_DEPTH;
+    uint32_t threads = opts->fdThreads != 0 ? opts->fdThreads : AIO_THREADS_DEFAULT;
+    romfs_aio_t *a;
+    int ret = -ENOTSUP;
+
+    a = (romfs_aio_t *)RomfsMalloc(sizeof(romfs_aio_t));
+    if (NULL == a) return -ENOMEM;
+
+    memset(a, 0, sizeof(romfs_aio_t));
+    a->fd = fd;
+    a->direct = -1;
+    a->align = 1;
+    a->fileSize = FileSize(fd);
+#if AIO_URING
+    a->ring.fd = -1;
+#endif
+
+    if (*size == 0) *size = (size_t)a->fileSize;
+
+    if (opts->flags & ROMFS_OPT_FD_DIRECT) {
+#if AIO_DIRECT
+        a->direct = DirectOpen(fd);
+        if (a->direct < 0) {
+            ret = -errno;
+            RomfsAioFree(a);
+            return ret;
+        }
+
+        a->fd = a->direct;
+        a->align = DirectAlign(a->direct);
+        ret = -ENOTSUP;
+#else
+        RomfsAioFree(a);
+        return -ENOTSUP;
+#endif
+    }
+
+#if AIO_URING
+    if (!(opts->flags & ROMFS_OPT_FD_NO_URING)) {
+        ret = UringInit(&a->ring, depth);
+        if (ret < 0) {
+            ROMFS_TRACE("io_uring not available (%d), reading with pread", ret);
+            UringFree(&a->ring);
+        }
+    }
+#else
+    (void)depth;
+#endif
+
+#if AIO_THREADS
+    a->threads = threads;
+    if (ret < 0) {
+        ret = PoolInit(a, threads);
+        if (ret < 0) { RomfsAioFree(a); return ret; }
+    }
+#else
+    (void)threads;
+    (void)ret;
+#endif
+
+    *aio = a;
+
+    return 0;
+#else
+    (void)fd; (void)opts; (void)size; (void)aio;
+
+    return -ENOTSUP;
+#endif
+}
+
+void RomfsAioSubmit(romfs_aio_t *aio, devio_t *io, size_t n)
+{
+    if (aio->align > 1) {
+        DirectSubmit(aio, io, n);
+    } else {
+        Issue(aio, io, n);
+    }
+}
+
+uint32_t RomfsAioAlign(const romfs_aio_t *aio)
+{
+    return aio->align;
+}
+
+void RomfsAioStats(const romfs_aio_t *aio, romfs_stats_t *stats)
+{
+#if AIO_URING
+    stats->fdUring = aio->ring.fd >= 0;
+#endif
+    stats->fdDirectAlign = aio->align > 1 ? aio->align : 0;
+    stats->fdBounceBytes = aio->bounced;
+}
+
+void RomfsAioFree(romfs_aio_t *aio)
+{
+    if (NULL == aio) return;
+
+#if AIO_URING
+    UringFree(&aio->ring);
+#endif
+#if AIO_THREADS
+    PoolFree(aio);
+#endif
+#if AIO_POSIX
+    if (aio->direct >= 0) close(aio->direct);
+#endif
+
+    RomfsFree(aio->bounceMem);
+    RomfsFree(aio->shadow);
+    RomfsFree(aio->piece);
+    RomfsFree(aio);
+}
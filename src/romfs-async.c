@@ -0,0 +1,346 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "romfs-internal.h"
+
+#if ROMFS_THREADS && defined(__GNUC__) && (defined(__unix__) || defined(__APPLE__))
+#   include <pthread.h>
+#   include <unistd.h>
+#   define ASYNC_THREADS 1
+#endif
+
+#if ASYNC_THREADS && defined(__linux__)
+#   include <sys/eventfd.h>
+#   define ASYNC_EVENTFD 1
+#endif
+
+/* Background fetches for non-blocking reads.
+ *
+ * A read of a device image through a ROMFS_O_FLAGS_NONBLOCK handle copies only what the
+ * block cache has. When the cache has nothing at the read position, the range is queued
+ * here and the read fails with -EAGAIN. A worker thread, started on first use, reads queued
+ * ranges into the cache. Every finished fetch makes the eventfd of RomfsEventFd readable,
+ * and fetches of reads that got -EAGAIN call opts.ready with the inode and the result. So
+ * callers wait in poll or epoll, or for the callback, and read again. Readahead of such
+ * handles is queued the same way, behind the reads.
+ *
+ * A fetch that fails is remembered by its offset, the next non-blocking read there gets the
+ * error instead of another -EAGAIN. When the queue is full a read still gets -EAGAIN and is
+ * remembered by its inode, the last one of each file. Once the queue has drained the worker
+ * fetches a block there, so that file is still told about. Callback images are read from the
+ * worker then, the callback must not care which thread calls it.
+ *
+ * Without threads nothing is queued and non-blocking reads block, like reads of regular
+ * files do on POSIX.
+ */
+
+#define ASYNC_QUEUE     64
+
+#if ASYNC_THREADS
+typedef struct {
+    uint32_t    ino;
+    uint32_t    off;        ///> Image offset
+    uint32_t    len;
+    int         notify;     ///> Fetch for a read that got -EAGAIN, 0 for readahead
+} asyncfetch_t;
+
+struct romfs_async_t {
+    const struct romfs_t *rm;
+    pthread_t   tid;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    asyncfetch_t queue[ASYNC_QUEUE];
+    uint32_t    head;
+    uint32_t    count;
+    asyncfetch_t cur;       ///> Fetch the worker is doing, valid when busy
+    int         busy;
+    int         quit;
+    int         efd;        ///> Completion eventfd, -1 until asked for
+    romfs_map_t failed;     ///> Image offset of a failed fetch -> errno
+    romfs_map_t pending;    ///> Inode -> image offset of a read that found the queue full
+    uint32_t    again;
+    uint32_t    fetches;
+};
+
+/* Moves one read that found the queue full into the queue. */
+static
+void Requeue(romfs_async_t *a)
+{
+    for (uint32_t i = 0; i <= a->pending.mask; i++) {
+        const mapslot_t *s = &a->pending.slots[i];
+        asyncfetch_t *f;
+
+        if (s->key == 0) continue;
+
+        f = &a->queue[(a->head + a->count++) % ASYNC_QUEUE];
+        f->ino = s->key;
+        f->off = (uint32_t)s->val;
+        f->len = a->rm->dev.blockSize;
+        f->notify = 1;
+        RomfsMapDel(&a->pending, f->ino);
+
+        return;
+    }
+}
+
+static
+void *Worker(void *arg)
+{
+    romfs_async_t *a = (romfs_async_t *)arg;
+    const romfs_opts_t *opts = &a->rm->opts;
+
+    pthread_mutex_lock(&a->mutex);
+
+    while (!a->quit) {
+        asyncfetch_t f;
+        uint64_t one = 1;
+        ssize_t n;
+        int ret;
+
+        if (a->count == 0 && a->pending.count != 0) Requeue(a);
+
+        if (a->count == 0) {
+            pthread_cond_wait(&a->work, &a->mutex);
+            continue;
+        }
+
+        f = a->queue[a->head];
+        a->head = (a->head + 1) % ASYNC_QUEUE;
+        a->count--;
+        a->cur = f;
+        a->busy = 1;
+        pthread_mutex_unlock(&a->mutex);
+
+        ret = RomfsDevFill(a->rm, f.off, f.len, !f.notify);
+
+        pthread_mutex_lock(&a->mutex);
+        a->busy = 0;
+        a->fetches++;
+
+        // a reader may have started waiting for it meanwhile
+        f.notify = a->cur.notify;
+
+        // recorded before anyone is woken, the read that follows finds it
+        if (ret < 0 && f.notify) RomfsMapPut(&a->failed, f.off, (uintptr_t)-ret);
+
+        if (f.notify && opts->ready != NULL) {
+            pthread_mutex_unlock(&a->mutex);
+            opts->ready(opts->readyCtx, f.ino, ret);
+            pthread_mutex_lock(&a->mutex);
+        }
+
+        if (a->efd >= 0) {
+            n = write(a->efd, &one, sizeof(one));
+            (void)n;
+        }
+    }
+
+    pthread_mutex_unlock(&a->mutex);
+
+    return NULL;
+}
+
+static
+romfs_async_t *Start(const struct romfs_t *rm)
+{
+    romfs_async_t *a = (romfs_async_t *)RomfsMalloc(sizeof(romfs_async_t));
+
+    if (NULL == a) return NULL;
+
+    memset(a, 0, sizeof(romfs_async_t));
+    a->rm = rm;
+    a->efd = -1;
+
+    if (RomfsMapInit(&a->failed, 8) == 0) {
+        if (pthread_mutex_init(&a->mutex, NULL) == 0) {
+            if (pthread_cond_init(&a->work, NULL) == 0) {
+                if (pthread_create(&a->tid, NULL, Worker, a) == 0) return a;
+
+                pthread_cond_destroy(&a->work);
+            }
+            pthread_mutex_destroy(&a->mutex);
+        }
+        RomfsMapFree(&a->failed);
+    }
+
+    RomfsFree(a);
+
+    return NULL;
+}
+
+/* Worker of the image, started on the first call. NULL if it can't be. */
+static
+romfs_async_t *Get(const struct romfs_t *rm)
+{
+    // started from otherwise read-only reads
+    romfs_dev_t *d = (romfs_dev_t *)&rm->dev;
+    romfs_async_t *a = __atomic_load_n(&d->async, __ATOMIC_ACQUIRE);
+
+    if (a != NULL) return a;
+
+    RomfsLock(&d->asyncLock);
+
+    a = d->async;
+    if (NULL == a) {
+        a = Start(rm);
+        __atomic_store_n(&d->async, a, __ATOMIC_RELEASE);
+    }
+
+    RomfsUnlock(&d->asyncLock);
+
+    return a;
+}
+
+static
+asyncfetch_t *Queued(romfs_async_t *a, uint32_t off)
+{
+    if (a->busy && a->cur.off == off) return &a->cur;
+
+    for (uint32_t k = 0; k < a->count; k++) {
+        asyncfetch_t *f = &a->queue[(a->head + k) % ASYNC_QUEUE];
+
+        if (f->off == off) return f;
+    }
+
+    return NULL;
+}
+#endif
+
+/** public functions **/
+
+#if ASYNC_THREADS
+
+/* Queues a fetch of [off, off + len) of file ino. Returns -EAGAIN, the error of a failed
+   fetch at off once, -ENOMEM when a full queue can't remember the read, or -ENOTSUP when
+   there is no worker. */
+int RomfsAsyncQueue(const struct romfs_t *rm, uint32_t ino, uint32_t off, uint32_t len, int notify)
+{
+    romfs_async_t *a = Get(rm);
+    asyncfetch_t *f;
+    uintptr_t err;
+    int ret = -EAGAIN;
+
+    if (NULL == a) return -ENOTSUP;
+
+    pthread_mutex_lock(&a->mutex);
+
+    if (notify && RomfsMapGet(&a->failed, off, &err) == 0) {
+        RomfsMapDel(&a->failed, off);
+        pthread_mutex_unlock(&a->mutex);
+        return -(int)err;
+    }
+
+    f = Queued(a, off);
+    if (f != NULL) {
+        // readahead a reader now waits for
+        f->notify |= notify;
+    } else if (a->count < ASYNC_QUEUE) {
+        f = &a->queue[(a->head + a->count++) % ASYNC_QUEUE];
+        f->ino = ino;
+        f->off = off;
+        f->len = len;
+        f->notify = notify;
+        pthread_cond_signal(&a->work);
+    } else if (notify && RomfsMapPut(&a->pending, ino, off) < 0) {
+        ret = -ENOMEM;
+    }
+
+    if (notify) a->again++;
+
+    pthread_mutex_unlock(&a->mutex);
+
+    return ret;
+}
+
+void RomfsAsyncStats(const struct romfs_t *rm, romfs_stats_t *stats)
+{
+    romfs_async_t *a = __atomic_load_n(&rm->dev.async, __ATOMIC_ACQUIRE);
+
+    if (NULL == a) return;
+
+    pthread_mutex_lock(&a->mutex);
+    stats->asyncAgain   = a->again;
+    stats->asyncFetches = a->fetches;
+    pthread_mutex_unlock(&a->mutex);
+}
+
+void RomfsAsyncFree(romfs_dev_t *d)
+{
+    romfs_async_t *a = d->async;
+
+    if (NULL == a) return;
+
+    pthread_mutex_lock(&a->mutex);
+    a->quit = 1;
+    pthread_cond_signal(&a->work);
+    pthread_mutex_unlock(&a->mutex);
+
+    pthread_join(a->tid, NULL);
+
+    if (a->efd >= 0) close(a->efd);
+    pthread_cond_destroy(&a->work);
+    pthread_mutex_destroy(&a->mutex);
+    RomfsMapFree(&a->failed);
+    RomfsMapFree(&a->pending);
+    RomfsFree(a);
+
+    d->async = NULL;
+}
+
+int RomfsEventFd(romfs_t t)
+{
+#if ASYNC_EVENTFD
+    romfs_async_t *a;
+    int ret;
+
+    if (NULL == t) return -EINVAL;
+
+    // images in memory never wait
+    if (t->img != NULL) return -ENOTSUP;
+
+    a = Get(t);
+    if (NULL == a) return -ENOMEM;
+
+    pthread_mutex_lock(&a->mutex);
+
+    if (a->efd < 0) a->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ret = a->efd >= 0 ? a->efd : -errno;
+
+    pthread_mutex_unlock(&a->mutex);
+
+    return ret;
+#else
+    if (NULL == t) return -EINVAL;
+
+    return -ENOTSUP;
+#endif
+}
+
+#else
+
+int RomfsAsyncQueue(const struct romfs_t *rm, uint32_t ino, uint32_t off, uint32_t len, int notify)
+{
+    (void)rm; (void)ino; (void)off; (void)len; (void)notify;
+
+    return -ENOTSUP;
+}
+
+void RomfsAsyncStats(const struct romfs_t *rm, romfs_stats_t *stats)
+{
+    (void)rm; (void)stats;
+}
+
+void RomfsAsyncFree(romfs_dev_t *d)
+{
+    (void)d;
+}
+
+int RomfsEventFd(romfs_t t)
+{
+    if (NULL == t) return -EINVAL;
+
+    return -ENOTSUP;
+}
+
+#endif
@@ -0,0 +1,350 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+
+#include "romfs-internal.h"
+
+/* Batched lookups and reads.
+ *
+ * Paths are sorted, so paths sharing a prefix come one after another. Every directory on
+ * the current path is kept on a stack with the result of its step, next path reuses the
+ * levels its prefix matches and walks only the rest. A prefix that failed fails all its
+ * paths without another search.
+ *
+ * Reads are sorted by their position in the image and done in one forward sweep. Images in
+ * memory are just copied. On device images, requests whose regions touch or overlap are
+ * merged into a run and each run is one read through the block cache: straight into the
+ * buffer of a request that has the run to itself, into scratch memory otherwise, and every
+ * request of the run is copied out of it. Device reads of all runs go out in shared batches.
+ */
+
+#define BATCH_MAX_LEVELS  (MAX_PATH_LEN / 2 + 1)
+
+typedef struct {
+    const char  *path;
+    size_t      idx;        ///> Position in the caller's array
+} batchpath_t;
+
+typedef struct {
+    const char  *name;      ///> Component, points into one of the caller's paths
+    size_t      len;
+    int         ret;        ///> Result of the step into this level
+    nodehdr_t   node;
+} batchlevel_t;
+
+typedef struct {
+    uint32_t    start;      ///> Image offset of the first byte
+    uint32_t    len;
+    size_t      idx;        ///> Position in the caller's array
+} batchread_t;
+
+typedef struct {
+    romfs_stat_t *stats;
+    int          *results;
+} statctx_t;
+
+typedef struct {
+    int          *fds;
+    int          flags;
+} openctx_t;
+
+/* Called for every path, in sorted order. nd is valid when ret >= 0. Returns the result
+   stored for the path. */
+typedef int (*batch_done_t)(struct romfs_t *rm, size_t idx, const nodehdr_t *nd, int ret, void *ctx);
+
+static
+int CmpPath(const void *a, const void *b)
+{
+    return strcmp(((const batchpath_t *)a)->path, ((const batchpath_t *)b)->path);
+}
+
+static
+int CmpRead(const void *a, const void *b)
+{
+    const batchread_t *x = (const batchread_t *)a, *y = (const batchread_t *)b;
+
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+
+    // equal starts keep the caller's order, qsort is not stable
+    return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+static
+int WalkShared(const struct romfs_t *rm, const char *path, const nodehdr_t *root,
+               batchlevel_t *lvl, size_t *depth, nodehdr_t *nd)
+{
+    path_walk_t w;
+    namekey_t key;
+    size_t d = 0;
+    int ret;
+
+    ret = UtilsPathWalkInit(&w, path, MAX_PATH_LEN);
+    if (ret < 0) return ret;
+
+    *nd = *root;
+
+    while ((ret = UtilsPathWalkNext(&w)) > 0) {
+        if (d < *depth && lvl[d].len == w.len && memcmp(lvl[d].name, w.name, w.len) == 0) {
+            ret = lvl[d].ret;
+            *nd = lvl[d].node;
+        } else {
+            RomfsNameKeyInit(&key, w.name, w.len);
+            ret = RomfsWalkStep(rm, &key, nd);
+
+            // paths diverged here, deeper levels belong to the previous path
+            lvl[d].name = w.name;
+            lvl[d].len  = w.len;
+            lvl[d].ret  = ret;
+            lvl[d].node = *nd;
+            *depth = d + 1;
+        }
+
+        d++;
+        if (ret < 0) return ret;
+    }
+
+    if (ret < 0) return ret;
+
+    return RomfsWalkFinish(rm, nd);
+}
+
+static
+int ResolveMany(struct romfs_t *rm, int fd, const char *const *paths, size_t count, batch_done_t done, void *ctx)
+{
+    batchpath_t *order;
+    batchlevel_t *lvl;
+    nodehdr_t root, nd;
+    size_t depth = 0;
+    fildes_t *f;
+    int ret, ok = 0;
+
+    if (NULL == rm || NULL == paths) return -EINVAL;
+
+    f = RomfsFdGet(&rm->fdt, fd - RESVD_FDS);
+    if (NULL == f) return -EBADF;
+
+    ret = RomfsGetNodeHdr(rm, f->file.ino, &root);
+    if (ret < 0) return ret;
+
+    order = (batchpath_t *)RomfsMalloc(count * sizeof(batchpath_t) + BATCH_MAX_LEVELS * sizeof(batchlevel_t));
+    if (NULL == order) return -ENOMEM;
+    lvl = (batchlevel_t *)(order + count);
+
+    for (size_t i = 0; i < count; i++) {
+        order[i].path = paths[i] != NULL ? paths[i] : "";
+        order[i].idx = i;
+    }
+
+    qsort(order, count, sizeof(batchpath_t), CmpPath);
+
+    for (size_t i = 0; i < count; i++) {
+        ret = paths[order[i].idx] != NULL ? WalkShared(rm, order[i].path, &root, lvl, &depth, &nd) : -EINVAL;
+
+        if (done(rm, order[i].idx, &nd, ret, ctx) >= 0) ok++;
+    }
+
+    RomfsFree(order);
+
+    return ok;
+}
+
+static
+int StatDone(struct romfs_t *rm, size_t idx, const nodehdr_t *nd, int ret, void *ctx)
+{
+    statctx_t *c = (statctx_t *)ctx;
+
+    if (ret >= 0) {
+        if (c->stats != NULL) {
+            c->stats[idx].ino    = nd->off;
+            c->stats[idx].chksum = nd->chksum;
+            c->stats[idx].size   = nd->size;
+            c->stats[idx].mode   = nd->mode;
+        }
+        ret = nd->mode;
+    }
+
+    return c->results[idx] = ret;
+}
+
+static
+int OpenDone(struct romfs_t *rm, size_t idx, const nodehdr_t *nd, int ret, void *ctx)
+{
+    openctx_t *c = (openctx_t *)ctx;
+
+    return c->fds[idx] = ret >= 0 ? RomfsOpenNode(rm, nd, c->flags) : ret;
+}
+
+static
+int ReadPrepare(struct romfs_t *rm, const romfs_readreq_t *req, batchread_t *rd)
+{
+    const romfs_file_t *file;
+    romfs_file_t tmp;
+    nodehdr_t node;
+    fildes_t *f;
+    uint32_t avail;
+    int ret;
+
+    if (NULL == req->buf) return -EINVAL;
+
+    if (req->fd >= 0) {
+        f = RomfsFdGet(&rm->fdt, req->fd - RESVD_FDS);
+        if (NULL == f) return -EBADF;
+        file = &f->file;
+    } else {
+        ret = RomfsFindIno(rm, req->ino, &node);
+        if (ret < 0) return ret;
+        RomfsFileInit(&tmp, &node);
+        file = &tmp;
+    }
+
+    if (IS_DIRECTORY(file->mode)) {
+        return -EISDIR;
+    }
+
+    avail = req->off < file->size ? file->size - req->off : 0;
+
+    rd->start = file->dataOff + req->off;
+    rd->len = req->len < avail ? (uint32_t)req->len : avail;
+    if (rd->len > INT_MAX) rd->len = INT_MAX;
+
+    return RomfsVerityCheck(rm, file, req->off, rd->len);
+}
+
+/* Device image reads of a sweep, in image order. Returns the number that failed. */
+static
+int ReadDev(struct romfs_t *rm, romfs_readreq_t *reqs, const batchread_t *order, size_t n)
+{
+    size_t runs = 0, scratch = 0, used = 0;
+    uint8_t *buf = NULL;
+    size_t *first;
+    devio_t *io;
+    int failed = 0;
+
+    if (n == 0) return 0;
+
+    io = (devio_t *)RomfsMalloc(n * sizeof(devio_t));
+    first = (size_t *)RomfsMalloc((n + 1) * sizeof(size_t));
+
+    for (size_t i = 0, j; io != NULL && first != NULL && i < n; i = j, runs++) {
+        uint32_t end = order[i].start + order[i].len;
+
+        // extend the run while the next region touches it
+        for (j = i + 1; j < n && order[j].start <= end; j++) {
+            if (order[j].start + order[j].len > end) end = order[j].start + order[j].len;
+        }
+
+        io[runs].off = order[i].start;
+        io[runs].len = end - order[i].start;
+        first[runs] = i;
+        if (j - i > 1) scratch += io[runs].len;
+    }
+
+    if (scratch != 0) buf = (uint8_t *)RomfsMalloc(scratch);
+
+    if (NULL == io || NULL == first || (scratch != 0 && NULL == buf)) {
+        for (size_t k = 0; k < n; k++) reqs[order[k].idx].ret = -ENOMEM;
+        RomfsFree(io);
+        RomfsFree(first);
+        return (int)n;
+    }
+
+    first[runs] = n;
+
+    // run of one request is read straight into its buffer, shared runs into scratch
+    for (size_t i = 0; i < runs; i++) {
+        if (first[i + 1] - first[i] == 1) {
+            io[i].buf = (uint8_t *)reqs[order[first[i]].idx].buf;
+        } else {
+            io[i].buf = buf + used;
+            used += io[i].len;
+        }
+    }
+
+    RomfsDevReadMany(rm, io, runs);
+
+    for (size_t i = 0; i < runs; i++) {
+        for (size_t k = first[i]; k < first[i + 1]; k++) {
+            romfs_readreq_t *req = &reqs[order[k].idx];
+
+            if (io[i].ret < 0) {
+                req->ret = io[i].ret;
+                failed++;
+                continue;
+            }
+
+            if (io[i].buf != req->buf) memcpy(req->buf, io[i].buf + (order[k].start - io[i].off), order[k].len);
+            req->ret = (int)order[k].len;
+        }
+    }
+
+    RomfsFree(buf);
+    RomfsFree(first);
+    RomfsFree(io);
+
+    return failed;
+}
+
+/** public functions **/
+
+int RomfsStatMany(romfs_t t, int fd, const char *const *paths, size_t count, romfs_stat_t *stats, int *results)
+{
+    statctx_t ctx = { stats, results };
+
+    if (NULL == results) return -EINVAL;
+
+    return ResolveMany(t, fd, paths, count, StatDone, &ctx);
+}
+
+int RomfsOpenMany(romfs_t t, int fd, const char *const *paths, size_t count, int flags, int *fds)
+{
+    openctx_t ctx = { fds, flags };
+
+    if (NULL == fds) return -EINVAL;
+
+    return ResolveMany(t, fd, paths, count, OpenDone, &ctx);
+}
+
+int RomfsReadMany(romfs_t t, romfs_readreq_t *reqs, size_t count)
+{
+    batchread_t *order;
+    size_t n = 0;
+    int ok = 0;
+
+    if (NULL == t || NULL == reqs) return -EINVAL;
+
+    order = (batchread_t *)RomfsMalloc(count * sizeof(batchread_t));
+    if (NULL == order && count != 0) return -ENOMEM;
+
+    for (size_t i = 0; i < count; i++) {
+        reqs[i].ret = ReadPrepare(t, &reqs[i], &order[n]);
+        if (reqs[i].ret < 0) continue;
+
+        ok++;
+        if (order[n].len == 0) continue;    // nothing to copy, ret is already 0
+
+        order[n].idx = i;
+        n++;
+    }
+
+    qsort(order, n, sizeof(batchread_t), CmpRead);
+
+    if (NULL == t->img) {
+        ok -= ReadDev(t, reqs, order, n);
+        RomfsFree(order);
+        return ok;
+    }
+
+    for (size_t k = 0; k < n; k++) {
+        romfs_readreq_t *req = &reqs[order[k].idx];
+
+        memcpy(req->buf, t->img + order[k].start, order[k].len);
+        req->ret = (int)order[k].len;
+    }
+
+    RomfsFree(order);
+
+    return ok;
+}
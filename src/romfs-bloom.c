@@ -0,0 +1,195 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "romfs-internal.h"
+
+/* Per-directory Bloom filters.
+ *
+ * Each directory chain gets a small bit set of its names, so a search for a name that is
+ * not there is answered without reading a single sibling header. Positive answers can be
+ * false, those fall through to the regular search.
+ *
+ * Eager mode builds filters for the whole tree in RomfsLoad and is read-only afterwards.
+ * Lazy mode builds a chain's filter on its first search. The chain is walked without the bloom
+ * lock, which only covers the map, a thread that loses the race to insert frees its copy.
+ * Filters take only a few bytes per name and are never evicted or changed once inserted, so
+ * they are tested unlocked.
+ */
+
+#define BLOOM_DEFAULT_BITS  10
+#define BLOOM_MAX_PROBES    16
+
+static inline
+uint32_t BloomStep(uint32_t h)
+{
+    // second hash for double hashing, odd so every bit can be reached
+    return ((h >> 16) | (h << 16)) * 0x85EBCA6Bu | 1;
+}
+
+static
+int BloomChain(const struct romfs_t *rm, uint32_t head, dirbloom_t **out)
+{
+    uint32_t bitsPerName = rm->opts.bloomBits ? rm->opts.bloomBits : BLOOM_DEFAULT_BITS;
+    uint32_t count = 0, bits = 64, limit = (uint32_t)(rm->vol.size / ROMFS_ALIGNMENT);
+    nodehdr_t node;
+    dirbloom_t *b;
+    uint32_t off;
+    size_t size;
+    int ret;
+
+    for (off = head; off != 0; off = node.next) {
+        ret = RomfsGetNodeHdr(rm, off, &node);
+        if (ret < 0) return ret;
+        if (++count > limit) return -ELOOP;
+    }
+
+    while (bits < count * bitsPerName) bits <<= 1;
+
+    size = sizeof(dirbloom_t) + bits / 8;
+    b = (dirbloom_t *)RomfsMalloc(size);
+    if (NULL == b) return -ENOMEM;
+
+    memset(b, 0, size);
+    b->mask = bits - 1;
+
+    // optimal probe count is bits/names * ln 2
+    b->probes = (uint32_t)((uint64_t)bits * 693 / (1000ull * count));
+    if (b->probes == 0) b->probes = 1;
+    if (b->probes > BLOOM_MAX_PROBES) b->probes = BLOOM_MAX_PROBES;
+
+    for (off = head; off != 0; off = node.next) {
+        uint32_t h, step;
+
+        ret = RomfsGetNodeHdr(rm, off, &node);
+        if (ret < 0) { RomfsFree(b); return ret; }
+
+        h = RomfsNameHash(node.name, RomfsNameLen(node.name, rm->size - off - FILEHDR_NAME_OFF));
+        step = BloomStep(h);
+
+        for (uint32_t i = 0; i < b->probes; i++, h += step) {
+            b->bits[(h & b->mask) >> 6] |= 1ull << (h & 63);
+        }
+    }
+
+    *out = b;
+    return 0;
+}
+
+static
+int BloomInsert(romfs_bloom_t *bl, uint32_t head, dirbloom_t *b)
+{
+    int ret;
+
+    ret = RomfsMapPut(&bl->dirs, head, (uintptr_t)b);
+    if (ret < 0) return ret;
+
+    bl->bytes += sizeof(dirbloom_t) + (b->mask + 1) / 8;
+
+    return 0;
+}
+
+static
+int BloomAdd(const struct romfs_t *rm, romfs_bloom_t *bl, uint32_t head)
+{
+    dirbloom_t *b;
+    int ret;
+
+    ret = BloomChain(rm, head, &b);
+    if (ret < 0) return ret;
+
+    ret = BloomInsert(bl, head, b);
+    if (ret < 0) RomfsFree(b);
+
+    return ret;
+}
+
+static
+int BloomTest(const dirbloom_t *b, uint32_t h)
+{
+    uint32_t step = BloomStep(h);
+
+    for (uint32_t i = 0; i < b->probes; i++, h += step) {
+        if (!(b->bits[(h & b->mask) >> 6] & (1ull << (h & 63)))) return BLOOM_ABSENT;
+    }
+
+    return BLOOM_MAYBE;
+}
+
+static
+int VisitBloom(const struct romfs_t *rm, const nodehdr_t *nd, uint32_t head, void *ctx)
+{
+    // one filter per chain, built when the walk enters it
+    if (nd->off != head) return 0;
+
+    return BloomAdd(rm, (romfs_bloom_t *)ctx, head);
+}
+
+/** public functions **/
+
+int RomfsBloomBuild(struct romfs_t *rm)
+{
+    int ret;
+
+    ret = RomfsMapInit(&rm->bloom.dirs, 16);
+    if (ret < 0) return ret;
+
+    if (!(rm->opts.flags & ROMFS_OPT_DIR_BLOOM)) return 0;
+
+    ret = RomfsTreeWalk(rm, VisitBloom, &rm->bloom);
+
+    ROMFS_TRACE("bloom: %u dirs, %zu bytes", rm->bloom.dirs.count, rm->bloom.bytes);
+
+    return ret;
+}
+
+int RomfsBloomCheck(const struct romfs_t *rm, const namekey_t *k, uint32_t head)
+{
+    // lazy mode fills filters from otherwise read-only lookups
+    romfs_bloom_t *bl = (romfs_bloom_t *)&rm->bloom;
+    dirbloom_t *b;
+    uintptr_t val;
+    int ret;
+
+    if (rm->opts.flags & ROMFS_OPT_DIR_BLOOM) {
+        if (RomfsMapGet(&bl->dirs, head, &val) != 0) return BLOOM_NONE;
+        return BloomTest((const dirbloom_t *)val, k->hash);
+    }
+
+    RomfsLock(&bl->lock);
+    ret = RomfsMapGet(&bl->dirs, head, &val);
+    RomfsUnlock(&bl->lock);
+
+    if (ret == 0) return BloomTest((const dirbloom_t *)val, k->hash);
+
+    // chain walk may read the device, the filter is built unlocked
+    if (BloomChain(rm, head, &b) < 0) return BLOOM_NONE;
+
+    RomfsLock(&bl->lock);
+
+    if (RomfsMapGet(&bl->dirs, head, &val) == 0) {
+        // other thread was first
+        RomfsFree(b);
+        b = (dirbloom_t *)val;
+    } else if (BloomInsert(bl, head, b) < 0) {
+        RomfsUnlock(&bl->lock);
+        RomfsFree(b);
+        return BLOOM_NONE;
+    }
+
+    RomfsUnlock(&bl->lock);
+
+    return BloomTest(b, k->hash);
+}
+
+void RomfsBloomFree(romfs_bloom_t *b)
+{
+    for (uint32_t i = 0; b->dirs.slots != NULL && i <= b->dirs.mask; i++) {
+        if (b->dirs.slots[i].key != 0) {
+            RomfsFree((void *)b->dirs.slots[i].val);
+        }
+    }
+
+    RomfsMapFree(&b->dirs);
+    b->bytes = 0;
+}
@@ -0,0 +1,145 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "romfs-internal.h"
+
+/* Resolved path cache.
+ *
+ * Maps (start offset, path) to the final header of a successful lookup, hardlinks already
+ * followed. Callers pass the path hash in, compiled paths have it precomputed. Image never
+ * changes, so entries never go stale, they only get evicted when the cache is full. Eviction
+ * is second chance: a clock hand goes round the entries, one hit since its last pass spares
+ * an entry once. A hit only sets that bit in its own entry, it does not reorder anything
+ * shared. Failed lookups are not cached.
+ */
+
+static inline
+uint32_t DentryHash(uint32_t start, uint32_t pathHash)
+{
+    return pathHash ^ ((start >> 4) * 2654435761u);
+}
+
+static
+void BucketUnlink(dcache_t *dc, uint32_t i)
+{
+    uint32_t *p = &dc->bucket[dc->ent[i].hash & dc->mask];
+
+    while (*p != i) p = &dc->ent[*p].chain;
+    *p = dc->ent[i].chain;
+}
+
+static
+uint32_t DentryFind(const dcache_t *dc, uint32_t h, uint32_t start, const char *path, size_t len)
+{
+    for (uint32_t i = dc->bucket[h & dc->mask]; i != DENTRY_NONE; i = dc->ent[i].chain) {
+        const dentry_t *e = &dc->ent[i];
+
+        if (e->hash == h && e->start == start && e->len == len && memcmp(e->path, path, len) == 0) {
+            return i;
+        }
+    }
+
+    return DENTRY_NONE;
+}
+
+/** public functions **/
+
+int RomfsDcacheInit(dcache_t *dc, uint32_t size)
+{
+    uint32_t buckets = 1;
+
+    while (buckets < size) buckets <<= 1;
+
+    memset(dc, 0, sizeof(dcache_t));
+
+    dc->ent = (dentry_t *)RomfsMalloc(size * sizeof(dentry_t));
+    dc->bucket = (uint32_t *)RomfsMalloc(buckets * sizeof(uint32_t));
+    if (NULL == dc->ent || NULL == dc->bucket) {
+        RomfsDcacheFree(dc);
+        return -ENOMEM;
+    }
+
+    memset(dc->bucket, 0xFF, buckets * sizeof(uint32_t));
+    dc->size = size;
+    dc->mask = buckets - 1;
+
+    return 0;
+}
+
+void RomfsDcacheFree(dcache_t *dc)
+{
+    RomfsFree(dc->ent);
+    RomfsFree(dc->bucket);
+    memset(dc, 0, sizeof(dcache_t));
+}
+
+int RomfsDcacheGet(const struct romfs_t *rm, uint32_t start, const char *path, size_t len, uint32_t hash, nodehdr_t *nd)
+{
+    // cache is filled from otherwise read-only lookups
+    dcache_t *dc = (dcache_t *)&rm->dcache;
+    uint32_t h = DentryHash(start, hash);
+    uint32_t i;
+
+    RomfsLock(&dc->lock);
+
+    i = DentryFind(dc, h, start, path, len);
+    if (i == DENTRY_NONE) {
+        dc->misses++;
+        RomfsUnlock(&dc->lock);
+        return -ENOENT;
+    }
+
+    dc->hits++;
+    *nd = dc->ent[i].node;
+
+    // written only when clear, repeated hits leave the entry's line clean
+    if (!dc->ent[i].ref) dc->ent[i].ref = 1;
+
+    RomfsUnlock(&dc->lock);
+
+    return 0;
+}
+
+void RomfsDcachePut(const struct romfs_t *rm, uint32_t start, const char *path, size_t len, uint32_t hash, const nodehdr_t *nd)
+{
+    dcache_t *dc = (dcache_t *)&rm->dcache;
+    uint32_t h = DentryHash(start, hash);
+    uint32_t i;
+
+    if (len >= MAX_PATH_LEN) return;
+
+    RomfsLock(&dc->lock);
+
+    // somebody else resolved the same path meanwhile
+    if (DentryFind(dc, h, start, path, len) != DENTRY_NONE) {
+        RomfsUnlock(&dc->lock);
+        return;
+    }
+
+    if (dc->used < dc->size) {
+        i = dc->used++;
+    } else {
+        while (dc->ent[dc->hand].ref) {
+            dc->ent[dc->hand].ref = 0;
+            dc->hand = dc->hand + 1 < dc->size ? dc->hand + 1 : 0;
+        }
+
+        i = dc->hand;
+        dc->hand = dc->hand + 1 < dc->size ? dc->hand + 1 : 0;
+        BucketUnlink(dc, i);
+        dc->evictions++;
+    }
+
+    dc->ent[i].start = start;
+    dc->ent[i].hash  = h;
+    dc->ent[i].len   = (uint32_t)len;
+    dc->ent[i].ref   = 0;
+    dc->ent[i].node  = *nd;
+    memcpy(dc->ent[i].path, path, len);
+
+    dc->ent[i].chain = dc->bucket[h & dc->mask];
+    dc->bucket[h & dc->mask] = i;
+
+    RomfsUnlock(&dc->lock);
+}
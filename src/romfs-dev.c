@@ -0,0 +1,798 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "romfs-internal.h"
+
+#if ROMFS_THREADS && defined(__GNUC__) && (defined(__unix__) || defined(__APPLE__))
+#   include <pthread.h>
+#   define DEV_THREADS 1
+#endif
+
+/* Device images.
+ *
+ * Image is read through the caller's callback, or from a file by RomfsLoadFd, instead of
+ * being addressed in memory. Data goes through an LRU cache of fixed size blocks. Runs of
+ * whole blocks not in the cache are read straight into the caller's buffer.
+ *
+ * Reads are planned before any is issued: blocks missing from the cache are claimed and the
+ * device reads they need are collected into a batch, up to DEV_BATCH of them, and submitted
+ * together. A file reader keeps all of a batch in flight at once, a callback gets one call
+ * per read. Batched multi-file reads plan all their requests into the same batches. Claimed
+ * blocks are kept off the LRU list until the batch is done, later claims can't evict them.
+ *
+ * The cache lock only covers planning and publishing, it is dropped while a batch is read.
+ * Blocks the batch fills are marked busy meanwhile, other readers hit the rest of the cache
+ * freely. A reader that needs a busy block of another batch, or finds every block pinned,
+ * flushes its own batch and sleeps on the device lock, which serializes device reads.
+ *
+ * Cursor reads of a file read ahead. A read that continues where the previous one on the
+ * same handle ended is sequential. Once such a reader gets within half a window of the data
+ * read ahead, the window doubles, up to raMax, and the next one past the data read ahead is
+ * fetched in one round. A read anywhere else halves the window. Blocks read ahead that get
+ * evicted before anyone reads them are counted as wasted.
+ *
+ * Non-blocking reads copy only the blocks the cache has at the read position. The rest is
+ * left to the background fetches of romfs-async.c, which fill it straight into cache blocks. On verified images the fetch
+ * covers the whole verity blocks around the read, the check that follows hashes them.
+ *
+ * Decoded headers hand out pointers to their names, which callers keep, e.g. in directory
+ * entries. So every header read from the device is copied with its name into an arena and
+ * stays there until unload. Names are zero padded in the arena, block compares of names
+ * may read past the terminating NUL.
+ */
+
+#if DEV_THREADS
+static
+void *IoInit(void)
+{
+    pthread_mutex_t *m = (pthread_mutex_t *)RomfsMalloc(sizeof(pthread_mutex_t));
+
+    if (m != NULL && pthread_mutex_init(m, NULL) != 0) {
+        RomfsFree(m);
+        m = NULL;
+    }
+
+    return m;
+}
+
+#   define IoLock(d)    pthread_mutex_lock((pthread_mutex_t *)(d)->io)
+#   define IoUnlock(d)  pthread_mutex_unlock((pthread_mutex_t *)(d)->io)
+#   define IoFree(d)    pthread_mutex_destroy((pthread_mutex_t *)(d)->io)
+#else
+static
+void *IoInit(void)
+{
+    romfs_lock_t *l = (romfs_lock_t *)RomfsMalloc(sizeof(romfs_lock_t));
+
+    if (l != NULL) *l = 0;
+
+    return l;
+}
+
+#   define IoLock(d)    RomfsLock((romfs_lock_t *)(d)->io)
+#   define IoUnlock(d)  RomfsUnlock((romfs_lock_t *)(d)->io)
+#   define IoFree(d)    ((void)(d))
+#endif
+
+/* Arena space for a name of len bytes, enough for any block compare or length scan. */
+static inline
+size_t NamePad(size_t len)
+{
+    size_t n = (len + 1 + 31) & ~(size_t)31;
+
+    return n < NAMEKEY_LEN ? NAMEKEY_LEN : n;
+}
+
+static
+uint8_t *ArenaAlloc(romfs_dev_t *d, size_t size)
+{
+    devchunk_t *c = d->arena;
+    uint8_t *p;
+
+    if (NULL == c || c->size - c->used < size) {
+        size_t cap = size > DEV_ARENA_CHUNK ? size : DEV_ARENA_CHUNK;
+
+        c = (devchunk_t *)RomfsMalloc(sizeof(devchunk_t) + cap);
+        if (NULL == c) return NULL;
+
+        memset(c->buf, 0, cap);
+        c->used = 0;
+        c->size = cap;
+        c->next = d->arena;
+        d->arena = c;
+        d->arenaBytes += sizeof(devchunk_t) + cap;
+    }
+
+    p = c->buf + c->used;
+    c->used += size;
+
+    return p;
+}
+
+static
+uint8_t *AllocAligned(size_t size, uint32_t align, void **raw)
+{
+    *raw = RomfsMalloc(size + align - 1);
+    if (NULL == *raw) return NULL;
+
+    return (uint8_t *)(((uintptr_t)*raw + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+static
+uint32_t BlockFind(const romfs_dev_t *d, uint32_t blk)
+{
+    for (uint32_t i = d->bucket[blk & d->mask]; i != DEV_BLOCK_NONE; i = d->blocks[i].chain) {
+        if (d->blocks[i].tag == blk + 1) return i;
+    }
+
+    return DEV_BLOCK_NONE;
+}
+
+static
+void LruUnlink(romfs_dev_t *d, uint32_t i)
+{
+    devblock_t *b = &d->blocks[i];
+
+    if (b->prev != DEV_BLOCK_NONE) d->blocks[b->prev].next = b->next; else d->head = b->next;
+    if (b->next != DEV_BLOCK_NONE) d->blocks[b->next].prev = b->prev; else d->tail = b->prev;
+}
+
+static
+void LruPushFront(romfs_dev_t *d, uint32_t i)
+{
+    devblock_t *b = &d->blocks[i];
+
+    b->prev = DEV_BLOCK_NONE;
+    b->next = d->head;
+    if (d->head != DEV_BLOCK_NONE) d->blocks[d->head].prev = i;
+    d->head = i;
+    if (d->tail == DEV_BLOCK_NONE) d->tail = i;
+}
+
+static
+void BucketUnlink(romfs_dev_t *d, uint32_t i)
+{
+    uint32_t *p = &d->bucket[(d->blocks[i].tag - 1) & d->mask];
+
+    while (*p != i) p = &d->blocks[*p].chain;
+    *p = d->blocks[i].chain;
+}
+
+/* Slot for a block about to be read, least recently used one is evicted. */
+static
+uint32_t BlockClaim(romfs_dev_t *d, uint32_t blk)
+{
+    uint32_t i;
+
+    if (d->used < d->count) {
+        i = d->used++;
+    } else {
+        i = d->tail;
+        LruUnlink(d, i);
+        if (d->blocks[i].tag != 0) BucketUnlink(d, i);
+        d->raWasted += d->blocks[i].ahead;
+    }
+
+    d->blocks[i].tag = blk + 1;
+    d->blocks[i].ahead = 0;
+    d->blocks[i].chain = d->bucket[blk & d->mask];
+    d->bucket[blk & d->mask] = i;
+    LruPushFront(d, i);
+
+    return i;
+}
+
+/* Cached block just read, moves to the front of the LRU list. */
+static
+void BlockUse(romfs_dev_t *d, uint32_t i)
+{
+    d->hits++;
+    d->blocks[i].ahead = 0;
+
+    if (d->head != i) {
+        LruUnlink(d, i);
+        LruPushFront(d, i);
+    }
+}
+
+/* Pinned block whose read failed, its slot goes first on the next claim. */
+static
+void BlockDrop(romfs_dev_t *d, uint32_t i)
+{
+    BucketUnlink(d, i);
+    d->blocks[i].tag = 0;
+    d->blocks[i].busy = 0;
+
+    d->blocks[i].prev = d->tail;
+    d->blocks[i].next = DEV_BLOCK_NONE;
+    if (d->tail != DEV_BLOCK_NONE) d->blocks[d->tail].next = i; else d->head = i;
+    d->tail = i;
+}
+
+/* Every block is pinned by a pending read, nothing left to claim. */
+static inline
+int NoSlot(const romfs_dev_t *d)
+{
+    return d->used == d->count && d->tail == DEV_BLOCK_NONE;
+}
+
+static inline
+size_t BlockLen(const struct romfs_t *rm, const romfs_dev_t *d, uint32_t blk)
+{
+    uint64_t start = (uint64_t)blk << d->shift;
+
+    // last block of the image may be short
+    return rm->size - start < d->blockSize ? (size_t)(rm->size - start) : d->blockSize;
+}
+
+typedef struct {
+    devio_t     io[DEV_BATCH];
+    devio_t     *req[DEV_BATCH];    ///> Request the read is for
+    uint32_t    slot[DEV_BATCH];    ///> Block the read fills, DEV_BLOCK_NONE if it goes to the request's buffer
+    uint32_t    in[DEV_BATCH];      ///> Block reads: part of the block the request wants
+    uint8_t     *out[DEV_BATCH];
+    size_t      outLen[DEV_BATCH];
+    size_t      n;
+} devbatch_t;
+
+/* Claims a block for a read of the batch. It stays off the LRU list and busy until the batch
+   is flushed, hits in between can't make it the next one evicted. */
+static
+uint32_t BlockPin(romfs_dev_t *d, uint32_t blk)
+{
+    uint32_t i = BlockClaim(d, blk);
+
+    LruUnlink(d, i);
+    d->blocks[i].busy = 1;
+
+    return i;
+}
+
+/* Issues reads of a batch, through the file reader or one callback call each. Called with
+   the cache lock held, it is dropped until the reads are done. */
+static
+void Submit(romfs_dev_t *d, devio_t *io, size_t n)
+{
+    if (n == 0) return;
+
+    d->reads += (uint32_t)n;
+    d->rounds++;
+
+    RomfsUnlock(&d->lock);
+    IoLock(d);
+
+    if (d->aio != NULL) {
+        RomfsAioSubmit(d->aio, io, n);
+    } else {
+        for (size_t k = 0; k < n; k++) {
+            io[k].ret = d->read(d->ctx, io[k].off, io[k].buf, io[k].len);
+        }
+    }
+
+    IoUnlock(d);
+    RomfsLock(&d->lock);
+}
+
+static
+void Flush(romfs_dev_t *d, devbatch_t *b)
+{
+    Submit(d, b->io, b->n);
+
+    for (size_t k = 0; k < b->n; k++) {
+        if (b->io[k].ret < 0) {
+            if (b->slot[k] != DEV_BLOCK_NONE) BlockDrop(d, b->slot[k]);
+            if (b->req[k]->ret == 0) b->req[k]->ret = b->io[k].ret;
+        } else if (b->slot[k] != DEV_BLOCK_NONE) {
+            d->blocks[b->slot[k]].busy = 0;
+            LruPushFront(d, b->slot[k]);
+            if (b->out[k] != NULL) memcpy(b->out[k], d->blocks[b->slot[k]].data + b->in[k], b->outLen[k]);
+        }
+    }
+
+    b->n = 0;
+}
+
+/* Makes room for a claim or waits for a busy block: flushes the batch, or when it is empty
+   waits for the reads of other batches. Those are done once the device lock is free, they
+   are published right after. */
+static
+void Settle(romfs_dev_t *d, devbatch_t *b)
+{
+    if (b->n != 0) {
+        Flush(d, b);
+        return;
+    }
+
+    RomfsUnlock(&d->lock);
+    IoLock(d);
+    IoUnlock(d);
+    RomfsLock(&d->lock);
+}
+
+static
+void Add(devbatch_t *b, devio_t *req, uint32_t off, uint8_t *buf, size_t len, uint32_t slot)
+{
+    size_t k = b->n++;
+
+    b->io[k].off = off;
+    b->io[k].buf = buf;
+    b->io[k].len = len;
+    b->io[k].ret = 0;
+    b->req[k] = req;
+    b->slot[k] = slot;
+    b->out[k] = NULL;
+}
+
+/* Copies what the cache has of a request, adds reads for the rest to the batch. */
+static
+void Plan(const struct romfs_t *rm, romfs_dev_t *d, devbatch_t *b, devio_t *req)
+{
+    uint32_t off = req->off;
+    uint8_t *out = req->buf;
+    size_t len = req->len;
+
+    while (len != 0) {
+        uint32_t blk = off >> d->shift;
+        uint32_t in = off & (d->blockSize - 1);
+        size_t n = d->blockSize - in < len ? d->blockSize - in : len;
+        uint32_t i;
+
+        if (b->n == DEV_BATCH) Flush(d, b);
+
+        // being read, by this batch or another one
+        i = BlockFind(d, blk);
+        if (i != DEV_BLOCK_NONE && d->blocks[i].busy) {
+            Settle(d, b);
+            continue;
+        }
+
+        if (i != DEV_BLOCK_NONE) {
+            BlockUse(d, i);
+            memcpy(out, d->blocks[i].data + in, n);
+        } else if (in == 0 && n == d->blockSize) {
+            for (n = d->blockSize; len - n >= d->blockSize && BlockFind(d, blk + (uint32_t)(n >> d->shift)) == DEV_BLOCK_NONE; n += d->blockSize) { }
+
+            d->misses += (uint32_t)(n >> d->shift);
+            Add(b, req, off, out, n, DEV_BLOCK_NONE);
+        } else if (NoSlot(d)) {
+            Settle(d, b);
+            continue;
+        } else {
+            d->misses++;
+
+            i = BlockPin(d, blk);
+            Add(b, req, blk << d->shift, d->blocks[i].data, BlockLen(rm, d, blk), i);
+            b->in[b->n - 1] = in;
+            b->out[b->n - 1] = out;
+            b->outLen[b->n - 1] = n;
+        }
+
+        off += (uint32_t)n;
+        out += n;
+        len -= n;
+    }
+}
+
+/* Copies the cached blocks at the start of a read, up to the first one missing. */
+static
+size_t Cached(romfs_dev_t *d, uint32_t off, uint8_t *out, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        uint32_t in = off & (d->blockSize - 1);
+        size_t n = d->blockSize - in < len - done ? d->blockSize - in : len - done;
+        uint32_t i = BlockFind(d, off >> d->shift);
+
+        if (i == DEV_BLOCK_NONE || d->blocks[i].busy) break;
+
+        BlockUse(d, i);
+        memcpy(out + done, d->blocks[i].data + in, n);
+
+        off += (uint32_t)n;
+        done += n;
+    }
+
+    return done;
+}
+
+/* Reads blocks of [from, to) missing from the cache. Each run of them is one read, runs go
+   out together as long as they fit raBuf. Skipped while another readahead has raBuf. */
+static
+void Prefetch(const struct romfs_t *rm, romfs_dev_t *d, uint32_t from, uint32_t to)
+{
+    uint32_t last = (to - 1) >> d->shift;
+    uint32_t first[DEV_BATCH];
+    devio_t io[DEV_BATCH];
+
+    if (d->raBusy) return;
+    d->raBusy = 1;
+
+    for (uint32_t blk = from >> d->shift; blk <= last; ) {
+        size_t n = 0, used = 0;
+
+        while (blk <= last && n < DEV_BATCH && used + d->blockSize <= d->raMax) {
+            if (BlockFind(d, blk) != DEV_BLOCK_NONE) { blk++; continue; }
+
+            first[n] = blk;
+            io[n].off = blk << d->shift;
+            io[n].buf = d->raBuf + used;
+            io[n].len = 0;
+
+            while (blk <= last && used + d->blockSize <= d->raMax && BlockFind(d, blk) == DEV_BLOCK_NONE) {
+                io[n].len += BlockLen(rm, d, blk);
+                used += d->blockSize;
+                blk++;
+            }
+
+            n++;
+        }
+
+        Submit(d, io, n);
+
+        for (size_t k = 0; k < n; k++) {
+            // a failed readahead is no error, the read itself will report it
+            if (io[k].ret < 0) continue;
+
+            for (uint32_t j = 0; ((size_t)j << d->shift) < io[k].len; j++) {
+                uint32_t i;
+
+                // read by someone else meanwhile, or nothing left to evict
+                if (BlockFind(d, first[k] + j) != DEV_BLOCK_NONE || NoSlot(d)) continue;
+
+                i = BlockClaim(d, first[k] + j);
+                d->blocks[i].ahead = (uint32_t)BlockLen(rm, d, first[k] + j);
+                memcpy(d->blocks[i].data, io[k].buf + ((size_t)j << d->shift), d->blocks[i].ahead);
+            }
+
+            d->raBytes += io[k].len;
+        }
+    }
+
+    d->raBusy = 0;
+}
+
+/** public functions **/
+
+int RomfsDevInit(struct romfs_t *rm, romfs_devread_t read, void *ctx, int fd)
+{
+    romfs_dev_t *d = &rm->dev;
+    uint8_t buf[VOLHDR_VOLNAME_OFF + DEV_NAME_MAX];
+    uint32_t align = 1;
+    size_t len;
+    char *name;
+    int ret;
+
+    d->read = read;
+    d->ctx = ctx;
+
+    d->io = IoInit();
+    if (NULL == d->io) return -ENOMEM;
+
+    if (NULL == read) {
+        ret = RomfsAioInit(fd, &rm->opts, &rm->size, &d->aio);
+        if (ret < 0) return ret;
+
+        align = RomfsAioAlign(d->aio);
+    }
+
+    // O_DIRECT reads go straight into blocks as big as the device's logical block
+    d->blockSize = rm->opts.devBlockSize != 0 ? rm->opts.devBlockSize : DEV_BLOCK_SIZE;
+    if (rm->opts.devBlockSize == 0 && d->blockSize < align) d->blockSize = align;
+    d->count = rm->opts.devCacheBlocks != 0 ? rm->opts.devCacheBlocks : DEV_CACHE_BLOCKS;
+
+    if ((d->blockSize & (d->blockSize - 1)) != 0 || d->blockSize < ROMFS_ALIGNMENT) {
+        return -EINVAL;
+    }
+
+    for (d->shift = 0; (1u << d->shift) < d->blockSize; d->shift++) { }
+    for (d->mask = 1; d->mask < d->count; d->mask <<= 1) { }
+    d->mask--;
+
+    // window over half the cache would evict itself before it is read
+    d->raMax = rm->opts.devReadahead != 0 ? rm->opts.devReadahead : d->count / 4 * d->blockSize;
+    if (d->raMax > d->count / 2 * d->blockSize) d->raMax = d->count / 2 * d->blockSize;
+    d->raMax &= ~(d->blockSize - 1);
+    if (rm->opts.flags & ROMFS_OPT_DEV_NO_READAHEAD) d->raMax = 0;
+
+    d->blocks = (devblock_t *)RomfsMalloc(d->count * sizeof(devblock_t));
+    d->bucket = (uint32_t *)RomfsMalloc((d->mask + 1) * sizeof(uint32_t));
+    d->mem = AllocAligned((size_t)d->count * d->blockSize, align, &d->memAlloc);
+    d->raBuf = d->raMax != 0 ? AllocAligned(d->raMax, align, &d->raAlloc) : NULL;
+    if (NULL == d->blocks || NULL == d->bucket || NULL == d->mem || (d->raMax != 0 && NULL == d->raBuf)) {
+        return -ENOMEM;
+    }
+
+    memset(d->bucket, 0xFF, (d->mask + 1) * sizeof(uint32_t));
+    memset(d->blocks, 0, d->count * sizeof(devblock_t));
+    for (uint32_t i = 0; i < d->count; i++) {
+        d->blocks[i].data = d->mem + (size_t)i * d->blockSize;
+    }
+    d->head = DEV_BLOCK_NONE;
+    d->tail = DEV_BLOCK_NONE;
+
+    ret = RomfsMapInit(&d->hdrs, 64);
+    if (ret < 0) return ret;
+
+    len = rm->size < sizeof(buf) ? rm->size : sizeof(buf);
+    ret = RomfsDevRead(rm, 0, buf, len);
+    if (ret < 0) return ret;
+
+    ret = RomfsVolumeConfigure(buf, len, &rm->vol);
+    if (ret < 0) return ret;
+
+    // buf is gone after return, volume name moves to the arena
+    name = (char *)ArenaAlloc(d, strlen(rm->vol.name) + 1);
+    if (NULL == name) return -ENOMEM;
+
+    strcpy(name, rm->vol.name);
+    rm->vol.name = name;
+
+    return 0;
+}
+
+int RomfsDevRead(const struct romfs_t *rm, uint32_t off, void *buf, size_t len)
+{
+    devio_t io = { off, (uint8_t *)buf, len, 0 };
+
+    RomfsDevReadMany(rm, &io, 1);
+
+    return io.ret;
+}
+
+void RomfsDevReadMany(const struct romfs_t *rm, devio_t *io, size_t n)
+{
+    // cache is filled from otherwise read-only reads
+    romfs_dev_t *d = (romfs_dev_t *)&rm->dev;
+    devbatch_t b;
+
+    b.n = 0;
+
+    RomfsLock(&d->lock);
+
+    for (size_t k = 0; k < n; k++) {
+        io[k].ret = (uint64_t)io[k].off + io[k].len > rm->size ? -EFAULT : 0;
+        if (io[k].ret == 0) Plan(rm, d, &b, &io[k]);
+    }
+
+    Flush(d, &b);
+
+    RomfsUnlock(&d->lock);
+}
+
+int RomfsDevHeader(const struct romfs_t *rm, uint32_t off, const uint8_t **hdr)
+{
+    // headers are added from otherwise read-only lookups
+    romfs_dev_t *d = (romfs_dev_t *)&rm->dev;
+    uint8_t raw[FILEHDR_NAME_OFF + DEV_NAME_MAX];
+    size_t len = 0, avail = rm->size - off - FILEHDR_NAME_OFF;
+    uintptr_t val;
+    uint8_t *e;
+    int ret;
+
+    RomfsLock(&d->lock);
+    ret = RomfsMapGet(&d->hdrs, off, &val);
+    RomfsUnlock(&d->lock);
+
+    if (ret == 0) {
+        *hdr = (const uint8_t *)val;
+        return 0;
+    }
+
+    ret = RomfsDevRead(rm, off, raw, FILEHDR_NAME_OFF);
+
+    // name is padded to ROMFS_ALIGNMENT, read it a padding block at a time
+    while (ret == 0) {
+        size_t n = avail - len < ROMFS_ALIGNMENT ? avail - len : ROMFS_ALIGNMENT;
+
+        if (n == 0) return -EINVAL;     // not terminated inside the image
+        if (len + n > DEV_NAME_MAX) return -ENAMETOOLONG;
+
+        ret = RomfsDevRead(rm, off + FILEHDR_NAME_OFF + (uint32_t)len, raw + FILEHDR_NAME_OFF + len, n);
+        if (ret == 0 && memchr(raw + FILEHDR_NAME_OFF + len, '\0', n) != NULL) break;
+
+        len += n;
+    }
+
+    if (ret < 0) return ret;
+
+    len = strlen((const char *)raw + FILEHDR_NAME_OFF);
+
+    RomfsLock(&d->lock);
+
+    if (RomfsMapGet(&d->hdrs, off, &val) == 0) {
+        // other thread was first
+        e = (uint8_t *)val;
+    } else {
+        e = ArenaAlloc(d, FILEHDR_NAME_OFF + NamePad(len));
+
+        if (NULL == e) {
+            ret = -ENOMEM;
+        } else {
+            memcpy(e, raw, FILEHDR_NAME_OFF + len + 1);
+            ret = RomfsMapPut(&d->hdrs, off, (uintptr_t)e);
+        }
+    }
+
+    RomfsUnlock(&d->lock);
+
+    if (ret == 0) *hdr = e;
+
+    return ret;
+}
+
+void RomfsDevReadahead(const struct romfs_t *rm, romfs_file_t *file, size_t len)
+{
+    romfs_dev_t *d = (romfs_dev_t *)&rm->dev;
+    uint32_t end = file->pos + (uint32_t)len;
+    uint32_t from, to;
+
+    if (d->raMax == 0) return;
+
+    if (file->pos != file->raNext) {
+        // random access, shrink and start over from here
+        file->raWindow = file->raWindow / 2 < d->blockSize ? 0 : file->raWindow / 2;
+        file->raNext = end;
+        file->raEnd = end;
+        return;
+    }
+
+    file->raNext = end;
+
+    // enough read ahead in front of the reader still
+    if (file->raEnd > end && file->raEnd - end > file->raWindow / 2) return;
+
+    file->raWindow = file->raWindow == 0 ? DEV_RA_MIN * d->blockSize : file->raWindow * 2;
+    if (file->raWindow > d->raMax) file->raWindow = d->raMax;
+
+    // next window starts where the last one ended, so every fetch is a whole window
+    from = file->raEnd > end ? file->raEnd : end;
+    if (from >= file->size) return;
+
+    to = file->size - from > file->raWindow ? from + file->raWindow : file->size;
+    file->raEnd = to;
+
+    if ((file->flags & ROMFS_O_FLAGS_NONBLOCK) &&
+        RomfsAsyncQueue(rm, file->ino, file->dataOff + from, to - from, 0) != -ENOTSUP) {
+        return;
+    }
+
+    RomfsLock(&d->lock);
+    Prefetch(rm, d, file->dataOff + from, file->dataOff + to);
+    RomfsUnlock(&d->lock);
+}
+
+/* Read of a non-blocking handle: bytes copied from the cache, or -EAGAIN with a fetch of the
+   range queued. Blocks like RomfsDevRead when there is no background fetching, or when the
+   image is verified and half the cache can't hold a verity block. */
+int RomfsDevReadNowait(const struct romfs_t *rm, const romfs_file_t *file, uint32_t off, void *buf, size_t len)
+{
+    romfs_dev_t *d = (romfs_dev_t *)&rm->dev;
+    uint32_t fetch = d->count / 2 * d->blockSize;
+    uint32_t from = off, to;
+    uint64_t end;
+    size_t done = 0;
+    int ret = -ENOTSUP;
+
+    if (len == 0) return 0;
+
+    RomfsLock(&d->lock);
+    done = Cached(d, off, (uint8_t *)buf, len);
+    RomfsUnlock(&d->lock);
+
+    if (done != 0) return (int)done;
+
+    // no more than half the cache, so the fetch is still there when the reader comes back
+    if (fetch < d->blockSize) fetch = d->blockSize;
+    to = off + (len < fetch ? (uint32_t)len : fetch);
+
+    if (rm->verity.buf != NULL && fetch >= VERITY_BLOCK) {
+        // whole blocks of the file, as verification hashes them
+        end = (uint64_t)(off - file->dataOff) + len;
+        end = (end + VERITY_BLOCK - 1) / VERITY_BLOCK * VERITY_BLOCK;
+        if (end > file->size) end = file->size;
+
+        from = file->dataOff + (off - file->dataOff) / VERITY_BLOCK * VERITY_BLOCK;
+        to = file->dataOff + (uint32_t)end;
+        if (to - from > fetch) to = from + fetch / VERITY_BLOCK * VERITY_BLOCK;
+    }
+
+    if (NULL == rm->verity.buf || fetch >= VERITY_BLOCK) {
+        ret = RomfsAsyncQueue(rm, file->ino, from, to - from, 1);
+    }
+    if (ret != -ENOTSUP) return ret;
+
+    ret = RomfsDevRead(rm, off, buf, len);
+
+    return ret < 0 ? ret : (int)len;
+}
+
+/* Reads blocks of [off, off + len) missing from the cache into it, for background fetches.
+   Read ahead ones are accounted as readahead. */
+int RomfsDevFill(const struct romfs_t *rm, uint32_t off, size_t len, int ahead)
+{
+    romfs_dev_t *d = (romfs_dev_t *)&rm->dev;
+    devio_t req = { off, NULL, len, 0 };
+    uint32_t last;
+    devbatch_t b;
+
+    if (len == 0 || (uint64_t)off + len > rm->size) return -EFAULT;
+
+    last = (uint32_t)((off + len - 1) >> d->shift);
+    b.n = 0;
+
+    RomfsLock(&d->lock);
+
+    if (ahead) {
+        Prefetch(rm, d, off, off + (uint32_t)len);
+        RomfsUnlock(&d->lock);
+        return 0;
+    }
+
+    for (uint32_t blk = off >> d->shift; blk <= last; ) {
+        uint32_t i;
+
+        if (b.n == DEV_BATCH) Flush(d, &b);
+
+        // the fetch is done when every block is there, also ones other readers fill
+        i = BlockFind(d, blk);
+        if ((i != DEV_BLOCK_NONE && d->blocks[i].busy) || (i == DEV_BLOCK_NONE && NoSlot(d))) {
+            Settle(d, &b);
+            continue;
+        }
+
+        if (i == DEV_BLOCK_NONE) {
+            d->misses++;
+
+            i = BlockPin(d, blk);
+            Add(&b, &req, blk << d->shift, d->blocks[i].data, BlockLen(rm, d, blk), i);
+        }
+
+        blk++;
+    }
+
+    Flush(d, &b);
+
+    RomfsUnlock(&d->lock);
+
+    return req.ret;
+}
+
+const char *RomfsDevName(const struct romfs_t *rm, uint32_t off)
+{
+    // stands in for a name that can't be read, long enough for block compares
+    static const char none[NAMEKEY_LEN];
+    const uint8_t *hdr;
+
+    return RomfsDevHeader(rm, off, &hdr) == 0 ? (const char *)hdr + FILEHDR_NAME_OFF : none;
+}
+
+void RomfsDevFree(romfs_dev_t *d)
+{
+    while (d->arena != NULL) {
+        devchunk_t *next = d->arena->next;
+
+        RomfsFree(d->arena);
+        d->arena = next;
+    }
+
+    RomfsMapFree(&d->hdrs);
+    RomfsFree(d->blocks);
+    RomfsFree(d->bucket);
+    RomfsFree(d->memAlloc);
+    RomfsFree(d->raAlloc);
+    RomfsAioFree(d->aio);
+    if (d->io != NULL) IoFree(d);
+    RomfsFree(d->io);
+
+    d->aio = NULL;
+    d->io = NULL;
+    d->blocks = NULL;
+    d->bucket = NULL;
+    d->mem = NULL;
+    d->raBuf = NULL;
+    d->memAlloc = NULL;
+    d->raAlloc = NULL;
+    d->arenaBytes = 0;
+}
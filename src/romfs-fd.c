@@ -0,0 +1,133 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "romfs-internal.h"
+
+/* File descriptor table.
+ *
+ * Descriptors live in segments of FD_SEG_SIZE slots, allocated on demand. The directory of
+ * segment pointers is a fixed array in the instance, sized from MAX_OPEN at compile time,
+ * one pointer per FD_SEG_SIZE descriptors: MAX_OPEN is a hard cap, only the memory behind
+ * it grows. A slot is claimed by setting its bit in the segment bitmap with compare-and-swap,
+ * so concurrent opens never hand out the same descriptor and need no lock. Lowest free
+ * descriptor is preferred, like POSIX open does. Segments are never freed before unload,
+ * a descriptor pointer stays valid while the descriptor is open.
+ */
+
+#if defined(__GNUC__)
+#   define LOAD(p)          __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#   define CAS(p, e, d)     __atomic_compare_exchange_n((p), (e), (d), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#   define FETCH_AND(p, v)  __atomic_fetch_and((p), (v), __ATOMIC_RELEASE)
+#   define CTZ64(x)         __builtin_ctzll(x)
+#else
+#   define LOAD(p)          (*(p))
+#   define CAS(p, e, d)     (*(p) == *(e) ? (*(p) = (d), 1) : (*(e) = *(p), 0))
+#   define FETCH_AND(p, v)  (*(p) &= (v))
+
+static inline int CTZ64(uint64_t x)
+{
+    int n = 0;
+    while (!(x & 1)) { x >>= 1; n++; }
+    return n;
+}
+#endif
+
+static
+fdseg_t *SegGet(fdtable_t *t, uint32_t s)
+{
+    fdseg_t *seg = LOAD(&t->seg[s]);
+    fdseg_t *expected = NULL;
+    uint32_t tail = MAX_OPEN - s * FD_SEG_SIZE;
+    void *mem;
+
+    if (seg != NULL) return seg;
+
+    mem = RomfsMalloc(sizeof(fdseg_t) + ROMFS_CACHELINE - 1);
+    if (NULL == mem) return NULL;
+
+    seg = (fdseg_t *)(((uintptr_t)mem + ROMFS_CACHELINE - 1) & ~(uintptr_t)(ROMFS_CACHELINE - 1));
+    memset(seg, 0, sizeof(fdseg_t));
+    seg->mem = mem;
+
+    // slots past MAX_OPEN in the last segment are never handed out
+    if (tail < FD_SEG_SIZE) seg->used = ~((1ull << tail) - 1);
+
+    if (!CAS(&t->seg[s], &expected, seg)) {
+        // other thread grew the table first
+        RomfsFree(mem);
+        return expected;
+    }
+
+    return seg;
+}
+
+static
+int ClaimFrom(fdtable_t *t, uint32_t first)
+{
+    for (uint32_t s = first; s < FD_MAX_SEGS; s++) {
+        fdseg_t *seg = SegGet(t, s);
+        uint64_t used;
+
+        if (NULL == seg) return -ENOMEM;
+
+        used = LOAD(&seg->used);
+        while (~used != 0) {
+            int bit = CTZ64(~used);
+
+            if (CAS(&seg->used, &used, used | (1ull << bit))) {
+                return (int)(s * FD_SEG_SIZE + bit);
+            }
+        }
+
+        // segment is full, next search may start past it
+        uint32_t h = s;
+        CAS(&t->hint, &h, s + 1);
+    }
+
+    return -EMFILE;
+}
+
+/** public functions **/
+
+int RomfsFdAlloc(fdtable_t *t)
+{
+    int fd = ClaimFrom(t, LOAD(&t->hint));
+
+    // hint can overshoot a slot freed meanwhile, rescan everything before giving up
+    if (fd == -EMFILE) fd = ClaimFrom(t, 0);
+
+    return fd;
+}
+
+fildes_t *RomfsFdGet(const fdtable_t *t, int fd)
+{
+    fdseg_t *seg;
+
+    if (fd < 0 || fd >= MAX_OPEN) return NULL;
+
+    seg = LOAD(&t->seg[fd / FD_SEG_SIZE]);
+    if (NULL == seg || !(LOAD(&seg->used) & (1ull << (fd % FD_SEG_SIZE)))) return NULL;
+
+    return &seg->fd[fd % FD_SEG_SIZE];
+}
+
+void RomfsFdRelease(fdtable_t *t, int fd)
+{
+    uint32_t s = (uint32_t)fd / FD_SEG_SIZE;
+    uint32_t h;
+
+    FETCH_AND(&t->seg[s]->used, ~(1ull << (fd % FD_SEG_SIZE)));
+
+    h = LOAD(&t->hint);
+    while (s < h && !CAS(&t->hint, &h, s)) { }
+}
+
+void RomfsFdTableFree(fdtable_t *t)
+{
+    for (uint32_t s = 0; s < FD_MAX_SEGS; s++) {
+        if (t->seg[s] != NULL) RomfsFree(t->seg[s]->mem);
+    }
+
+    memset(t, 0, sizeof(fdtable_t));
+}
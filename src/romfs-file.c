@@ -0,0 +1,408 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+
+#include "romfs-internal.h"
+
+/* Caller owned file handles.
+ *
+ * romfs_file_t holds everything needed to read a node, so the handle functions never touch
+ * the descriptor table. Descriptor API is a thin layer on top of these, its table just
+ * stores handles.
+ *
+ * They do share the instance's caches, each behind its own lock:
+ *  - opens and lookups: the path cache (pathCacheSize), lazy index, lazy Bloom filters and
+ *    lazy header verification (ROMFS_OPT_DIR_INDEX_LAZY, _DIR_BLOOM_LAZY, _VERIFY_LAZY);
+ *    eager Bloom filters only bump hit counters, atomically;
+ *  - reads: verity block states (ROMFS_OPT_VERITY);
+ *  - everything on device images (RomfsLoadDev, RomfsLoadFd): the block cache, readahead
+ *    and the background fetch worker of non-blocking handles.
+ * A memory image loaded with none of these writes nothing shared, handle calls on it take
+ * no lock at all.
+ *
+ * Reads of device images through ROMFS_O_FLAGS_NONBLOCK handles return what the cache has,
+ * a short count, or -EAGAIN when it has nothing at the position yet. They are checked
+ * against the hash tree after the copy, for the part actually read and with what the cache
+ * has: the read stops before a verity block that isn't cached, or gets -EAGAIN when that is
+ * the first one. Everything else on such handles (open, lookup, readdir, RomfsReadMany)
+ * still blocks.
+ */
+
+#define NOWAIT(t, file) ((((file)->flags & ROMFS_O_FLAGS_NONBLOCK) != 0) && NULL == (t)->img)
+
+#define ABS(x)  ((x) < 0 ? -(x) : (x))
+
+void RomfsFileInit(romfs_file_t *file, const nodehdr_t *node)
+{
+    file->ino     = node->off;
+    file->info    = node->info;
+    file->size    = node->size;
+    file->chksum  = node->chksum;
+    file->dataOff = node->dataOff;
+    file->pos     = 0;
+    file->raNext  = 0;
+    file->raEnd   = 0;
+    file->raWindow = 0;
+    file->mode    = node->mode;
+    file->flags   = 0;
+}
+
+static
+int CopyOut(romfs_t t, const romfs_file_t *file, const romfs_iovec_t *iov, int iovcnt, uint32_t off)
+{
+    size_t total = 0, avail;
+    uint32_t pos;
+    int ret;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].len > INT_MAX - total) return -EINVAL;
+        total += iov[i].len;
+    }
+
+    // one bounds check for the whole request, then plain copies
+    avail = off < file->size ? file->size - off : 0;
+    if (total > avail) total = avail;
+
+    if (!NOWAIT(t, file)) {
+        ret = RomfsVerityCheck(t, file, off, total);
+        if (ret < 0) return ret;
+    }
+
+    pos = file->dataOff + off;
+    avail = total;
+
+    for (int i = 0; i < iovcnt && avail != 0; i++) {
+        size_t n = iov[i].len < avail ? iov[i].len : avail;
+
+        if (NOWAIT(t, file)) {
+            ret = RomfsDevReadNowait(t, file, pos, iov[i].base, n);
+            if (ret < 0 && avail == total) return ret;
+            if (ret < 0) break;
+        } else {
+            ret = RomfsImgRead(t, pos, iov[i].base, n);
+            if (ret < 0) return ret;
+            ret = (int)n;
+        }
+
+        pos += (uint32_t)ret;
+        avail -= (size_t)ret;
+
+        // short non-blocking read, the rest is not cached
+        if ((size_t)ret < n) break;
+    }
+
+    total -= avail;
+
+    if (NOWAIT(t, file)) {
+        ret = RomfsVerityCheckNowait(t, file, off, &total);
+        if (ret < 0) return ret;
+    }
+
+    return (int)total;
+}
+
+static
+void FillPlus(romfs_t t, const nodehdr_t *node, romfs_direntplus_t *plus)
+{
+    nodehdr_t target = *node;
+
+    // link that cannot be resolved is reported as itself
+    if (RomfsWalkFinish(t, &target) < 0) {
+        target = *node;
+    }
+
+    plus->stat.ino    = target.off;
+    plus->stat.chksum = target.chksum;
+    plus->stat.size   = target.size;
+    plus->stat.mode   = target.mode;
+    plus->dataOff     = target.dataOff;
+}
+
+/* TODO:
+    - cookie can be bad
+*/
+static
+int ReadDir(romfs_t t, const romfs_file_t *dir, romfs_dirent_t *buf, romfs_direntplus_t *plus,
+            size_t bufLen, uint32_t *cookie, size_t *bufUsed)
+{
+    nodehdr_t curNode;
+    int ret;
+
+    if (NULL == t || NULL == dir) return -EINVAL;
+
+    if (bufUsed == NULL || cookie == NULL) {
+        return -EINVAL;
+    }
+
+    if (!IS_DIRECTORY(dir->mode)) {
+        return -ENOTDIR;
+    }
+
+    if (*cookie == ROMFS_COOKIE_LAST) {
+        *bufUsed = 0;
+        return 0;
+    }
+
+    if (*cookie == 0) {
+        *cookie = dir->info;
+    }
+
+    ret = RomfsGetNodeHdr(t, *cookie, &curNode);
+    if (ret < 0) {
+        return -EINVAL;
+    }
+
+    for (*bufUsed = 0; *bufUsed < bufLen; (*bufUsed)++) {
+        romfs_dirent_t *ent = plus != NULL ? &plus[*bufUsed].ent : &buf[*bufUsed];
+
+        ent->name    = curNode.name;
+        ent->nameLen = RomfsNameLen(curNode.name, t->size - curNode.off - FILEHDR_NAME_OFF);
+        ent->inode   = curNode.off;
+        ent->next    = curNode.next;
+        ent->type    = curNode.mode;
+
+        // target is resolved while its header is at hand, no second lookup by name
+        if (plus != NULL) {
+            FillPlus(t, &curNode, &plus[*bufUsed]);
+        }
+
+        if (curNode.next) {
+            *cookie = curNode.next;
+
+            ret = RomfsGetNodeHdrFrom(t, &curNode, curNode.next, &curNode);
+            if (ret < 0) {
+                break;
+            }
+        }
+        else {
+            *cookie = ROMFS_COOKIE_LAST;
+            (*bufUsed)++;
+            break;
+        }
+    }
+
+    ROMFS_TRACE("last cookie = 0x%x", *cookie);
+
+    return 0;
+}
+
+/** public functions **/
+
+int RomfsFileOpen(romfs_t t, const romfs_file_t *dir, const char *path, int flags, romfs_file_t *file)
+{
+    nodehdr_t node;
+    int ret;
+
+    if (NULL == t || NULL == file) return -EINVAL;
+
+    ret = RomfsFindEntry(t, dir != NULL ? dir->ino : t->vol.rootOff, path, &node);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = RomfsVerifyOpen(t, &node);
+    if (ret < 0) {
+        return ret;
+    }
+
+    RomfsFileInit(file, &node);
+    file->flags = (uint8_t)flags;
+
+    return 0;
+}
+
+int RomfsFileStat(romfs_t t, const romfs_file_t *file, romfs_stat_t *stat)
+{
+    if (NULL == t || NULL == file) return -EINVAL;
+
+    if (stat != NULL) {
+        stat->ino    = file->ino;
+        stat->chksum = file->chksum;
+        stat->size   = file->size;
+        stat->mode   = file->mode;
+    }
+
+    return file->mode;
+}
+
+int RomfsFileRead(romfs_t t, romfs_file_t *file, void *buf, size_t nbyte)
+{
+    size_t toRead;
+    int ret;
+
+    if (NULL == t || NULL == file || NULL == buf) return -EINVAL;
+
+    if (IS_DIRECTORY(file->mode)) {
+        return -EISDIR;
+    }
+
+    toRead = file->size - file->pos;
+    if (nbyte > toRead) {
+        nbyte = toRead;
+    }
+
+    if (nbyte == 0) {
+        return 0;
+    }
+
+    if (NOWAIT(t, file)) {
+        ret = RomfsDevReadNowait(t, file, file->dataOff + file->pos, buf, nbyte);
+        if (ret < 0) return ret;
+
+        nbyte = (size_t)ret;
+        ret = RomfsVerityCheckNowait(t, file, file->pos, &nbyte);
+        if (ret < 0) return ret;
+    } else {
+        ret = RomfsVerityCheck(t, file, file->pos, nbyte);
+        if (ret < 0) return ret;
+
+        ret = RomfsImgRead(t, file->dataOff + file->pos, buf, nbyte);
+        if (ret < 0) return ret;
+    }
+
+    if (NULL == t->img) RomfsDevReadahead(t, file, nbyte);
+
+    file->pos += nbyte;
+
+    return nbyte;
+}
+
+int RomfsFileReadv(romfs_t t, romfs_file_t *file, const romfs_iovec_t *iov, int iovcnt)
+{
+    int ret;
+
+    if (NULL == t || NULL == file || NULL == iov || iovcnt < 0) return -EINVAL;
+
+    if (IS_DIRECTORY(file->mode)) {
+        return -EISDIR;
+    }
+
+    ret = CopyOut(t, file, iov, iovcnt, file->pos);
+    if (ret > 0) {
+        if (NULL == t->img) RomfsDevReadahead(t, file, (size_t)ret);
+        file->pos += ret;
+    }
+
+    return ret;
+}
+
+int RomfsFilePread(romfs_t t, const romfs_file_t *file, void *buf, size_t nbyte, uint32_t off)
+{
+    romfs_iovec_t iov = { buf, nbyte };
+
+    return RomfsFilePreadv(t, file, &iov, 1, off);
+}
+
+int RomfsFilePreadv(romfs_t t, const romfs_file_t *file, const romfs_iovec_t *iov, int iovcnt, uint32_t off)
+{
+    if (NULL == t || NULL == file || NULL == iov || iovcnt < 0) return -EINVAL;
+
+    if (IS_DIRECTORY(file->mode)) {
+        return -EISDIR;
+    }
+
+    return CopyOut(t, file, iov, iovcnt, off);
+}
+
+int RomfsFileSeek(romfs_t t, romfs_file_t *file, long off, romfs_seek_t whence)
+{
+    if (NULL == t || NULL == file) return -EINVAL;
+
+    if (!IS_FILE(file->mode)) {
+        return -EBADF;
+    }
+
+    if (ABS(off) > file->size) {
+        return -EINVAL;
+    }
+
+    switch (whence)
+    {
+    case ROMFS_SEEK_SET:
+        if (off < 0) {
+            return -EINVAL;
+        }
+        file->pos = (uint32_t)off;
+        break;
+    case ROMFS_SEEK_CUR:
+        ROMFS_TRACE("%ld + %u, size %u", off, file->pos, file->size);
+        if ((long)file->pos + off > (long)file->size || (long)file->pos + off < 0) {
+            return -EINVAL;
+        }
+        file->pos += off;
+        break;
+    case ROMFS_SEEK_END:
+        if (off > 0) {
+            return -EINVAL;
+        }
+        file->pos = (uint32_t)(file->size + off);
+        break;
+    default:
+        return -EINVAL;
+        break;
+    }
+
+    return 0;
+}
+
+int RomfsFileTell(romfs_t t, const romfs_file_t *file, long *off)
+{
+    if (NULL == t || NULL == file || NULL == off) return -EINVAL;
+
+    if (!IS_FILE(file->mode)) {
+        return -EBADF;
+    }
+
+    *off = (long)file->pos;
+
+    return 0;
+}
+
+int RomfsFileReadDir(romfs_t t, const romfs_file_t *dir, romfs_dirent_t *buf, size_t bufLen, uint32_t *cookie, size_t *bufUsed)
+{
+    if (NULL == buf) return -EINVAL;
+
+    return ReadDir(t, dir, buf, NULL, bufLen, cookie, bufUsed);
+}
+
+int RomfsFileReadDirPlus(romfs_t t, const romfs_file_t *dir, romfs_direntplus_t *buf, size_t bufLen, uint32_t *cookie, size_t *bufUsed)
+{
+    if (NULL == buf) return -EINVAL;
+
+    return ReadDir(t, dir, NULL, buf, bufLen, cookie, bufUsed);
+}
+
+int RomfsFileMap(romfs_t t, const romfs_file_t *file, void **addr, size_t *len, uint32_t off)
+{
+    int ret;
+
+    if (NULL == t || NULL == file) return -EINVAL;
+
+    if (NULL == addr || NULL == len) {
+        return -EINVAL;
+    }
+
+    if (!IS_FILE(file->mode)) {
+        return -EACCES;
+    }
+
+    // device images have nothing to point to
+    if (NULL == t->img) {
+        return -ENOTSUP;
+    }
+
+    if (off >= file->size) {
+        return -EINVAL;
+    }
+
+    // caller reads the mapping directly, whole range is checked up front
+    ret = RomfsVerityCheck(t, file, off, file->size - off);
+    if (ret < 0) return ret;
+
+    *addr = t->img + (file->dataOff + off);
+    *len = file->size - off;
+
+    return 0;
+}
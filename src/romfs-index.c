@@ -0,0 +1,339 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "romfs-internal.h"
+
+/* Per-directory hash index.
+ *
+ * Every directory chain (identified by the offset of its first header) gets an open addressing
+ * table of (name hash, header offset) pairs, so a lookup costs one probe instead of a walk
+ * over all siblings.
+ *
+ * Eager mode indexes whole tree in RomfsLoad and is read-only afterwards. Lazy mode indexes
+ * a chain on its first search and evicts least recently used tables when over the memory
+ * limit. The index lock covers only the maps and the LRU list: tables are built outside of
+ * it, and a search takes a reference to its table and probes it unlocked, as comparing names
+ * may read the device. An evicted table is freed by whoever drops the last reference. Chains
+ * that can't be indexed, or whose table alone is over the limit, are remembered and searched
+ * linearly from then on, the map remembering them counts against the limit too.
+ */
+
+static inline
+uint32_t ChainLimit(const struct romfs_t *rm)
+{
+    // upper bound of headers in the image, guards against looped chains
+    return (uint32_t)(rm->vol.size / ROMFS_ALIGNMENT);
+}
+
+static
+int IndexChain(const struct romfs_t *rm, uint32_t head, dirindex_t **out)
+{
+    nodehdr_t node;
+    dirindex_t *di;
+    uint32_t count = 0, size = 1, limit = ChainLimit(rm);
+    uint32_t off;
+    int ret;
+
+    for (off = head; off != 0; off = node.next) {
+        ret = RomfsGetNodeHdr(rm, off, &node);
+        if (ret < 0) return ret;
+        if (++count > limit) return -ELOOP;
+    }
+
+    while (size < count * 2) size <<= 1;
+
+    di = (dirindex_t *)RomfsMalloc(sizeof(dirindex_t) + size * sizeof(dirslot_t));
+    if (NULL == di) return -ENOMEM;
+
+    memset(di, 0, sizeof(dirindex_t) + size * sizeof(dirslot_t));
+    di->head = head;
+    di->count = count;
+    di->mask = size - 1;
+    di->refs = 1;
+
+    for (off = head; off != 0; off = node.next) {
+        uint32_t h, i;
+
+        ret = RomfsGetNodeHdr(rm, off, &node);
+        if (ret < 0) { RomfsFree(di); return ret; }
+
+        h = RomfsNameHash(node.name, RomfsNameLen(node.name, rm->size - off - FILEHDR_NAME_OFF));
+
+        for (i = h & di->mask; di->slot[i].off != 0; i = (i + 1) & di->mask) {
+            // first entry with given name wins, same as the linear search
+            if (di->slot[i].hash == h && strcmp(RomfsImgName(rm, di->slot[i].off), node.name) == 0) break;
+        }
+
+        if (di->slot[i].off == 0) {
+            di->slot[i].hash = h;
+            di->slot[i].off = off;
+        }
+    }
+
+    *out = di;
+    return 0;
+}
+
+static inline
+size_t IndexBytes(const dirindex_t *di)
+{
+    return sizeof(dirindex_t) + (di->mask + 1) * sizeof(dirslot_t);
+}
+
+/* Adds a built table, frees it if it can't be added. */
+static
+int IndexInsert(romfs_index_t *idx, uint32_t head, dirindex_t *di)
+{
+    int ret;
+
+    ret = RomfsMapPut(&idx->dirs, head, (uintptr_t)di);
+    if (ret < 0) { RomfsFree(di); return ret; }
+
+    idx->bytes += IndexBytes(di);
+
+    return 0;
+}
+
+static
+int IndexAdd(const struct romfs_t *rm, romfs_index_t *idx, uint32_t head)
+{
+    dirindex_t *di;
+    int ret;
+
+    ret = IndexChain(rm, head, &di);
+    if (ret < 0) return ret;
+
+    return IndexInsert(idx, head, di);
+}
+
+static inline
+size_t IndexMem(const romfs_index_t *idx)
+{
+    return idx->bytes + RomfsMapBytes(&idx->dirs) + RomfsMapBytes(&idx->skip);
+}
+
+static
+void LruUnlink(romfs_index_t *idx, dirindex_t *di)
+{
+    if (di->prev != NULL) di->prev->next = di->next; else idx->mru = di->next;
+    if (di->next != NULL) di->next->prev = di->prev; else idx->lru = di->prev;
+
+    di->prev = NULL;
+    di->next = NULL;
+}
+
+static
+void LruPush(romfs_index_t *idx, dirindex_t *di)
+{
+    di->prev = NULL;
+    di->next = idx->mru;
+
+    if (idx->mru != NULL) idx->mru->prev = di; else idx->lru = di;
+    idx->mru = di;
+}
+
+static inline
+void IndexPut(dirindex_t *di)
+{
+    if (RomfsUnref(&di->refs) == 0) RomfsFree(di);
+}
+
+/* Takes a lazy table out of the map, searches still probing it keep it until they are done. */
+static
+void IndexDrop(romfs_index_t *idx, dirindex_t *di)
+{
+    idx->bytes -= IndexBytes(di);
+    RomfsMapDel(&idx->dirs, di->head);
+    LruUnlink(idx, di);
+    IndexPut(di);
+}
+
+static
+void IndexEvict(romfs_index_t *idx, size_t limit, const dirindex_t *keep)
+{
+    while (IndexMem(idx) > limit) {
+        dirindex_t *victim = idx->lru;
+
+        if (victim == keep) victim = victim->prev;
+        if (NULL == victim) break;
+
+        ROMFS_TRACE("evict index of 0x%x", victim->head);
+        IndexDrop(idx, victim);
+        idx->evictions++;
+    }
+}
+
+static
+int IndexProbe(const struct romfs_t *rm, const dirindex_t *di, const namekey_t *k, uint32_t *offset)
+{
+    for (uint32_t i = k->hash & di->mask; di->slot[i].off != 0; i = (i + 1) & di->mask) {
+        uint32_t off = di->slot[i].off;
+
+        if (di->slot[i].hash == k->hash &&
+            RomfsNameKeyEq(k, RomfsImgName(rm, off), rm->size - off - FILEHDR_NAME_OFF)) {
+            *offset = di->slot[i].off;
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+/* Builds the table of a chain that has none, without the index lock. Returns it with a
+   reference taken, or NULL if the chain is left to the linear search. */
+static
+dirindex_t *IndexBuildLazy(const struct romfs_t *rm, romfs_index_t *idx, uint32_t head)
+{
+    size_t limit = rm->opts.indexMemLimit;
+    clock_t start = clock();
+    dirindex_t *di;
+    uintptr_t val;
+    int ret;
+
+    ret = IndexChain(rm, head, &di);
+
+    RomfsLock(&idx->lock);
+    idx->buildUs += (uint32_t)((clock() - start) * 1000000.0 / CLOCKS_PER_SEC);
+
+    if (ret == 0 && RomfsMapGet(&idx->dirs, head, &val) == 0) {
+        // other thread was first
+        RomfsFree(di);
+        di = (dirindex_t *)val;
+        LruUnlink(idx, di);
+    } else if (ret == 0) {
+        ret = IndexInsert(idx, head, di);
+    }
+
+    if (ret == 0) LruPush(idx, di);
+
+    if (ret == 0 && limit != 0) {
+        IndexEvict(idx, limit, di);
+
+        // table alone does not fit
+        if (IndexMem(idx) > limit) {
+            IndexDrop(idx, di);
+            ret = -ENOMEM;
+        }
+    }
+
+    if (ret < 0) {
+        // no rebuild on every lookup, chain is searched linearly from now on
+        RomfsMapPut(&idx->skip, head, 1);
+        RomfsUnlock(&idx->lock);
+        return NULL;
+    }
+
+    RomfsCount(&di->refs);
+    RomfsUnlock(&idx->lock);
+
+    return di;
+}
+
+static
+int IndexSearchLazy(const struct romfs_t *rm, const namekey_t *k, uint32_t *offset)
+{
+    // index is a lookup cache, lazy mode fills it from otherwise read-only lookups
+    romfs_index_t *idx = (romfs_index_t *)&rm->index;
+    dirindex_t *di = NULL;
+    uintptr_t val;
+    int ret;
+
+    RomfsLock(&idx->lock);
+
+    if (RomfsMapGet(&idx->dirs, *offset, &val) == 0) {
+        di = (dirindex_t *)val;
+        if (di != idx->mru) {
+            LruUnlink(idx, di);
+            LruPush(idx, di);
+        }
+        RomfsCount(&di->refs);
+        ret = 0;
+    } else {
+        ret = RomfsMapGet(&idx->skip, *offset, NULL);
+    }
+
+    RomfsUnlock(&idx->lock);
+
+    if (NULL == di) {
+        if (ret == 0) return INDEX_NOT_FOUND;
+
+        di = IndexBuildLazy(rm, idx, *offset);
+        if (NULL == di) return INDEX_NOT_FOUND;
+    }
+
+    ret = IndexProbe(rm, di, k, offset);
+    IndexPut(di);
+
+    return ret;
+}
+
+static
+int VisitIndex(const struct romfs_t *rm, const nodehdr_t *nd, uint32_t head, void *ctx)
+{
+    // index every chain once, when the walk enters it
+    if (nd->off != head) return 0;
+
+    return IndexAdd(rm, (romfs_index_t *)ctx, head);
+}
+
+/** public functions **/
+
+uint32_t RomfsNameHash(const char *name, size_t len)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+int RomfsIndexBuild(struct romfs_t *rm)
+{
+    clock_t start = clock();
+    int ret;
+
+    ret = RomfsMapInit(&rm->index.dirs, 16);
+    if (ret < 0) return ret;
+
+    ret = RomfsTreeWalk(rm, VisitIndex, &rm->index);
+
+    rm->index.buildUs = (uint32_t)((clock() - start) * 1000000.0 / CLOCKS_PER_SEC);
+
+    ROMFS_TRACE("indexed %u dirs, %zu bytes, %u us", rm->index.dirs.count, rm->index.bytes, rm->index.buildUs);
+
+    return ret;
+}
+
+int RomfsIndexSearch(const struct romfs_t *rm, const namekey_t *k, uint32_t *offset)
+{
+    uintptr_t val;
+
+    if (rm->opts.flags & ROMFS_OPT_DIR_INDEX_LAZY) {
+        return IndexSearchLazy(rm, k, offset);
+    }
+
+    if (RomfsMapGet(&rm->index.dirs, *offset, &val) != 0) return INDEX_NOT_FOUND;
+
+    return IndexProbe(rm, (const dirindex_t *)val, k, offset);
+}
+
+void RomfsIndexFree(romfs_index_t *idx)
+{
+    for (uint32_t i = 0; idx->dirs.slots != NULL && i <= idx->dirs.mask; i++) {
+        if (idx->dirs.slots[i].key != 0) {
+            RomfsFree((void *)idx->dirs.slots[i].val);
+        }
+    }
+
+    RomfsMapFree(&idx->dirs);
+    RomfsMapFree(&idx->skip);
+    idx->bytes = 0;
+    idx->mru = NULL;
+    idx->lru = NULL;
+}
@@ -17,11 +17,28 @@ uint32_t ReadBE32(const uint8_t *buf, size_t offset)
              ((uint32_t)*(buf + offset + 3) & 0xff));
 }
 
-#define LINK_FOLLOWED 1
-#define LINK_NOT_FOLLOWED 0
-
 static
 int FollowHardlinks(const struct romfs_t *rm, uint32_t offset, uint32_t *destOffset)
+{
+    uintptr_t target;
+
+    // every reachable link was resolved at load, a miss means offset is not a link
+    if (rm->links.slots != NULL) {
+        if (RomfsMapGet(&rm->links, offset, &target) != 0) {
+            *destOffset = offset;
+            return LINK_NOT_FOLLOWED;
+        }
+
+        *destOffset = (uint32_t)target;
+        return LINK_FOLLOWED;
+    }
+
+    return RomfsResolveLink(rm, offset, destOffset);
+}
+
+/** public functions **/
+
+int RomfsResolveLink(const struct romfs_t *rm, uint32_t offset, uint32_t *destOffset)
 {
     uint32_t next;
     nodehdr_t node;
@@ -43,31 +60,54 @@ int FollowHardlinks(const struct romfs_t *rm, uint32_t offset, uint32_t *destOff
     return -ELOOP;
 }
 
-/** public functions **/
-
-int RomfsVolumeConfigure(const uint8_t *buf, volume_t *vol)
+int RomfsVolumeConfigure(const uint8_t *buf, size_t size, volume_t *vol)
 {
-    if (memcmp(buf, VOLHDR_MAGIC_STR, 8) != 0) {
+    size_t len;
+
+    if (size <= VOLHDR_VOLNAME_OFF || memcmp(buf, VOLHDR_MAGIC_STR, 8) != 0) {
         return -EINVAL;
     }
 
     vol->size = ReadBE32(buf, VOLHDR_SIZE_OFF);
     vol->chksum = ReadBE32(buf, VOLHDR_CHKSUM_OFF);
     vol->name = (const char *)&buf[VOLHDR_VOLNAME_OFF];
-    vol->rootOff = ROMFS_ALIGNUP(VOLHDR_VOLNAME_OFF + strlen(vol->name) + 1);
+
+    // name must be terminated inside the image
+    len = RomfsNameLen(vol->name, size - VOLHDR_VOLNAME_OFF);
+    if (len == size - VOLHDR_VOLNAME_OFF) {
+        return -EINVAL;
+    }
+
+    vol->rootOff = ROMFS_ALIGNUP(VOLHDR_VOLNAME_OFF + len + 1);
 
     return 0;
 }
 
 int RomfsGetNodeHdr(const struct romfs_t *rm, uint32_t offset, nodehdr_t *nd)
 {
-    uint8_t *buf = rm->img;
+    const uint8_t *buf;
+    size_t len;
+    int ret;
 
-    if (offset > rm->vol.size || offset > rm->size || offset == 0) {
+    if (offset > rm->vol.size || offset + FILEHDR_NAME_OFF >= rm->size || offset == 0) {
         return -EINVAL;
     }
 
-    buf = buf + offset;
+    if (rm->nodes.count != 0) {
+        uint32_t i = RomfsNodeTableFind(&rm->nodes, offset);
+        if (i != NODE_NONE) {
+            RomfsNodeTableGet(rm, i, nd);
+            return 0;
+        }
+    }
+
+    if (rm->img != NULL) {
+        buf = rm->img + offset;
+    } else {
+        // arena copy has the same layout as the header in the image
+        ret = RomfsDevHeader(rm, offset, &buf);
+        if (ret < 0) return ret;
+    }
 
     nd->off = offset;
     nd->next = ReadBE32(buf, FILEHDR_NEXT_OFF) & ~(FILEHDR_NEXT_MODE_MASK);
@@ -76,22 +116,44 @@ int RomfsGetNodeHdr(const struct romfs_t *rm, uint32_t offset, nodehdr_t *nd)
     nd->size = ReadBE32(buf, FILEHDR_SIZE_OFF);
     nd->chksum = ReadBE32(buf, FILEHDR_CHKSUM_OFF);
     nd->name = (const char *)&buf[FILEHDR_NAME_OFF];
-    nd->dataOff = offset + ROMFS_ALIGNUP(FILEHDR_NAME_OFF + strlen(nd->name) + 1);
+
+    // name must be terminated inside the image
+    len = RomfsNameLen(nd->name, rm->size - offset - FILEHDR_NAME_OFF);
+    if (len == rm->size - offset - FILEHDR_NAME_OFF) {
+        return -EINVAL;
+    }
+
+    nd->dataOff = offset + ROMFS_ALIGNUP(FILEHDR_NAME_OFF + len + 1);
+    nd->slot = 0;
 
     return 0;
 }
 
-int RomfsSearchDir(const struct romfs_t *rm, const char *name, uint32_t *offset)
+static
+int SearchChain(const struct romfs_t *rm, const namekey_t *k, uint32_t *offset)
 {
     int ret;
     nodehdr_t node;
     uint32_t off = *offset;
 
+    if (INDEX_ENABLED(rm)) {
+        ret = RomfsIndexSearch(rm, k, offset);
+        if (ret != INDEX_NOT_FOUND) return ret;
+    }
+
+    if (rm->nodes.count != 0) {
+        ret = RomfsNodeTableSearch(rm, k, offset);
+        if (ret != INDEX_NOT_FOUND) return ret;
+    }
+
     while (off != 0) {
         ret = RomfsGetNodeHdr(rm, off, &node);
-        if (ret) return -EINVAL;
+        if (ret) return ret;
+
+        // overlap fetch of the next sibling with the compare
+        if (node.next != 0 && node.next < rm->size && rm->img != NULL) ROMFS_PREFETCH(rm->img + node.next);
 
-        if (strcmp(node.name, name) == 0) {
+        if (RomfsNameKeyEq(k, node.name, rm->size - off - FILEHDR_NAME_OFF)) {
             *offset = off;
             return 0;
         }
@@ -102,72 +164,278 @@ int RomfsSearchDir(const struct romfs_t *rm, const char *name, uint32_t *offset)
     return -ENOENT;
 }
 
-int RomfsFindEntry(const struct romfs_t *rm, uint32_t offset, const char* path, nodehdr_t *nd)
+int RomfsSearchDirKey(const struct romfs_t *rm, const namekey_t *k, uint32_t *offset)
 {
-    int d, ret;
-    path_t buf;
-    char *save;
-    char *cur;
+    // counters only, filters themselves are read-only here
+    romfs_bloom_t *bl = (romfs_bloom_t *)&rm->bloom;
+    int bloom = BLOOM_NONE;
+    int ret;
 
-    // just count elements and do some checks
-    d = UtilsCheckPath(path);
-    if (d < 0) return d;
+    if (BLOOM_ENABLED(rm)) {
+        bloom = RomfsBloomCheck(rm, k, *offset);
+        if (bloom == BLOOM_ABSENT) {
+            RomfsCount(&bl->negatives);
+            return -ENOENT;
+        }
+    }
 
-    ret = RomfsGetNodeHdr(rm, offset, nd);
-    if (ret < 0) {
-        return ret;
+    ret = SearchChain(rm, k, offset);
+    if (ret == -ENOENT && bloom == BLOOM_MAYBE) {
+        RomfsCount(&bl->falsePositives);
     }
 
-    cur = UtilsParsePathGetNext(path, buf, &save);
-    while (cur != NULL) {
-        ROMFS_TRACE("[files to parse: %d] \"%s\"", d--, cur);
-        ROMFS_TRACE("[node]: mode = 0x%x, off -> 0x%x", nd->mode, nd->off);
+    return ret;
+}
+
+int RomfsSearchDirN(const struct romfs_t *rm, const char *name, size_t len, uint32_t *offset)
+{
+    namekey_t key;
+
+    RomfsNameKeyInit(&key, name, len);
+
+    return RomfsSearchDirKey(rm, &key, offset);
+}
+
+int RomfsSearchDir(const struct romfs_t *rm, const char *name, uint32_t *offset)
+{
+    return RomfsSearchDirN(rm, name, strlen(name), offset);
+}
+
+int RomfsTreeWalk(const struct romfs_t *rm, romfs_visit_t visit, void *ctx)
+{
+    romfs_map_t queued;
+    uint32_t *stack;
+    uint32_t top = 0, depth = 16, count = 0;
+    uint32_t limit = (uint32_t)(rm->vol.size / ROMFS_ALIGNMENT);
+    nodehdr_t node;
+    int ret;
+
+    ret = RomfsMapInit(&queued, 16);
+    if (ret < 0) return ret;
+
+    stack = (uint32_t *)RomfsMalloc(depth * sizeof(uint32_t));
+    if (NULL == stack) { RomfsMapFree(&queued); return -ENOMEM; }
+
+    stack[top++] = rm->vol.rootOff;
+    ret = RomfsMapPut(&queued, rm->vol.rootOff, 0);
+
+    while (top > 0 && ret == 0) {
+        uint32_t head = stack[--top];
+
+        for (uint32_t off = head; off != 0 && ret == 0; off = node.next) {
+            ret = off == head ? RomfsGetNodeHdr(rm, off, &node) : RomfsGetNodeHdrFrom(rm, &node, off, &node);
+            if (ret < 0) break;
+
+            // more headers than fit into the image, chains are looped
+            if (++count > limit) { ret = -ELOOP; break; }
+
+            ret = visit(rm, &node, head, ctx);
+            if (ret != 0) break;
+
+            // "." and ".." are hardlinks, so only real subdirectories are queued
+            if (!IS_DIRECTORY(node.mode) || RomfsMapGet(&queued, node.info, NULL) == 0) continue;
 
-        if (IS_HARDLINK(nd->mode)) {
-            ret = FollowHardlinks(rm, offset, &offset);
-            if (ret < 0) {
-                return ret;
-            } else if (ret == LINK_FOLLOWED) {
-                ROMFS_TRACE("link followed -> 0x%x", offset);
+            if (top == depth) {
+                uint32_t *s = (uint32_t *)RomfsMalloc(depth * 2 * sizeof(uint32_t));
+                if (NULL == s) { ret = -ENOMEM; break; }
+                memcpy(s, stack, depth * sizeof(uint32_t));
+                RomfsFree(stack);
+                stack = s;
+                depth *= 2;
             }
+            stack[top++] = node.info;
+            ret = RomfsMapPut(&queued, node.info, 0);
         }
+    }
 
-        ret = RomfsGetNodeHdr(rm, offset, nd);
-        if (ret < 0) {
-            return ret;
-        }
+    RomfsFree(stack);
+    RomfsMapFree(&queued);
 
-        if (IS_DIRECTORY(nd->mode)) {
-            offset = nd->info;
-        }
+    return ret;
+}
+
+static
+int VisitIno(const struct romfs_t *rm, const nodehdr_t *nd, uint32_t head, void *ctx)
+{
+    return RomfsMapPut((romfs_map_t *)ctx, nd->off, 0);
+}
+
+int RomfsNodeValid(const struct romfs_t *rm, uint32_t offset)
+{
+    // set of reachable headers is filled from otherwise read-only lookups
+    romfs_map_t *inos = (romfs_map_t *)&rm->inos;
+    romfs_lock_t *lock = (romfs_lock_t *)&rm->inosLock;
+    int ret = 0;
+
+    if (offset == 0 || offset % ROMFS_ALIGNMENT != 0 || offset > rm->vol.size || offset + FILEHDR_NAME_OFF >= rm->size) {
+        return -EINVAL;
+    }
+
+    if (rm->nodes.count != 0) {
+        return RomfsNodeTableFind(&rm->nodes, offset) != NODE_NONE ? 0 : -ENOENT;
+    }
+
+    // no table, the headers reachable from the root are collected by one walk and kept
+    RomfsLock(lock);
+
+    if (NULL == inos->slots) {
+        ret = RomfsMapInit(inos, 64);
+        if (ret == 0) ret = RomfsTreeWalk(rm, VisitIno, inos);
+        if (ret < 0) RomfsMapFree(inos);
+    }
+
+    if (ret == 0) ret = RomfsMapGet(inos, offset, NULL) == 0 ? 0 : -ENOENT;
+
+    RomfsUnlock(lock);
+
+    return ret;
+}
+
+int RomfsWalkStep(const struct romfs_t *rm, const namekey_t *k, nodehdr_t *nd)
+{
+    uint32_t offset = nd->off;
+    int ret;
+
+    ROMFS_TRACE("[node]: mode = 0x%x, off -> 0x%x, next \"%.*s\"", nd->mode, nd->off, (int)k->len, k->name);
+
+    // table walk goes by index, an index or filter per directory is still asked first
+    if (!INDEX_ENABLED(rm) && !BLOOM_ENABLED(rm)) {
+        ret = RomfsNodeTableStep(rm, k, nd);
+        if (ret != INDEX_NOT_FOUND) return ret;
+    }
 
-        ret = RomfsSearchDir(rm, cur, &offset);
-        ROMFS_TRACE("search: %d (0x%x)", ret, offset);
+    if (IS_HARDLINK(nd->mode)) {
+        ret = FollowHardlinks(rm, offset, &offset);
         if (ret < 0) {
             return ret;
         }
 
+        ROMFS_TRACE("link followed -> 0x%x", offset);
         ret = RomfsGetNodeHdr(rm, offset, nd);
         if (ret < 0) {
             return ret;
         }
+    }
 
-        cur = UtilsParsePathGetNext(NULL, buf, &save);
+    if (IS_DIRECTORY(nd->mode)) {
+        offset = nd->info;
     }
 
-    if (IS_HARDLINK(nd->mode)) {
-        ret = FollowHardlinks(rm, offset, &offset);
+    ret = RomfsSearchDirKey(rm, k, &offset);
+    ROMFS_TRACE("search: %d (0x%x)", ret, offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return RomfsGetNodeHdr(rm, offset, nd);
+}
+
+int RomfsWalkFinish(const struct romfs_t *rm, nodehdr_t *nd)
+{
+    uint32_t offset = nd->off;
+    int ret;
+
+    if (!IS_HARDLINK(nd->mode)) {
+        return 0;
+    }
+
+    ret = FollowHardlinks(rm, offset, &offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ROMFS_TRACE("link followed -> 0x%x", offset);
+    return RomfsGetNodeHdr(rm, offset, nd);
+}
+
+static
+int FindEntryWalk(const struct romfs_t *rm, uint32_t offset, path_walk_t *w, nodehdr_t *nd)
+{
+    namekey_t key;
+    int ret;
+
+    ret = RomfsGetNodeHdr(rm, offset, nd);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while ((ret = UtilsPathWalkNext(w)) > 0) {
+        RomfsNameKeyInit(&key, w->name, w->len);
+        ret = RomfsWalkStep(rm, &key, nd);
         if (ret < 0) {
             return ret;
-        } else if (ret == LINK_FOLLOWED) {
-            ROMFS_TRACE("link followed -> 0x%x", offset);
-            ret = RomfsGetNodeHdr(rm, offset, nd);
-            if (ret < 0) {
-                return ret;
-            }
         }
     }
 
+    if (ret < 0) {
+        return ret;
+    }
+
     ROMFS_TRACE("---");
+    return RomfsWalkFinish(rm, nd);
+}
+
+int RomfsFindEntryN(const struct romfs_t *rm, uint32_t offset, const char *path, size_t len, nodehdr_t *nd)
+{
+    const char *start = path;
+    path_walk_t w;
+    uint32_t hash;
+    int ret;
+
+    ret = UtilsPathWalkInit(&w, path, len);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (rm->dcache.size == 0) {
+        return FindEntryWalk(rm, offset, &w, nd);
+    }
+
+    len = (size_t)(w.end - start);
+    hash = RomfsNameHash(start, len);
+    if (RomfsDcacheGet(rm, offset, start, len, hash, nd) == 0) {
+        ROMFS_TRACE("path cache hit \"%.*s\" -> 0x%x", (int)len, start, nd->off);
+        return 0;
+    }
+
+    ret = FindEntryWalk(rm, offset, &w, nd);
+    if (ret >= 0) {
+        RomfsDcachePut(rm, offset, start, len, hash, nd);
+    }
+
     return ret;
 }
+
+int RomfsFindEntryCompiled(const struct romfs_t *rm, uint32_t offset, const struct romfs_path_t *cp, nodehdr_t *nd)
+{
+    int ret;
+
+    if (rm->dcache.size != 0 && RomfsDcacheGet(rm, offset, cp->path, cp->len, cp->hash, nd) == 0) {
+        ROMFS_TRACE("path cache hit \"%s\" -> 0x%x", cp->path, nd->off);
+        return 0;
+    }
+
+    ret = RomfsGetNodeHdr(rm, offset, nd);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (uint32_t i = 0; i < cp->count; i++) {
+        ret = RomfsWalkStep(rm, &cp->comp[i], nd);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = RomfsWalkFinish(rm, nd);
+    if (ret >= 0 && rm->dcache.size != 0) {
+        RomfsDcachePut(rm, offset, cp->path, cp->len, cp->hash, nd);
+    }
+
+    return ret;
+}
+
+int RomfsFindEntry(const struct romfs_t *rm, uint32_t offset, const char* path, nodehdr_t *nd)
+{
+    return RomfsFindEntryN(rm, offset, path, MAX_PATH_LEN, nd);
+}
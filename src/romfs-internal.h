@@ -1,6 +1,9 @@
 #pragma once
 
+#include <string.h>
+
 #include <romfs.h>
+#include <path_utils.h>
 
 #if DEBUG
 #   include <stdio.h>
@@ -9,7 +12,60 @@
 #   define ROMFS_TRACE(fmt, ...)
 #endif
 
-#define MAX_OPEN    20  ///> Max number of open files at once. Root is preopened
+// Hard cap, the segment directory is sized from it at compile time. Used to be 20.
+#ifndef MAX_OPEN
+#   define MAX_OPEN 4096    ///> Max number of open files at once. Root is preopened
+#endif
+
+#define RESVD_FDS   3   ///> Count of reserved file descriptor numbers: stdin, stdout, stderr
+
+#define ROMFS_CACHELINE 64
+
+#if defined(__GNUC__)
+#   define ROMFS_ALIGNED(n) __attribute__((aligned(n)))
+#else
+#   define ROMFS_ALIGNED(n)
+#endif
+
+// Locking, used only by the optional caches which are filled from lookups
+
+#if defined(__GNUC__)
+typedef int romfs_lock_t;
+
+static inline void RomfsLock(romfs_lock_t *l)
+{
+    while (__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(l, __ATOMIC_RELAXED)) { }
+    }
+}
+
+static inline int RomfsTryLock(romfs_lock_t *l)
+{
+    return !__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void RomfsUnlock(romfs_lock_t *l)
+{
+    __atomic_store_n(l, 0, __ATOMIC_RELEASE);
+}
+
+static inline void RomfsCount(uint32_t *c)
+{
+    __atomic_fetch_add(c, 1, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t RomfsUnref(uint32_t *c)
+{
+    return __atomic_sub_fetch(c, 1, __ATOMIC_ACQ_REL);
+}
+#else
+typedef int romfs_lock_t;
+#   define RomfsLock(l)     ((void)(l))
+#   define RomfsTryLock(l)  ((void)(l), 1)
+#   define RomfsUnlock(l)   ((void)(l))
+#   define RomfsCount(c)    ((void)(++*(c)))
+#   define RomfsUnref(c)    (--*(c))
+#endif
 
 // Volume header
 
@@ -40,6 +96,24 @@
 
 #define ROMF_MAX_LINKS        16
 
+#if defined(__GNUC__)
+#   define ROMFS_PREFETCH(addr)  __builtin_prefetch((addr))
+#else
+#   define ROMFS_PREFETCH(addr)
+#endif
+
+// Name compare key, query name NUL padded to whole SIMD blocks and its hash
+
+#define NAMEKEY_LEN   ((MAX_NAME_LEN + 1 + 31) & ~31)
+
+typedef struct {
+    const char *name;
+    size_t     len;
+    uint32_t   hash;        ///> RomfsNameHash of the name
+    int        padded;      ///> Name fits into pad, block compare can be used
+    char       pad[NAMEKEY_LEN];
+} namekey_t;
+
 typedef struct {
     uint32_t off;
     uint32_t next;
@@ -48,14 +122,31 @@ typedef struct {
     uint32_t chksum;
     const char *name;
     uint32_t dataOff;
+    uint32_t slot;      ///> Node table index + 1, 0 if decoded from the image
     uint8_t mode;
 } nodehdr_t;
 
+// Descriptor table. Grows a segment at a time, slots are claimed in the segment bitmap
+// with atomic ops. Each descriptor has its own cache line, cursors of fds used by
+// different threads don't share one.
+
 typedef struct fildes_t {
-    uint8_t     opened;
-    nodehdr_t   node;
-    void        *cur;
-} fildes_t;
+    romfs_file_t file;
+} ROMFS_ALIGNED(ROMFS_CACHELINE) fildes_t;
+
+#define FD_SEG_SIZE  64     ///> Descriptors per segment, one bitmap word
+#define FD_MAX_SEGS  ((MAX_OPEN + FD_SEG_SIZE - 1) / FD_SEG_SIZE)    ///> Segment directory size, fixed
+
+typedef struct {
+    uint64_t    used;       ///> Bit per open descriptor
+    void        *mem;       ///> Allocation the aligned segment lives in
+    fildes_t    fd[FD_SEG_SIZE];
+} fdseg_t;
+
+typedef struct {
+    fdseg_t     *seg[FD_MAX_SEGS];
+    uint32_t    hint;       ///> Lowest segment likely to have a free slot
+} fdtable_t;
 
 typedef struct {
     size_t size;
@@ -64,14 +155,365 @@ typedef struct {
     uint32_t rootOff;
 } volume_t;
 
+typedef struct {
+    uint32_t  key;
+    uintptr_t val;
+} mapslot_t;
+
+typedef struct {
+    mapslot_t *slots;
+    uint32_t  mask;
+    uint32_t  count;
+} romfs_map_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t off;
+} dirslot_t;
+
+typedef struct dirindex_t {
+    uint32_t  head;     ///> Offset of the first header in the directory chain
+    uint32_t  count;    ///> Number of entries in the chain
+    uint32_t  mask;     ///> Slot count - 1, slot count is a power of 2
+    uint32_t  refs;     ///> Lazy mode: one for the map, one per search probing it unlocked
+    struct dirindex_t *prev;    ///> Lazy mode LRU list, towards most recently used
+    struct dirindex_t *next;    ///> Lazy mode LRU list, towards least recently used
+    dirslot_t slot[];
+} dirindex_t;
+
+typedef struct {
+    romfs_map_t  dirs;      ///> Chain head offset -> dirindex_t *
+    romfs_map_t  skip;      ///> Lazy mode: chain head offset -> 1, chain left to the linear search
+    size_t       bytes;     ///> Memory used by dirindex_t tables, maps excluded
+    dirindex_t   *mru;      ///> Lazy mode LRU list ends
+    dirindex_t   *lru;
+    uint32_t     buildUs;
+    uint32_t     evictions;
+    romfs_lock_t lock;
+} romfs_index_t;
+
+typedef struct {
+    uint32_t  mask;     ///> Bit count - 1, bit count is a power of 2
+    uint32_t  probes;   ///> Number of bits set per name
+    uint64_t  bits[];
+} dirbloom_t;
+
+typedef struct {
+    romfs_map_t  dirs;      ///> Chain head offset -> dirbloom_t *
+    size_t       bytes;     ///> Memory used by dirbloom_t filters, map excluded
+    uint32_t     negatives;
+    uint32_t     falsePositives;
+    romfs_lock_t lock;
+} romfs_bloom_t;
+
+typedef struct {
+    romfs_map_t  done;      ///> Header offset -> 0 or EIO, lazy mode only
+    uint32_t     nodes;
+    uint32_t     failures;
+    romfs_lock_t lock;
+} romfs_verify_t;
+
+// SHA-256 and verified reads
+
+#define SHA256_LEN          32
+
+typedef struct {
+    uint32_t    h[8];
+    uint64_t    len;
+    uint8_t     buf[64];
+} sha256_t;
+
+#define VERITY_BLOCK        4096
+#define VERITY_HASHES       (VERITY_BLOCK / SHA256_LEN)     ///> Hashes in one tree block
+#define VERITY_MAX_LEVELS   8
+
+typedef struct {
+    const uint8_t *tree;    ///> First tree block of the file in the sidecar
+    const uint8_t *root;    ///> Root hash, from the sidecar table
+    uint32_t    blocks;     ///> Data blocks
+    uint32_t    levels;     ///> Tree levels, 0 for single block files
+    uint32_t    base[VERITY_MAX_LEVELS];    ///> Index of the first tree block of each level
+    uint32_t    bits[];     ///> Verified data blocks, then verified tree blocks
+} filevty_t;
+
+typedef struct {
+    const uint8_t *buf;     ///> Sidecar, NULL if verified reads are off
+    size_t      len;
+    uint32_t    count;      ///> Files in the sidecar table
+    romfs_map_t files;      ///> Inode -> filevty_t *, added on first read of the file
+    size_t      bytes;      ///> Memory used by filevty_t states, map excluded
+    uint32_t    hashed;
+    uint32_t    failures;
+    romfs_lock_t lock;
+} romfs_verity_t;
+
+// Device images, read through a callback instead of memory
+
+#define DEV_BLOCK_SIZE      512     ///> Default cache block size
+#define DEV_CACHE_BLOCKS    64      ///> Default number of cached blocks
+#define DEV_RA_MIN          2       ///> First readahead window, in blocks
+#define DEV_NAME_MAX        256     ///> Longest header name accepted from a device
+#define DEV_ARENA_CHUNK     4096
+#define DEV_BATCH           16      ///> Most device reads submitted in one round
+#define DEV_BLOCK_NONE      0xFFFFFFFF
+
+/* One device read of a batch. */
+typedef struct {
+    uint32_t    off;
+    uint8_t     *buf;
+    size_t      len;
+    int         ret;        ///> 0 or -errno, set when the batch is done
+} devio_t;
+
+typedef struct romfs_aio_t romfs_aio_t;
+typedef struct romfs_async_t romfs_async_t;
+
+typedef struct {
+    uint32_t    tag;        ///> Block number + 1, 0 if empty
+    uint32_t    chain;      ///> Next block in hash bucket
+    uint32_t    prev;       ///> LRU list, towards most recently used
+    uint32_t    next;       ///> LRU list, towards least recently used
+    uint32_t    ahead;      ///> Bytes read ahead and not used yet
+    uint32_t    busy;       ///> Claimed by a batch whose read is not done, data not valid yet
+    uint8_t     *data;
+} devblock_t;
+
+typedef struct devchunk_t {
+    struct devchunk_t *next;
+    size_t      used;
+    size_t      size;
+    uint8_t     buf[];
+} devchunk_t;
+
+typedef struct {
+    romfs_devread_t read;   ///> Caller's callback, NULL for images in memory and files
+    void        *ctx;
+    romfs_aio_t *aio;       ///> Image file reader, NULL unless loaded by RomfsLoadFd
+    romfs_async_t *async;   ///> Background fetches of non-blocking reads, started on first use
+    romfs_lock_t asyncLock;
+    uint32_t    blockSize;
+    uint32_t    shift;      ///> log2 of blockSize
+    uint32_t    count;      ///> Number of cached blocks
+    uint32_t    used;
+    devblock_t  *blocks;
+    uint32_t    *bucket;
+    uint32_t    mask;
+    uint32_t    head;       ///> Most recently used
+    uint32_t    tail;       ///> Least recently used
+    uint8_t     *mem;       ///> Data of all cached blocks, aligned for the file reader
+    uint8_t     *raBuf;     ///> Readahead runs are read here, then split into blocks
+    void        *memAlloc;  ///> What mem and raBuf were carved from
+    void        *raAlloc;
+    uint32_t    raMax;      ///> Largest readahead window in bytes, 0 if readahead is off
+    romfs_map_t hdrs;       ///> Header offset -> copy of the header and its name in the arena
+    devchunk_t  *arena;     ///> Newest chunk first, freed only at unload
+    size_t      arenaBytes;
+    uint32_t    reads;      ///> Device reads issued
+    uint32_t    rounds;     ///> Batches of them submitted
+    uint32_t    hits;
+    uint32_t    misses;
+    uint64_t    raBytes;    ///> Bytes read ahead
+    uint64_t    raWasted;   ///> Bytes read ahead and evicted unused
+    int         raBusy;     ///> raBuf is in use by a readahead
+    romfs_lock_t lock;      ///> Cache state, never held across device reads
+    void        *io;        ///> Lock serializing device reads, sleeps where there are threads
+} romfs_dev_t;
+
+#define NODE_NONE   0xFFFFFFFF  ///> Node table: no such node / end of chain
+
+typedef struct {
+    uint32_t    count;      ///> Number of decoded nodes, 0 if table is not built
+    uint32_t    *off;       ///> Header offset
+    uint32_t    *next;      ///> Table index of next header in chain, NODE_NONE at the end
+    uint32_t    *link;      ///> Table index info points to for directories and hardlinks, else NODE_NONE
+    uint32_t    *info;
+    uint32_t    *size;
+    uint32_t    *dataOff;
+    uint32_t    *chksum;
+    uint32_t    *nameHash;
+    uint32_t    *nameLen;
+    uint8_t     *mode;
+    romfs_map_t map;        ///> Header offset -> table index
+    size_t      bytes;
+} nodetable_t;
+
+#define DENTRY_NONE 0xFFFFFFFF  ///> Path cache: no entry
+
+typedef struct {
+    uint32_t    start;      ///> Offset the lookup started from
+    uint32_t    hash;
+    uint32_t    len;
+    uint32_t    chain;      ///> Next entry in hash bucket
+    uint32_t    ref;        ///> Hit since the clock hand last passed
+    nodehdr_t   node;       ///> Resolved header, hardlinks followed
+    char        path[MAX_PATH_LEN];
+} dentry_t;
+
+typedef struct {
+    dentry_t     *ent;
+    uint32_t     *bucket;
+    uint32_t     mask;
+    uint32_t     size;      ///> Capacity, 0 if cache is disabled
+    uint32_t     used;
+    uint32_t     hand;      ///> Next entry the clock looks at for eviction
+    uint32_t     hits;
+    uint32_t     misses;
+    uint32_t     evictions;
+    romfs_lock_t lock;
+} dcache_t;
+
+struct romfs_path_t {
+    uint32_t    count;      ///> Number of components
+    uint32_t    len;        ///> Length of the path, without trailing garbage after NUL
+    uint32_t    hash;       ///> RomfsNameHash of the whole path, path cache key
+    char        *path;      ///> Own copy of the path, components point into it
+    namekey_t   comp[];
+};
+
+#define INDEX_ENABLED(rm)   ((rm)->opts.flags & (ROMFS_OPT_DIR_INDEX | ROMFS_OPT_DIR_INDEX_LAZY))
+#define BLOOM_ENABLED(rm)   ((rm)->opts.flags & (ROMFS_OPT_DIR_BLOOM | ROMFS_OPT_DIR_BLOOM_LAZY))
+#define VERIFY_ENABLED(rm)  ((rm)->opts.flags & (ROMFS_OPT_VERIFY | ROMFS_OPT_VERIFY_LAZY))
+
 struct romfs_t {
     uint8_t *img;
     size_t size;
     volume_t vol;
-    fildes_t fildes[MAX_OPEN];
+    romfs_opts_t opts;
+    romfs_index_t index;
+    romfs_bloom_t bloom;
+    romfs_verify_t verify;
+    romfs_verity_t verity;
+    romfs_dev_t dev;
+    nodetable_t nodes;
+    romfs_map_t links;      ///> Hardlink offset -> final target offset, empty if not built
+    romfs_map_t inos;       ///> Offset of every header reachable from the root, built on first by-inode call
+    romfs_lock_t inosLock;
+    dcache_t dcache;
+    fdtable_t fdt;
 };
 
-int RomfsVolumeConfigure(const uint8_t *buf, volume_t *vol);
+int RomfsDevInit(struct romfs_t *rm, romfs_devread_t read, void *ctx, int fd);
+int RomfsDevRead(const struct romfs_t *rm, uint32_t off, void *buf, size_t len);
+void RomfsDevReadMany(const struct romfs_t *rm, devio_t *io, size_t n);
+int RomfsDevHeader(const struct romfs_t *rm, uint32_t off, const uint8_t **hdr);
+void RomfsDevReadahead(const struct romfs_t *rm, romfs_file_t *file, size_t len);
+int RomfsDevReadNowait(const struct romfs_t *rm, const romfs_file_t *file, uint32_t off, void *buf, size_t len);
+int RomfsDevFill(const struct romfs_t *rm, uint32_t off, size_t len, int ahead);
+const char *RomfsDevName(const struct romfs_t *rm, uint32_t off);
+void RomfsDevFree(romfs_dev_t *d);
+
+int RomfsAioInit(int fd, const romfs_opts_t *opts, size_t *size, romfs_aio_t **aio);
+void RomfsAioSubmit(romfs_aio_t *aio, devio_t *io, size_t n);
+uint32_t RomfsAioAlign(const romfs_aio_t *aio);
+void RomfsAioStats(const romfs_aio_t *aio, romfs_stats_t *stats);
+void RomfsAioFree(romfs_aio_t *aio);
+
+int RomfsAsyncQueue(const struct romfs_t *rm, uint32_t ino, uint32_t off, uint32_t len, int notify);
+void RomfsAsyncStats(const struct romfs_t *rm, romfs_stats_t *stats);
+void RomfsAsyncFree(romfs_dev_t *d);
+
+/* Copies image bytes, callers check the bounds. Plain copy for images in memory. */
+static inline int RomfsImgRead(const struct romfs_t *rm, uint32_t off, void *buf, size_t len)
+{
+    if (rm->img != NULL) {
+        memcpy(buf, rm->img + off, len);
+        return 0;
+    }
+
+    return RomfsDevRead(rm, off, buf, len);
+}
+
+/* Name of a header decoded before, valid until unload. */
+static inline const char *RomfsImgName(const struct romfs_t *rm, uint32_t off)
+{
+    if (rm->img != NULL) return (const char *)rm->img + off + FILEHDR_NAME_OFF;
+
+    return RomfsDevName(rm, off);
+}
+
+int RomfsVolumeConfigure(const uint8_t *buf, size_t size, volume_t *vol);
 int RomfsGetNodeHdr(const struct romfs_t *rm, uint32_t offset, nodehdr_t *nd);
 int RomfsSearchDir(const struct romfs_t *rm, const char *name, uint32_t *offset);
+int RomfsSearchDirN(const struct romfs_t *rm, const char *name, size_t len, uint32_t *offset);
+int RomfsSearchDirKey(const struct romfs_t *rm, const namekey_t *k, uint32_t *offset);
+/* Tree walk visitor. Return 0 to continue, <0 to abort with error, >0 to stop the walk. */
+typedef int (*romfs_visit_t)(const struct romfs_t *rm, const nodehdr_t *nd, uint32_t head, void *ctx);
+
+int RomfsTreeWalk(const struct romfs_t *rm, romfs_visit_t visit, void *ctx);
+
+#define LINK_FOLLOWED       1
+#define LINK_NOT_FOLLOWED   0
+
+void RomfsFileInit(romfs_file_t *file, const nodehdr_t *node);
+
+int RomfsOpenNode(struct romfs_t *t, const nodehdr_t *node, int flags);
+int RomfsFindIno(const struct romfs_t *t, uint32_t ino, nodehdr_t *node);
+int RomfsFdAlloc(fdtable_t *t);
+fildes_t *RomfsFdGet(const fdtable_t *t, int fd);
+void RomfsFdRelease(fdtable_t *t, int fd);
+void RomfsFdTableFree(fdtable_t *t);
+
+int RomfsResolveLink(const struct romfs_t *rm, uint32_t offset, uint32_t *destOffset);
+int RomfsLinkTableBuild(struct romfs_t *rm);
+void RomfsLinkTableFree(romfs_map_t *links);
+int RomfsNodeValid(const struct romfs_t *rm, uint32_t offset);
+int RomfsWalkStep(const struct romfs_t *rm, const namekey_t *k, nodehdr_t *nd);
+int RomfsWalkFinish(const struct romfs_t *rm, nodehdr_t *nd);
 int RomfsFindEntry(const struct romfs_t *rm, uint32_t startOffset, const char* path, nodehdr_t *nd);
+int RomfsFindEntryN(const struct romfs_t *rm, uint32_t startOffset, const char *path, size_t len, nodehdr_t *nd);
+int RomfsFindEntryCompiled(const struct romfs_t *rm, uint32_t startOffset, const struct romfs_path_t *cp, nodehdr_t *nd);
+
+#define INDEX_NOT_FOUND 1   ///> Chain has no index, caller should fall back to linear search
+
+uint32_t RomfsNameHash(const char *name, size_t len);
+int RomfsIndexBuild(struct romfs_t *rm);
+int RomfsIndexSearch(const struct romfs_t *rm, const namekey_t *k, uint32_t *offset);
+void RomfsIndexFree(romfs_index_t *idx);
+
+#define BLOOM_ABSENT    0   ///> Name is definitely not in the directory
+#define BLOOM_MAYBE     1   ///> Name may be in the directory
+#define BLOOM_NONE      2   ///> Directory has no filter
+
+int RomfsBloomBuild(struct romfs_t *rm);
+int RomfsBloomCheck(const struct romfs_t *rm, const namekey_t *k, uint32_t head);
+void RomfsBloomFree(romfs_bloom_t *b);
+
+int RomfsVerifyNode(const struct romfs_t *rm, const nodehdr_t *nd);
+int RomfsVerifyVolume(const struct romfs_t *rm);
+int RomfsVerifyBuild(struct romfs_t *rm);
+int RomfsVerifyOpen(const struct romfs_t *rm, const nodehdr_t *nd);
+void RomfsVerifyFree(romfs_verify_t *v);
+
+void RomfsSha256Init(sha256_t *c);
+void RomfsSha256Update(sha256_t *c, const void *data, size_t len);
+void RomfsSha256Final(sha256_t *c, uint8_t out[SHA256_LEN]);
+
+int RomfsVerityInit(struct romfs_t *rm);
+int RomfsVerityCheck(const struct romfs_t *rm, const romfs_file_t *file, uint32_t off, size_t len);
+int RomfsVerityCheckNowait(const struct romfs_t *rm, const romfs_file_t *file, uint32_t off, size_t *len);
+void RomfsVerityFree(romfs_verity_t *v);
+
+int RomfsMapInit(romfs_map_t *m, uint32_t hint);
+void RomfsMapFree(romfs_map_t *m);
+int RomfsMapGet(const romfs_map_t *m, uint32_t key, uintptr_t *val);
+int RomfsMapPut(romfs_map_t *m, uint32_t key, uintptr_t val);
+int RomfsMapDel(romfs_map_t *m, uint32_t key);
+size_t RomfsMapBytes(const romfs_map_t *m);
+
+int RomfsNodeTableBuild(struct romfs_t *rm);
+void RomfsNodeTableFree(nodetable_t *t);
+uint32_t RomfsNodeTableFind(const nodetable_t *t, uint32_t offset);
+void RomfsNodeTableGet(const struct romfs_t *rm, uint32_t i, nodehdr_t *nd);
+int RomfsNodeTableSearch(const struct romfs_t *rm, const namekey_t *k, uint32_t *offset);
+int RomfsNodeTableStep(const struct romfs_t *rm, const namekey_t *k, nodehdr_t *nd);
+int RomfsGetNodeHdrFrom(const struct romfs_t *rm, const nodehdr_t *from, uint32_t offset, nodehdr_t *nd);
+
+int RomfsDcacheInit(dcache_t *dc, uint32_t size);
+void RomfsDcacheFree(dcache_t *dc);
+int RomfsDcacheGet(const struct romfs_t *rm, uint32_t start, const char *path, size_t len, uint32_t hash, nodehdr_t *nd);
+void RomfsDcachePut(const struct romfs_t *rm, uint32_t start, const char *path, size_t len, uint32_t hash, const nodehdr_t *nd);
+
+size_t RomfsNameLen(const char *name, size_t max);
+void RomfsNameKeyInit(namekey_t *k, const char *name, size_t len);
+int RomfsNameKeyEq(const namekey_t *k, const char *node, size_t avail);
+uint32_t RomfsChecksum(const uint8_t *buf, size_t len);
@@ -0,0 +1,59 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "romfs-internal.h"
+
+/* Resolved hardlink table.
+ *
+ * Every hardlink reachable from the root is followed to its final target once at load, so
+ * lookups jump to the target with a single probe instead of decoding each link on the way.
+ * Looped or too long link chains are found here and fail the load with -ELOOP.
+ */
+
+static
+int VisitLink(const struct romfs_t *rm, const nodehdr_t *nd, uint32_t head, void *ctx)
+{
+    romfs_map_t *links = (romfs_map_t *)ctx;
+    uint32_t target;
+    int ret;
+
+    if (!IS_HARDLINK(nd->mode)) return 0;
+
+    ret = RomfsResolveLink(rm, nd->off, &target);
+    if (ret < 0) {
+        ROMFS_TRACE("bad hardlink at 0x%x: %d", nd->off, ret);
+        return ret;
+    }
+
+    return RomfsMapPut(links, nd->off, target);
+}
+
+/** public functions **/
+
+int RomfsLinkTableBuild(struct romfs_t *rm)
+{
+    romfs_map_t links;
+    int ret;
+
+    ret = RomfsMapInit(&links, 16);
+    if (ret < 0) return ret;
+
+    // resolve against the image, not against a half built table
+    ret = RomfsTreeWalk(rm, VisitLink, &links);
+    if (ret < 0) {
+        RomfsMapFree(&links);
+        return ret;
+    }
+
+    rm->links = links;
+
+    ROMFS_TRACE("link table: %u links", rm->links.count);
+
+    return 0;
+}
+
+void RomfsLinkTableFree(romfs_map_t *links)
+{
+    RomfsMapFree(links);
+}
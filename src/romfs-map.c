@@ -0,0 +1,135 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "romfs-internal.h"
+
+/* Small open addressing hash map keyed by image offsets.
+ * Offsets are never zero (volume header lives there), so key 0 marks an empty slot.
+ */
+
+#define MAP_MIN_SIZE    16
+
+static inline
+uint32_t MapSlot(const romfs_map_t *m, uint32_t key)
+{
+    // offsets are 16 byte aligned, drop the always-zero bits before mixing
+    return ((key >> 4) * 2654435761u) & m->mask;
+}
+
+static
+int MapResize(romfs_map_t *m, uint32_t size)
+{
+    romfs_map_t n;
+
+    n.slots = (mapslot_t *)RomfsMalloc(size * sizeof(mapslot_t));
+    if (NULL == n.slots) return -ENOMEM;
+
+    memset(n.slots, 0, size * sizeof(mapslot_t));
+    n.mask = size - 1;
+    n.count = 0;
+
+    for (uint32_t i = 0; m->slots != NULL && i <= m->mask; i++) {
+        if (m->slots[i].key != 0) {
+            RomfsMapPut(&n, m->slots[i].key, m->slots[i].val);
+        }
+    }
+
+    RomfsFree(m->slots);
+    *m = n;
+
+    return 0;
+}
+
+int RomfsMapInit(romfs_map_t *m, uint32_t hint)
+{
+    uint32_t size = MAP_MIN_SIZE;
+
+    while (size < hint * 2) size <<= 1;
+
+    m->slots = NULL;
+    m->mask = 0;
+    m->count = 0;
+
+    return MapResize(m, size);
+}
+
+void RomfsMapFree(romfs_map_t *m)
+{
+    RomfsFree(m->slots);
+    m->slots = NULL;
+    m->mask = 0;
+    m->count = 0;
+}
+
+int RomfsMapGet(const romfs_map_t *m, uint32_t key, uintptr_t *val)
+{
+    if (NULL == m->slots || key == 0) return -ENOENT;
+
+    for (uint32_t i = MapSlot(m, key); m->slots[i].key != 0; i = (i + 1) & m->mask) {
+        if (m->slots[i].key == key) {
+            if (val != NULL) *val = m->slots[i].val;
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+int RomfsMapPut(romfs_map_t *m, uint32_t key, uintptr_t val)
+{
+    uint32_t i;
+    int ret;
+
+    if (key == 0) return -EINVAL;
+
+    // keep load factor below 3/4
+    if (NULL == m->slots || (m->count + 1) * 4 > (m->mask + 1) * 3) {
+        ret = MapResize(m, m->slots ? (m->mask + 1) * 2 : MAP_MIN_SIZE);
+        if (ret < 0) return ret;
+    }
+
+    for (i = MapSlot(m, key); m->slots[i].key != 0; i = (i + 1) & m->mask) {
+        if (m->slots[i].key == key) {
+            m->slots[i].val = val;
+            return 0;
+        }
+    }
+
+    m->slots[i].key = key;
+    m->slots[i].val = val;
+    m->count++;
+
+    return 0;
+}
+
+int RomfsMapDel(romfs_map_t *m, uint32_t key)
+{
+    uint32_t i, j, k;
+
+    if (NULL == m->slots || key == 0) return -ENOENT;
+
+    for (i = MapSlot(m, key); m->slots[i].key != key; i = (i + 1) & m->mask) {
+        if (m->slots[i].key == 0) return -ENOENT;
+    }
+
+    // backward shift deletion, keeps probe chains intact without tombstones
+    for (j = (i + 1) & m->mask; m->slots[j].key != 0; j = (j + 1) & m->mask) {
+        k = MapSlot(m, m->slots[j].key);
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            m->slots[i] = m->slots[j];
+            i = j;
+        }
+    }
+
+    m->slots[i].key = 0;
+    m->slots[i].val = 0;
+    m->count--;
+
+    return 0;
+}
+
+size_t RomfsMapBytes(const romfs_map_t *m)
+{
+    return m->slots ? (m->mask + 1) * sizeof(mapslot_t) : 0;
+}
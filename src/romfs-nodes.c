@@ -0,0 +1,206 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "romfs-internal.h"
+
+/* Decoded node table.
+ *
+ * All headers reachable from the root are decoded once at load into struct-of-arrays table,
+ * so traversal reads native integers instead of swapping big-endian fields and measuring
+ * names on every visit. Sibling links, first entries of directories and hardlink targets are
+ * stored as table indexes, and headers taken from the table carry their own index, so chain
+ * walks and path steps go from index to index without looking offsets up in the map.
+ */
+
+static
+int VisitCollect(const struct romfs_t *rm, const nodehdr_t *nd, uint32_t head, void *ctx)
+{
+    romfs_map_t *map = (romfs_map_t *)ctx;
+
+    // already seen, chains never merge in a sane image
+    if (RomfsMapGet(map, nd->off, NULL) == 0) return 0;
+
+    return RomfsMapPut(map, nd->off, map->count);
+}
+
+/* Entry named k in the chain starting at table index i, NODE_NONE if there is none. */
+static
+uint32_t ChainFind(const struct romfs_t *rm, const namekey_t *k, uint32_t i)
+{
+    const nodetable_t *t = &rm->nodes;
+
+    for (; i != NODE_NONE; i = t->next[i]) {
+        if (t->nameHash[i] != k->hash || t->nameLen[i] != k->len) continue;
+
+        if (memcmp(RomfsImgName(rm, t->off[i]), k->name, k->len) == 0) return i;
+    }
+
+    return NODE_NONE;
+}
+
+/** public functions **/
+
+int RomfsNodeTableBuild(struct romfs_t *rm)
+{
+    nodetable_t *t = &rm->nodes;
+    nodehdr_t node;
+    uint8_t *mem;
+    uint32_t n;
+    int ret;
+
+    ret = RomfsMapInit(&t->map, 64);
+    if (ret < 0) return ret;
+
+    ret = RomfsTreeWalk(rm, VisitCollect, &t->map);
+    if (ret < 0) return ret;
+
+    n = t->map.count;
+    t->bytes = (size_t)n * (10 * sizeof(uint32_t) + sizeof(uint8_t));
+
+    mem = (uint8_t *)RomfsMalloc(t->bytes);
+    if (NULL == mem) return -ENOMEM;
+
+    // 32-bit columns first, keeps every column naturally aligned
+    t->off      = (uint32_t *)mem;
+    t->next     = t->off + n;
+    t->link     = t->next + n;
+    t->info     = t->link + n;
+    t->size     = t->info + n;
+    t->dataOff  = t->size + n;
+    t->chksum   = t->dataOff + n;
+    t->nameHash = t->chksum + n;
+    t->nameLen  = t->nameHash + n;
+    t->mode     = (uint8_t *)(t->nameLen + n);
+
+    for (uint32_t s = 0; s <= t->map.mask; s++) {
+        uint32_t off = t->map.slots[s].key;
+        uint32_t i = (uint32_t)t->map.slots[s].val;
+        uintptr_t next;
+        size_t len;
+
+        if (off == 0) continue;
+
+        ret = RomfsGetNodeHdr(rm, off, &node);
+        if (ret < 0) return ret;
+
+        len = RomfsNameLen(node.name, rm->size - off - FILEHDR_NAME_OFF);
+
+        t->off[i]      = off;
+        t->next[i]     = RomfsMapGet(&t->map, node.next, &next) == 0 ? (uint32_t)next : NODE_NONE;
+        t->link[i]     = NODE_NONE;
+        t->info[i]     = node.info;
+        t->size[i]     = node.size;
+        t->dataOff[i]  = node.dataOff;
+        t->chksum[i]   = node.chksum;
+        t->nameHash[i] = RomfsNameHash(node.name, len);
+        t->nameLen[i]  = (uint32_t)len;
+        t->mode[i]     = node.mode;
+
+        if ((IS_DIRECTORY(node.mode) || IS_HARDLINK(node.mode)) && RomfsMapGet(&t->map, node.info, &next) == 0) {
+            t->link[i] = (uint32_t)next;
+        }
+    }
+
+    // publish only once filled, RomfsGetNodeHdr above still decoded the image
+    t->count = n;
+    t->bytes += RomfsMapBytes(&t->map);
+
+    ROMFS_TRACE("node table: %u nodes, %zu bytes", t->count, t->bytes);
+
+    return 0;
+}
+
+void RomfsNodeTableFree(nodetable_t *t)
+{
+    RomfsFree(t->off);
+    RomfsMapFree(&t->map);
+    memset(t, 0, sizeof(nodetable_t));
+}
+
+uint32_t RomfsNodeTableFind(const nodetable_t *t, uint32_t offset)
+{
+    uintptr_t i;
+
+    if (RomfsMapGet(&t->map, offset, &i) != 0) return NODE_NONE;
+
+    return (uint32_t)i;
+}
+
+void RomfsNodeTableGet(const struct romfs_t *rm, uint32_t i, nodehdr_t *nd)
+{
+    const nodetable_t *t = &rm->nodes;
+
+    nd->off     = t->off[i];
+    nd->next    = t->next[i] == NODE_NONE ? 0 : t->off[t->next[i]];
+    nd->info    = t->info[i];
+    nd->size    = t->size[i];
+    nd->chksum  = t->chksum[i];
+    nd->name    = RomfsImgName(rm, t->off[i]);
+    nd->dataOff = t->dataOff[i];
+    nd->slot    = i + 1;
+    nd->mode    = t->mode[i];
+}
+
+int RomfsNodeTableSearch(const struct romfs_t *rm, const namekey_t *k, uint32_t *offset)
+{
+    const nodetable_t *t = &rm->nodes;
+    uint32_t i;
+
+    i = RomfsNodeTableFind(t, *offset);
+    if (i == NODE_NONE) return INDEX_NOT_FOUND;
+
+    i = ChainFind(rm, k, i);
+    if (i == NODE_NONE) return -ENOENT;
+
+    *offset = t->off[i];
+    return 0;
+}
+
+/* Same as a RomfsWalkStep that finds no index: links followed, then the directory searched.
+   Returns INDEX_NOT_FOUND for headers not from the table and for links it can't follow,
+   the walk by offsets sorts those out. */
+int RomfsNodeTableStep(const struct romfs_t *rm, const namekey_t *k, nodehdr_t *nd)
+{
+    const nodetable_t *t = &rm->nodes;
+    uint32_t i = nd->slot - 1;
+
+    if (nd->slot == 0) return INDEX_NOT_FOUND;
+
+    for (int n = 0; IS_HARDLINK(t->mode[i]); n++) {
+        if (n == ROMF_MAX_LINKS || t->link[i] == NODE_NONE) return INDEX_NOT_FOUND;
+        i = t->link[i];
+    }
+
+    if (IS_DIRECTORY(t->mode[i])) {
+        if (t->link[i] == NODE_NONE) return INDEX_NOT_FOUND;
+        i = t->link[i];
+    }
+
+    i = ChainFind(rm, k, i);
+    if (i == NODE_NONE) return -ENOENT;
+
+    RomfsNodeTableGet(rm, i, nd);
+    return 0;
+}
+
+/* Header at offset, which is the next or info field of from. Follows the table index if from
+   came from the table, decodes by offset otherwise. nd may be from. */
+int RomfsGetNodeHdrFrom(const struct romfs_t *rm, const nodehdr_t *from, uint32_t offset, nodehdr_t *nd)
+{
+    const nodetable_t *t = &rm->nodes;
+    uint32_t j = NODE_NONE;
+
+    if (from->slot != 0) {
+        if (offset == from->next) {
+            j = t->next[from->slot - 1];
+        } else if (offset == from->info) {
+            j = t->link[from->slot - 1];
+        }
+    }
+
+    if (j == NODE_NONE) return RomfsGetNodeHdr(rm, offset, nd);
+
+    RomfsNodeTableGet(rm, j, nd);
+    return 0;
+}
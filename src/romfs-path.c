@@ -0,0 +1,62 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "romfs-internal.h"
+
+/* Compiled paths.
+ *
+ * Path is validated, split into components and hashed once, the result can be resolved
+ * against any directory fd of any instance. Object keeps its own copy of the path, so the
+ * caller's string does not need to outlive it.
+ */
+
+/** public functions **/
+
+int RomfsPathCompile(const char *path, size_t pathLen, romfs_path_t *cp)
+{
+    struct romfs_path_t *p;
+    path_walk_t w;
+    uint32_t count = 0;
+    size_t len;
+    int ret;
+
+    if (NULL == cp) return -EINVAL;
+
+    ret = UtilsPathWalkInit(&w, path, pathLen);
+    if (ret < 0) return ret;
+
+    while ((ret = UtilsPathWalkNext(&w)) > 0) count++;
+    if (ret < 0) return ret;
+
+    len = (size_t)(w.end - path);
+
+    p = (struct romfs_path_t *)RomfsMalloc(sizeof(struct romfs_path_t) + count * sizeof(namekey_t) + len + 1);
+    if (NULL == p) return -ENOMEM;
+
+    p->path = (char *)&p->comp[count];
+    memcpy(p->path, path, len);
+    p->path[len] = '\0';
+
+    p->count = count;
+    p->len = (uint32_t)len;
+    p->hash = RomfsNameHash(p->path, len);
+
+    // second pass over the copy, so the keys reference memory owned by the object
+    UtilsPathWalkInit(&w, p->path, len);
+    for (uint32_t i = 0; UtilsPathWalkNext(&w) > 0; i++) {
+        RomfsNameKeyInit(&p->comp[i], w.name, w.len);
+    }
+
+    *cp = p;
+
+    return 0;
+}
+
+void RomfsPathFree(romfs_path_t *cp)
+{
+    if (NULL == cp) return;
+
+    RomfsFree(*cp);
+    *cp = NULL;
+}
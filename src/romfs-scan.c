@@ -0,0 +1,313 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "romfs-internal.h"
+
+#if ROMFS_THREADS && defined(__GNUC__)
+#   include <pthread.h>
+#   include <sched.h>
+#   define SCAN_THREADS 1
+#endif
+
+/* Whole image integrity scan.
+ *
+ * Unit of work is one directory chain. Every worker has its own deque of chain heads, it
+ * takes the newest head itself and steals the oldest one from other workers when it runs
+ * dry, so big subtrees spread over the workers early. Each header is claimed in a bitmap,
+ * a bit per ROMFS_ALIGNMENT bytes of the volume, when it is first reached. Header reached
+ * again through next means chains loop or merge. Directory pointing to an already claimed
+ * chain is fine, root's "." entry does just that.
+ *
+ * A single chain is walked by one worker, a huge flat directory does not split.
+ */
+
+#define SCAN_MAX_THREADS    64
+
+#if defined(__GNUC__)
+#   define LOAD(p)          __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#   define ADD(p, v)        __atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+#   define FETCH_OR(p, v)   __atomic_fetch_or((p), (v), __ATOMIC_ACQ_REL)
+#else
+#   define LOAD(p)          (*(p))
+#   define ADD(p, v)        (*(p) += (v))
+
+static inline uint32_t FETCH_OR(uint32_t *p, uint32_t v)
+{
+    uint32_t old = *p;
+    *p |= v;
+    return old;
+}
+#endif
+
+typedef struct {
+    uint32_t        *heads;
+    uint32_t        top;        ///> Oldest head, thieves take from here
+    uint32_t        bottom;     ///> One past the newest head, owner pushes and pops here
+    uint32_t        cap;
+    romfs_lock_t    lock;
+} scandeque_t;
+
+typedef struct {
+    const struct romfs_t *rm;
+    uint32_t        *seen;      ///> Claimed headers
+    scandeque_t     *dq;        ///> Deque per worker
+    uint32_t        workers;
+    uint32_t        pending;    ///> Chains queued or being walked
+    uint32_t        failures;
+    int             error;      ///> Scan could not finish, e.g. out of memory
+    romfs_report_t  report;
+    void            *ctx;
+    romfs_lock_t    lock;       ///> Serializes reports
+} scan_t;
+
+typedef struct {
+    scan_t          *s;
+    uint32_t        id;
+} scanworker_t;
+
+static
+int Claim(scan_t *s, uint32_t off)
+{
+    uint32_t slot = off / ROMFS_ALIGNMENT;
+    uint32_t bit = 1u << (slot & 31);
+
+    return !(FETCH_OR(&s->seen[slot >> 5], bit) & bit);
+}
+
+static
+void Report(scan_t *s, uint32_t off, int err)
+{
+    RomfsLock(&s->lock);
+
+    if (err == -ENOMEM) {
+        s->error = err;
+    } else {
+        s->failures++;
+        if (s->report != NULL) s->report(s->ctx, off, err);
+    }
+
+    RomfsUnlock(&s->lock);
+}
+
+static
+void Push(scan_t *s, uint32_t id, uint32_t head)
+{
+    scandeque_t *d = &s->dq[id];
+
+    ADD(&s->pending, 1);
+
+    RomfsLock(&d->lock);
+
+    if (d->bottom == d->cap) {
+        uint32_t used = d->bottom - d->top;
+
+        if (d->cap == 0 || used * 2 > d->cap) {
+            uint32_t cap = d->cap == 0 ? 16 : d->cap * 2;
+            uint32_t *h = (uint32_t *)RomfsMalloc(cap * sizeof(uint32_t));
+
+            if (NULL == h) {
+                RomfsUnlock(&d->lock);
+                ADD(&s->pending, -1);
+                Report(s, head, -ENOMEM);
+                return;
+            }
+
+            if (used != 0) memcpy(h, d->heads + d->top, used * sizeof(uint32_t));
+            RomfsFree(d->heads);
+            d->heads = h;
+            d->cap = cap;
+        } else {
+            // mostly stolen from the front, reuse that space
+            memmove(d->heads, d->heads + d->top, used * sizeof(uint32_t));
+        }
+
+        d->top = 0;
+        d->bottom = used;
+    }
+
+    d->heads[d->bottom++] = head;
+
+    RomfsUnlock(&d->lock);
+}
+
+static
+int Take(scandeque_t *d, int newest, uint32_t *head)
+{
+    int ret = 0;
+
+    RomfsLock(&d->lock);
+
+    if (d->top < d->bottom) {
+        *head = newest ? d->heads[--d->bottom] : d->heads[d->top++];
+        ret = 1;
+    }
+
+    RomfsUnlock(&d->lock);
+
+    return ret;
+}
+
+static
+void CheckNode(scan_t *s, uint32_t id, const nodehdr_t *nd)
+{
+    const struct romfs_t *rm = s->rm;
+    uint32_t dest;
+    int ret;
+
+    if (RomfsVerifyNode(rm, nd) < 0) {
+        Report(s, nd->off, -EIO);
+    }
+
+    if (IS_FILE(nd->mode) && (uint64_t)nd->dataOff + nd->size > rm->vol.size) {
+        Report(s, nd->off, -EFAULT);
+    }
+
+    if (IS_HARDLINK(nd->mode)) {
+        ret = RomfsResolveLink(rm, nd->off, &dest);
+        if (ret < 0) Report(s, nd->off, ret);
+    }
+
+    if (IS_DIRECTORY(nd->mode)) {
+        if (nd->info == 0 || nd->info >= rm->vol.size) {
+            Report(s, nd->off, -EFAULT);
+        } else if (Claim(s, nd->info)) {
+            Push(s, id, nd->info);
+        }
+    }
+}
+
+static
+void WalkChain(scan_t *s, uint32_t id, uint32_t head)
+{
+    const struct romfs_t *rm = s->rm;
+    nodehdr_t node;
+
+    for (uint32_t off = head; ; off = node.next) {
+        if (RomfsGetNodeHdr(rm, off, &node) < 0) {
+            Report(s, off, -EFAULT);
+            return;
+        }
+
+        CheckNode(s, id, &node);
+
+        if (node.next == 0) return;
+
+        if (node.next >= rm->vol.size) {
+            Report(s, off, -EFAULT);
+            return;
+        }
+
+        if (!Claim(s, node.next)) {
+            Report(s, off, -ELOOP);
+            return;
+        }
+    }
+}
+
+static
+void *Worker(void *arg)
+{
+    scanworker_t *w = (scanworker_t *)arg;
+    scan_t *s = w->s;
+    uint32_t head;
+
+    while (LOAD(&s->pending) != 0) {
+        int found = Take(&s->dq[w->id], 1, &head);
+
+        for (uint32_t i = 1; !found && i < s->workers; i++) {
+            found = Take(&s->dq[(w->id + i) % s->workers], 0, &head);
+        }
+
+        if (!found) {
+#if SCAN_THREADS
+            // chains are still being walked elsewhere, they may queue more
+            sched_yield();
+#endif
+            continue;
+        }
+
+        WalkChain(s, w->id, head);
+
+        // children are queued already, count can not drop to zero early
+        ADD(&s->pending, -1);
+    }
+
+    return NULL;
+}
+
+/** public functions **/
+
+int RomfsVerifyImage(romfs_t t, int nthreads, romfs_report_t report, void *ctx)
+{
+    scanworker_t w[SCAN_MAX_THREADS];
+    size_t words;
+    scan_t s;
+
+    if (NULL == t) return -EINVAL;
+
+#if SCAN_THREADS
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > SCAN_MAX_THREADS) nthreads = SCAN_MAX_THREADS;
+#else
+    nthreads = 1;
+#endif
+
+    memset(&s, 0, sizeof(s));
+    s.rm = t;
+    s.report = report;
+    s.ctx = ctx;
+    s.workers = (uint32_t)nthreads;
+
+    words = (t->vol.size / ROMFS_ALIGNMENT + 31) / 32 + 1;
+    s.seen = (uint32_t *)RomfsMalloc(words * sizeof(uint32_t));
+    s.dq = (scandeque_t *)RomfsMalloc(s.workers * sizeof(scandeque_t));
+    if (NULL == s.seen || NULL == s.dq) {
+        RomfsFree(s.seen);
+        RomfsFree(s.dq);
+        return -ENOMEM;
+    }
+
+    memset(s.seen, 0, words * sizeof(uint32_t));
+    memset(s.dq, 0, s.workers * sizeof(scandeque_t));
+
+    if (RomfsVerifyVolume(t) < 0) {
+        Report(&s, 0, -EIO);
+    }
+
+    Claim(&s, t->vol.rootOff);
+    Push(&s, 0, t->vol.rootOff);
+
+    for (uint32_t i = 0; i < s.workers; i++) {
+        w[i].s = &s;
+        w[i].id = i;
+    }
+
+#if SCAN_THREADS
+    pthread_t tid[SCAN_MAX_THREADS];
+    uint32_t started = 1;
+
+    // caller is worker 0, if a thread fails to start the others take its share
+    while (started < s.workers && pthread_create(&tid[started], NULL, Worker, &w[started]) == 0) {
+        started++;
+    }
+
+    Worker(&w[0]);
+
+    for (uint32_t i = 1; i < started; i++) {
+        pthread_join(tid[i], NULL);
+    }
+#else
+    Worker(&w[0]);
+#endif
+
+    ROMFS_TRACE("scan: %u workers, %u failures", s.workers, s.failures);
+
+    for (uint32_t i = 0; i < s.workers; i++) {
+        RomfsFree(s.dq[i].heads);
+    }
+    RomfsFree(s.dq);
+    RomfsFree(s.seen);
+
+    return s.error != 0 ? s.error : (int)s.failures;
+}
@@ -0,0 +1,198 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "romfs-internal.h"
+
+/* Name and checksum kernels.
+ *
+ * File names in the image start 16 byte aligned and are NUL padded to ROMFS_ALIGNMENT, so they
+ * can be scanned and compared whole blocks at a time. All loads are bounded by the number of
+ * bytes left in the image, the tail falls back to scalar code.
+ *
+ * Romfs checksum is the sum of big-endian 32 bit words, vector kernels byte swap whole
+ * registers and keep one partial sum per lane.
+ *
+ * On x86 the AVX2 kernels are compiled whatever the build targets and picked at run time when
+ * the CPU has AVX2, SSE2 and scalar code finish what is left after them.
+ */
+
+#if !defined(ROMFS_NO_SIMD) && defined(__SSE2__)
+#   include <emmintrin.h>
+#   define SIMD_SSE2 1
+#   if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#       include <immintrin.h>
+#       define SIMD_AVX2 1
+#   endif
+#elif !defined(ROMFS_NO_SIMD) && defined(__ARM_NEON)
+#   include <arm_neon.h>
+#   define SIMD_NEON 1
+#endif
+
+#if SIMD_AVX2 && defined(__AVX2__)
+#   define HAVE_AVX2()  1
+#elif SIMD_AVX2
+#   define HAVE_AVX2()  __builtin_cpu_supports("avx2")
+#endif
+
+#define ROUND_UP(n, b)  (((n) + (b) - 1) & ~(size_t)((b) - 1))
+
+#if SIMD_AVX2
+/* Returns position of the first NUL, or where whole 32 byte blocks end. */
+static __attribute__((target("avx2")))
+size_t NameLenAvx2(const char *name, size_t max)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 32 <= max; i += 32) {
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(name + i)), zero));
+        if (m) return i + (size_t)__builtin_ctz(m);
+    }
+
+    return i;
+}
+
+static __attribute__((target("avx2")))
+int NameKeyEqAvx2(const namekey_t *k, const char *node, size_t n)
+{
+    for (size_t i = 0; i < n; i += 32) {
+        uint32_t want = n - i >= 32 ? UINT32_MAX : (uint32_t)((1ull << (n - i)) - 1);
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                        _mm256_loadu_si256((const __m256i *)(node + i)),
+                        _mm256_loadu_si256((const __m256i *)(k->pad + i))));
+
+        if ((m & want) != want) return 0;
+    }
+
+    return 1;
+}
+
+/* Sum of the whole 32 byte blocks, *done is set to where they end. */
+static __attribute__((target("avx2")))
+uint32_t ChecksumAvx2(const uint8_t *buf, size_t len, size_t *done)
+{
+    const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i acc = _mm256_setzero_si256();
+    uint32_t lane[8], sum = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        acc = _mm256_add_epi32(acc, _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), swap));
+    }
+
+    _mm256_storeu_si256((__m256i *)lane, acc);
+    for (int l = 0; l < 8; l++) sum += lane[l];
+
+    *done = i;
+
+    return sum;
+}
+#endif
+
+size_t RomfsNameLen(const char *name, size_t max)
+{
+    size_t i = 0;
+
+#if SIMD_AVX2
+    if (HAVE_AVX2()) i = NameLenAvx2(name, max);
+#endif
+
+#if SIMD_SSE2
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= max; i += 16) {
+        uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(name + i)), zero));
+        if (m) return i + (size_t)__builtin_ctz(m);
+    }
+#endif
+
+    for (; i < max; i++) {
+        if (name[i] == '\0') return i;
+    }
+
+    return max;
+}
+
+void RomfsNameKeyInit(namekey_t *k, const char *name, size_t len)
+{
+    k->name = name;
+    k->len = len;
+    k->hash = RomfsNameHash(name, len);
+    k->padded = len < NAMEKEY_LEN;
+
+    if (k->padded) {
+        memcpy(k->pad, name, len);
+        memset(k->pad + len, 0, NAMEKEY_LEN - len);
+    }
+}
+
+int RomfsNameKeyEq(const namekey_t *k, const char *node, size_t avail)
+{
+    // compared bytes include the terminating NUL of the node name
+    size_t n = k->len + 1;
+
+#if SIMD_AVX2
+    if (k->padded && ROUND_UP(n, 32) <= avail && HAVE_AVX2()) return NameKeyEqAvx2(k, node, n);
+#endif
+
+#if SIMD_SSE2
+    if (k->padded && ROUND_UP(n, 16) <= avail) {
+        for (size_t i = 0; i < n; i += 16) {
+            uint32_t want = n - i >= 16 ? 0xffffu : (uint32_t)((1u << (n - i)) - 1);
+            uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                            _mm_loadu_si128((const __m128i *)(node + i)),
+                            _mm_loadu_si128((const __m128i *)(k->pad + i))));
+
+            if ((m & want) != want) return 0;
+        }
+        return 1;
+    }
+#endif
+
+    if (n > avail) return 0;
+
+    return memcmp(node, k->name, k->len) == 0 && node[k->len] == '\0';
+}
+
+uint32_t RomfsChecksum(const uint8_t *buf, size_t len)
+{
+    uint32_t sum = 0;
+    size_t i = 0;
+
+#if SIMD_AVX2
+    if (HAVE_AVX2()) sum = ChecksumAvx2(buf, len, &i);
+#endif
+
+#if SIMD_SSE2
+    __m128i acc = _mm_setzero_si128();
+    uint32_t lane[4];
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(buf + i));
+
+        // no byte shuffle in SSE2: swap bytes of 16 bit halves, then the halves
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xB1), 0xB1);
+        acc = _mm_add_epi32(acc, x);
+    }
+
+    _mm_storeu_si128((__m128i *)lane, acc);
+    for (int l = 0; l < 4; l++) sum += lane[l];
+#elif SIMD_NEON
+    uint32x4_t acc = vdupq_n_u32(0);
+
+    for (; i + 16 <= len; i += 16) {
+        acc = vaddq_u32(acc, vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(buf + i))));
+    }
+
+    sum = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) + vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+
+    // byte at a time, partial last word counts as if padded with zeros
+    for (; i < len; i++) {
+        sum += (uint32_t)buf[i] << (24 - 8 * (i & 3));
+    }
+
+    return sum;
+}
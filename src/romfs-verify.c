@@ -0,0 +1,145 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "romfs-internal.h"
+
+/* Checksum verification.
+ *
+ * Volume checksum covers the first 512 bytes of the image, a file header checksum covers the
+ * header with its name and padding, file data is not covered. Covered words of a good image
+ * sum up to zero.
+ *
+ * Lookups never verify anything. Eager mode sums every header reachable from root in
+ * RomfsLoad, lazy mode sums a header when it is opened and remembers the result. The sum is
+ * taken without the verify lock, which only guards the map of results, so opens racing on
+ * the same header may both sum it but only the first result is kept and counted.
+ */
+
+#define VOLUME_CHKSUM_LEN   512
+#define SUM_CHUNK           256     ///> Device images are summed through a buffer this big
+
+static
+int Sum(const struct romfs_t *rm, uint32_t off, size_t len, uint32_t *sum)
+{
+    uint8_t buf[SUM_CHUNK];
+    int ret;
+
+    if (rm->img != NULL) {
+        *sum = RomfsChecksum(rm->img + off, len);
+        return 0;
+    }
+
+    // chunks are whole words, partial sums add up
+    for (*sum = 0; len != 0; ) {
+        size_t n = len < SUM_CHUNK ? len : SUM_CHUNK;
+
+        ret = RomfsDevRead(rm, off, buf, n);
+        if (ret < 0) return ret;
+
+        *sum += RomfsChecksum(buf, n);
+        off += (uint32_t)n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static
+int VisitVerify(const struct romfs_t *rm, const nodehdr_t *nd, uint32_t head, void *ctx)
+{
+    romfs_verify_t *v = (romfs_verify_t *)ctx;
+    int ret;
+
+    ret = RomfsVerifyNode(rm, nd);
+
+    v->nodes++;
+    if (ret < 0) v->failures++;
+
+    return ret;
+}
+
+/** public functions **/
+
+int RomfsVerifyNode(const struct romfs_t *rm, const nodehdr_t *nd)
+{
+    uint32_t sum;
+
+    // RomfsGetNodeHdr bounds the name only, padding may still run past the image
+    if (nd->dataOff > rm->size) return -EIO;
+
+    if (Sum(rm, nd->off, nd->dataOff - nd->off, &sum) < 0 || sum != 0) {
+        ROMFS_TRACE("bad header checksum at 0x%x", nd->off);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+int RomfsVerifyVolume(const struct romfs_t *rm)
+{
+    size_t len = rm->vol.size < VOLUME_CHKSUM_LEN ? rm->vol.size : VOLUME_CHKSUM_LEN;
+    uint32_t sum;
+
+    if (len > rm->size || Sum(rm, 0, len, &sum) < 0 || sum != 0) {
+        ROMFS_TRACE("bad volume checksum");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+int RomfsVerifyBuild(struct romfs_t *rm)
+{
+    int ret;
+
+    ret = RomfsVerifyVolume(rm);
+    if (ret < 0) return ret;
+
+    if (rm->opts.flags & ROMFS_OPT_VERIFY) {
+        return RomfsTreeWalk(rm, VisitVerify, &rm->verify);
+    }
+
+    return RomfsMapInit(&rm->verify.done, 16);
+}
+
+int RomfsVerifyOpen(const struct romfs_t *rm, const nodehdr_t *nd)
+{
+    // lazy mode caches results from otherwise read-only opens
+    romfs_verify_t *v = (romfs_verify_t *)&rm->verify;
+    uintptr_t val;
+    int ret;
+
+    // eager mode has checked everything already
+    if (!(rm->opts.flags & ROMFS_OPT_VERIFY_LAZY) || (rm->opts.flags & ROMFS_OPT_VERIFY)) return 0;
+
+    RomfsLock(&v->lock);
+    ret = RomfsMapGet(&v->done, nd->off, &val);
+    RomfsUnlock(&v->lock);
+
+    if (ret == 0) return -(int)val;
+
+    // summing may read the device, the result is published afterwards
+    ret = RomfsVerifyNode(rm, nd);
+
+    RomfsLock(&v->lock);
+
+    if (RomfsMapGet(&v->done, nd->off, &val) == 0) {
+        // other thread was first, same header gives the same sum
+        ret = -(int)val;
+    } else {
+        v->nodes++;
+        if (ret < 0) v->failures++;
+
+        RomfsMapPut(&v->done, nd->off, (uintptr_t)-ret);
+    }
+
+    RomfsUnlock(&v->lock);
+
+    return ret;
+}
+
+void RomfsVerifyFree(romfs_verify_t *v)
+{
+    RomfsMapFree(&v->done);
+}
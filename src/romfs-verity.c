@@ -0,0 +1,529 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "romfs-internal.h"
+
+/* Verified reads.
+ *
+ * Works like dm-verity, per file. File data is hashed in VERITY_BLOCK blocks, hashes are
+ * packed into tree blocks of the same size, those are hashed again, level by level, until a
+ * single block is left. Its hash is the root hash of the file. A file of one block has no
+ * tree, its root is the hash of the block itself. Last data block is hashed zero padded.
+ *
+ * Sidecar holds the table of root hashes followed by the trees, numbers are big-endian:
+ *
+ *   0   "-romvty-"
+ *   8   number of files
+ *   12  block size, VERITY_BLOCK
+ *   16  table sorted by inode, 48 bytes per file: inode, size, tree offset, levels, root hash
+ *   ..  trees, level 0 first
+ *
+ * Digest of the header and table is the root of trust of the whole image. A read verifies
+ * only the blocks it touches, each up the tree to the first tree block verified before, and
+ * marks them in a per-file bitmap, so reading the same blocks again costs nothing. Sidecar
+ * comes from romfs_opts_t or is appended to the image right after the volume. It is always
+ * addressed in memory, also for device images.
+ */
+
+#define VTY_MAGIC       "-romvty-"
+#define VTY_HDR_LEN     16
+#define VTY_ENTRY_LEN   48
+#define VTY_ROOT_OFF    16      ///> Root hash in a table entry
+
+#if defined(__GNUC__)
+#   define LOAD(p)          __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#   define FETCH_OR(p, v)   __atomic_fetch_or((p), (v), __ATOMIC_ACQ_REL)
+#else
+#   define LOAD(p)          (*(p))
+#   define FETCH_OR(p, v)   (*(p) |= (v))
+#endif
+
+typedef struct {
+    uint32_t    *ino;
+    uint32_t    count;
+    uint32_t    cap;
+} inolist_t;
+
+static inline
+uint32_t Get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline
+void Put32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline
+uint32_t BlockCount(uint32_t size)
+{
+    return (uint32_t)(((uint64_t)size + VERITY_BLOCK - 1) / VERITY_BLOCK);
+}
+
+/* Number of tree blocks for a file of given data block count. */
+static
+uint32_t Layout(uint32_t blocks, uint32_t *levels, uint32_t *base)
+{
+    uint32_t n = blocks, total = 0;
+
+    for (*levels = 0; n > 1; (*levels)++) {
+        n = (n + VERITY_HASHES - 1) / VERITY_HASHES;
+        if (base != NULL) base[*levels] = total;
+        total += n;
+    }
+
+    return total;
+}
+
+static
+void HashPad(sha256_t *c, size_t len, uint8_t out[SHA256_LEN])
+{
+    static const uint8_t zero[64];
+
+    for (size_t pad = VERITY_BLOCK - len; pad != 0; ) {
+        size_t n = pad < sizeof(zero) ? pad : sizeof(zero);
+
+        RomfsSha256Update(c, zero, n);
+        pad -= n;
+    }
+
+    RomfsSha256Final(c, out);
+}
+
+static
+void HashBlock(const uint8_t *data, size_t len, uint8_t out[SHA256_LEN])
+{
+    sha256_t c;
+
+    RomfsSha256Init(&c);
+    RomfsSha256Update(&c, data, len);
+    HashPad(&c, len, out);
+}
+
+/* Hashes a data block of the image, device images through a small buffer. Non-blocking
+   hashes take only what the cache has, -EAGAIN queues a fetch of the block. */
+static
+int HashData(const struct romfs_t *rm, const romfs_file_t *file, uint32_t off, size_t len, int nowait,
+             uint8_t out[SHA256_LEN])
+{
+    uint8_t buf[256];
+    sha256_t c;
+    int ret;
+
+    if (rm->img != NULL) {
+        HashBlock(rm->img + off, len, out);
+        return 0;
+    }
+
+    RomfsSha256Init(&c);
+
+    for (size_t done = 0; done < len; ) {
+        size_t n = len - done < sizeof(buf) ? len - done : sizeof(buf);
+
+        if (nowait) {
+            ret = RomfsDevReadNowait(rm, file, off + (uint32_t)done, buf, n);
+            if (ret < 0) return ret;
+            n = (size_t)ret;
+        } else {
+            ret = RomfsDevRead(rm, off + (uint32_t)done, buf, n);
+            if (ret < 0) return ret;
+        }
+
+        RomfsSha256Update(&c, buf, n);
+        done += n;
+    }
+
+    HashPad(&c, len, out);
+
+    return 0;
+}
+
+static inline
+int BitTest(const uint32_t *bits, uint32_t i)
+{
+    return (LOAD(&bits[i >> 5]) >> (i & 31)) & 1;
+}
+
+static inline
+void BitSet(uint32_t *bits, uint32_t i)
+{
+    FETCH_OR(&bits[i >> 5], 1u << (i & 31));
+}
+
+static
+const uint8_t *FindEntry(const romfs_verity_t *v, uint32_t ino)
+{
+    uint32_t lo = 0, hi = v->count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const uint8_t *e = v->buf + VTY_HDR_LEN + (size_t)mid * VTY_ENTRY_LEN;
+        uint32_t key = Get32(e);
+
+        if (key == ino) return e;
+        if (key < ino) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return NULL;
+}
+
+static
+int NewState(romfs_verity_t *v, const romfs_file_t *file, filevty_t **out)
+{
+    const uint8_t *e = FindEntry(v, file->ino);
+    uint32_t blocks = BlockCount(file->size);
+    uint32_t levels, tree = Layout(blocks, &levels, NULL);
+    uint32_t treeOff;
+    filevty_t *vf;
+    size_t size;
+    int ret;
+
+    // file missing from the sidecar or described differently can't be trusted
+    if (NULL == e) return -EIO;
+
+    treeOff = Get32(e + 8);
+    if (Get32(e + 4) != file->size || Get32(e + 12) != levels ||
+        treeOff > v->len || (uint64_t)tree * VERITY_BLOCK > v->len - treeOff) {
+        return -EIO;
+    }
+
+    size = sizeof(filevty_t) + ((size_t)blocks + tree + 31) / 32 * sizeof(uint32_t);
+    vf = (filevty_t *)RomfsMalloc(size);
+    if (NULL == vf) return -ENOMEM;
+
+    memset(vf, 0, size);
+    vf->tree = v->buf + treeOff;
+    vf->root = e + VTY_ROOT_OFF;
+    vf->blocks = blocks;
+    Layout(blocks, &vf->levels, vf->base);
+
+    ret = RomfsMapPut(&v->files, file->ino, (uintptr_t)vf);
+    if (ret < 0) { RomfsFree(vf); return ret; }
+
+    v->bytes += size;
+    *out = vf;
+
+    return 0;
+}
+
+static
+int VerifyTree(romfs_verity_t *v, filevty_t *vf, uint32_t level, uint32_t i)
+{
+    uint32_t blk = vf->base[level] + i;
+    uint8_t h[SHA256_LEN];
+    const uint8_t *want;
+    int ret;
+
+    if (BitTest(vf->bits, vf->blocks + blk)) return 0;
+
+    if (level + 1 == vf->levels) {
+        want = vf->root;
+    } else {
+        ret = VerifyTree(v, vf, level + 1, i / VERITY_HASHES);
+        if (ret < 0) return ret;
+
+        want = vf->tree + (size_t)(vf->base[level + 1] + i / VERITY_HASHES) * VERITY_BLOCK +
+               (i % VERITY_HASHES) * SHA256_LEN;
+    }
+
+    HashBlock(vf->tree + (size_t)blk * VERITY_BLOCK, VERITY_BLOCK, h);
+    RomfsCount(&v->hashed);
+
+    if (memcmp(h, want, SHA256_LEN) != 0) return -EIO;
+
+    BitSet(vf->bits, vf->blocks + blk);
+
+    return 0;
+}
+
+static
+int VerifyData(const struct romfs_t *rm, romfs_verity_t *v, filevty_t *vf, const romfs_file_t *file, uint32_t b,
+               int nowait)
+{
+    uint32_t off = b * VERITY_BLOCK;
+    uint8_t h[SHA256_LEN];
+    const uint8_t *want;
+    int ret;
+
+    if (BitTest(vf->bits, b)) return 0;
+
+    if (vf->levels == 0) {
+        want = vf->root;
+    } else {
+        ret = VerifyTree(v, vf, 0, b / VERITY_HASHES);
+        if (ret < 0) return ret;
+
+        // level 0 starts the tree, hash of block b is the b-th one
+        want = vf->tree + (size_t)b * SHA256_LEN;
+    }
+
+    ret = HashData(rm, file, file->dataOff + off, file->size - off < VERITY_BLOCK ? file->size - off : VERITY_BLOCK,
+                   nowait, h);
+    if (ret < 0) return ret;
+    RomfsCount(&v->hashed);
+
+    if (memcmp(h, want, SHA256_LEN) != 0) {
+        ROMFS_TRACE("bad block %u of 0x%x", b, file->ino);
+        return -EIO;
+    }
+
+    BitSet(vf->bits, b);
+
+    return 0;
+}
+
+static
+int VisitFile(const struct romfs_t *rm, const nodehdr_t *nd, uint32_t head, void *ctx)
+{
+    inolist_t *l = (inolist_t *)ctx;
+
+    if (!IS_FILE(nd->mode)) return 0;
+
+    if (l->count == l->cap) {
+        uint32_t cap = l->cap ? l->cap * 2 : 64;
+        uint32_t *ino = (uint32_t *)RomfsMalloc(cap * sizeof(uint32_t));
+
+        if (NULL == ino) return -ENOMEM;
+
+        if (l->count != 0) memcpy(ino, l->ino, l->count * sizeof(uint32_t));
+        RomfsFree(l->ino);
+        l->ino = ino;
+        l->cap = cap;
+    }
+
+    l->ino[l->count++] = nd->off;
+
+    return 0;
+}
+
+static
+int CmpIno(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static
+int BuildTree(const struct romfs_t *rm, const nodehdr_t *nd, uint8_t *entry, uint8_t *tree)
+{
+    uint32_t blocks = BlockCount(nd->size);
+    uint32_t levels, base[VERITY_MAX_LEVELS];
+    int ret;
+
+    Layout(blocks, &levels, base);
+
+    // level 0 from the data, each level above from the one below
+    for (uint32_t b = 0; b < blocks; b++) {
+        uint32_t off = b * VERITY_BLOCK;
+
+        ret = HashData(rm, NULL, nd->dataOff + off, nd->size - off < VERITY_BLOCK ? nd->size - off : VERITY_BLOCK, 0,
+                       levels == 0 ? entry + VTY_ROOT_OFF : tree + (size_t)b * SHA256_LEN);
+        if (ret < 0) return ret;
+    }
+
+    for (uint32_t l = 1; l < levels; l++) {
+        for (uint32_t i = 0; i < base[l] - base[l - 1]; i++) {
+            HashBlock(tree + (size_t)(base[l - 1] + i) * VERITY_BLOCK, VERITY_BLOCK,
+                      tree + (size_t)base[l] * VERITY_BLOCK + (size_t)i * SHA256_LEN);
+        }
+    }
+
+    if (levels != 0) {
+        HashBlock(tree + (size_t)base[levels - 1] * VERITY_BLOCK, VERITY_BLOCK, entry + VTY_ROOT_OFF);
+    }
+
+    return 0;
+}
+
+/** public functions **/
+
+int RomfsVerityInit(struct romfs_t *rm)
+{
+    romfs_verity_t *v = &rm->verity;
+    const uint8_t *buf = rm->opts.verity;
+    size_t len = rm->opts.verityLen, table;
+    uint8_t digest[SHA256_LEN];
+    sha256_t c;
+
+    if (NULL == buf) {
+        // appended to the image after the volume, device images must pass it in opts
+        size_t off = ROMFS_ALIGNUP(rm->vol.size);
+
+        if (NULL == rm->img) return -ENOTSUP;
+        if (off >= rm->size) return -EINVAL;
+
+        buf = rm->img + off;
+        len = rm->size - off;
+    }
+
+    if (len < VTY_HDR_LEN || memcmp(buf, VTY_MAGIC, 8) != 0 || Get32(buf + 12) != VERITY_BLOCK) {
+        return -EINVAL;
+    }
+
+    v->count = Get32(buf + 8);
+    if (v->count > (len - VTY_HDR_LEN) / VTY_ENTRY_LEN) return -EINVAL;
+
+    table = VTY_HDR_LEN + (size_t)v->count * VTY_ENTRY_LEN;
+
+    if (rm->opts.verityRoot != NULL) {
+        RomfsSha256Init(&c);
+        RomfsSha256Update(&c, buf, table);
+        RomfsSha256Final(&c, digest);
+
+        if (memcmp(digest, rm->opts.verityRoot, SHA256_LEN) != 0) return -EIO;
+    }
+
+    // lookups are binary searches
+    for (uint32_t i = 1; i < v->count; i++) {
+        if (Get32(buf + VTY_HDR_LEN + i * VTY_ENTRY_LEN) <= Get32(buf + VTY_HDR_LEN + (i - 1) * VTY_ENTRY_LEN)) {
+            return -EINVAL;
+        }
+    }
+
+    v->buf = buf;
+    v->len = len;
+
+    return RomfsMapInit(&v->files, 16);
+}
+
+/* Verifies the blocks of [off, off + *len). Non-blocking checks shorten *len to end before the
+   first block that isn't cached, -EAGAIN if that is the first one. */
+static
+int Verify(const struct romfs_t *rm, const romfs_file_t *file, uint32_t off, size_t *len, int nowait)
+{
+    // block states are filled from otherwise read-only reads
+    romfs_verity_t *v = (romfs_verity_t *)&rm->verity;
+    uint32_t first = off / VERITY_BLOCK, last;
+    uintptr_t val;
+    filevty_t *vf;
+    int ret = 0;
+
+    if (NULL == v->buf || *len == 0) return 0;
+
+    RomfsLock(&v->lock);
+
+    if (RomfsMapGet(&v->files, file->ino, &val) == 0) {
+        vf = (filevty_t *)val;
+    } else {
+        ret = NewState(v, file, &vf);
+    }
+
+    RomfsUnlock(&v->lock);
+
+    last = (uint32_t)(((uint64_t)off + *len - 1) / VERITY_BLOCK);
+
+    for (uint32_t b = first; ret == 0 && b <= last; b++) {
+        ret = VerifyData(rm, v, vf, file, b, nowait);
+
+        if (ret == -EAGAIN && b != first) {
+            *len = (size_t)b * VERITY_BLOCK - off;
+            ret = 0;
+            break;
+        }
+    }
+
+    if (ret == -EIO) RomfsCount(&v->failures);
+
+    return ret;
+}
+
+int RomfsVerityCheck(const struct romfs_t *rm, const romfs_file_t *file, uint32_t off, size_t len)
+{
+    return Verify(rm, file, off, &len, 0);
+}
+
+int RomfsVerityCheckNowait(const struct romfs_t *rm, const romfs_file_t *file, uint32_t off, size_t *len)
+{
+    return Verify(rm, file, off, len, 1);
+}
+
+void RomfsVerityFree(romfs_verity_t *v)
+{
+    for (uint32_t i = 0; v->files.slots != NULL && i <= v->files.mask; i++) {
+        if (v->files.slots[i].key != 0) {
+            RomfsFree((void *)v->files.slots[i].val);
+        }
+    }
+
+    RomfsMapFree(&v->files);
+    v->bytes = 0;
+}
+
+int RomfsVerityBuild(romfs_t t, uint8_t *buf, size_t *len, uint8_t root[32])
+{
+    inolist_t files = { 0 };
+    nodehdr_t node;
+    size_t need, pos;
+    uint32_t levels;
+    sha256_t c;
+    int ret;
+
+    if (NULL == t || NULL == len) return -EINVAL;
+
+    ret = RomfsTreeWalk(t, VisitFile, &files);
+    if (ret < 0) { RomfsFree(files.ino); return ret; }
+
+    qsort(files.ino, files.count, sizeof(uint32_t), CmpIno);
+
+    need = VTY_HDR_LEN + (size_t)files.count * VTY_ENTRY_LEN;
+    for (uint32_t i = 0; i < files.count; i++) {
+        ret = RomfsGetNodeHdr(t, files.ino[i], &node);
+        if (ret < 0) { RomfsFree(files.ino); return ret; }
+
+        need += (size_t)Layout(BlockCount(node.size), &levels, NULL) * VERITY_BLOCK;
+    }
+
+    if (NULL == buf || *len < need) {
+        *len = need;
+        RomfsFree(files.ino);
+        return NULL == buf ? 0 : -ENOSPC;
+    }
+
+    *len = need;
+    memset(buf, 0, need);
+
+    memcpy(buf, VTY_MAGIC, 8);
+    Put32(buf + 8, files.count);
+    Put32(buf + 12, VERITY_BLOCK);
+
+    pos = VTY_HDR_LEN + (size_t)files.count * VTY_ENTRY_LEN;
+
+    for (uint32_t i = 0; i < files.count; i++) {
+        uint8_t *e = buf + VTY_HDR_LEN + (size_t)i * VTY_ENTRY_LEN;
+        uint32_t tree;
+
+        ret = RomfsGetNodeHdr(t, files.ino[i], &node);
+        if (ret < 0) break;
+
+        tree = Layout(BlockCount(node.size), &levels, NULL);
+
+        Put32(e, node.off);
+        Put32(e + 4, node.size);
+        Put32(e + 8, (uint32_t)pos);
+        Put32(e + 12, levels);
+
+        ret = BuildTree(t, &node, e, buf + pos);
+        if (ret < 0) break;
+
+        pos += (size_t)tree * VERITY_BLOCK;
+    }
+
+    if (ret == 0 && root != NULL) {
+        RomfsSha256Init(&c);
+        RomfsSha256Update(&c, buf, VTY_HDR_LEN + (size_t)files.count * VTY_ENTRY_LEN);
+        RomfsSha256Final(&c, root);
+    }
+
+    RomfsFree(files.ino);
+
+    return ret;
+}
@@ -6,28 +6,51 @@
 #include "romfs-internal.h"
 
 
-#define RESVD_FDS   3   ///> Count of reserved file descriptor numbers: stdin, stdout, stderr
+int RomfsOpenNode(struct romfs_t *t, const nodehdr_t *node, int flags)
+{
+    fildes_t *f;
+    int fd;
+
+    fd = RomfsVerifyOpen(t, node);
+    if (fd < 0) return fd;
+
+    fd = RomfsFdAlloc(&t->fdt);
+    if (fd < 0) return fd;
 
-#define YES 1
-#define NO 0
+    f = RomfsFdGet(&t->fdt, fd);
+    RomfsFileInit(&f->file, node);
+    f->file.flags = (uint8_t)flags;
 
-#define ABS(x)  ((x) < 0 ? -(x) : (x))
+    return fd + RESVD_FDS; // map file descriptor to number higher than reserved fds
+}
 
 static
-int FindFirstClosedFd(fildes_t *fildes)
+void FillStat(romfs_stat_t *stat, const nodehdr_t *node)
 {
-    for (int i = 0; i < MAX_OPEN; i++) {
-        if (!fildes[i].opened) {
-            return i;
-        }
-    }
-    return -EMFILE;
+    stat->ino    = node->off;
+    stat->chksum = node->chksum;
+    stat->size   = node->size;
+    stat->mode   = node->mode;
 }
 
-/* PUBLIC functions */
+int RomfsFindIno(const struct romfs_t *t, uint32_t ino, nodehdr_t *node)
+{
+    int ret;
 
-int RomfsLoad(uint8_t * img, size_t imgSize, romfs_t *rom)
+    ret = RomfsNodeValid(t, ino);
+    if (ret < 0) return ret;
+
+    ret = RomfsGetNodeHdr(t, ino, node);
+    if (ret < 0) return ret;
+
+    return RomfsWalkFinish(t, node);
+}
+
+/* Memory image when img is set, device image read through read or from file fd otherwise. */
+static
+int Load(uint8_t *img, size_t imgSize, romfs_devread_t read, void *ctx, int fd, const romfs_opts_t *opts, romfs_t *rom)
 {
+    nodehdr_t root;
     int ret = 0;
     ROMFS_TRACE("Romfs lib, v.%s", ROMFS_VERSION);
 
@@ -38,10 +61,16 @@ int RomfsLoad(uint8_t * img, size_t imgSize, romfs_t *rom)
 
     struct romfs_t *r = *rom;
 
+    memset(r, 0, sizeof(struct romfs_t));
+
     r->img = img;
     r->size = imgSize;
 
-    ret = RomfsVolumeConfigure(r->img, &r->vol);
+    if (opts != NULL) {
+        r->opts = *opts;
+    }
+
+    ret = NULL != img ? RomfsVolumeConfigure(img, imgSize, &r->vol) : RomfsDevInit(r, read, ctx, fd);
     if (ret != 0) { RomfsUnload(rom); return ret; }
 
     ROMFS_TRACE("Loaded volume \"%s\". Size is %ld bytes. First entry offset = 0x%x",
@@ -49,46 +78,162 @@ int RomfsLoad(uint8_t * img, size_t imgSize, romfs_t *rom)
         r->vol.size,
         r->vol.rootOff);
 
-    memset(r->fildes, 0, sizeof(r->fildes));
+    if (VERIFY_ENABLED(r)) {
+        ret = RomfsVerifyBuild(r);
+        if (ret != 0) { RomfsUnload(rom); return ret; }
+    }
+
+    if (r->opts.flags & ROMFS_OPT_VERITY) {
+        ret = RomfsVerityInit(r);
+        if (ret != 0) { RomfsUnload(rom); return ret; }
+    }
 
     // preopen root dir as first file descriptor
-    ret = RomfsGetNodeHdr((const struct romfs_t *)r, r->vol.rootOff, &r->fildes[0].node);
+    ret = RomfsGetNodeHdr((const struct romfs_t *)r, r->vol.rootOff, &root);
     if (ret != 0) { RomfsUnload(rom); return ret; }
 
-    r->fildes[0].opened = YES;
-    r->fildes[0].cur = (void *)(r->img + r->fildes[0].node.dataOff);
+    ret = RomfsOpenNode(r, &root, 0);
+    if (ret < 0) { RomfsUnload(rom); return ret; }
+    ret = 0;
+
+    if (r->opts.flags & ROMFS_OPT_NODE_TABLE) {
+        ret = RomfsNodeTableBuild(r);
+        if (ret != 0) { RomfsUnload(rom); return ret; }
+    }
+
+    if (r->opts.flags & ROMFS_OPT_DIR_INDEX) {
+        ret = RomfsIndexBuild(r);
+        if (ret != 0) { RomfsUnload(rom); return ret; }
+    }
+
+    if (r->opts.flags & ROMFS_OPT_LINK_TABLE) {
+        ret = RomfsLinkTableBuild(r);
+        if (ret != 0) { RomfsUnload(rom); return ret; }
+    }
+
+    if (BLOOM_ENABLED(r)) {
+        ret = RomfsBloomBuild(r);
+        if (ret != 0) { RomfsUnload(rom); return ret; }
+    }
+
+    if (r->opts.pathCacheSize != 0) {
+        ret = RomfsDcacheInit(&r->dcache, r->opts.pathCacheSize);
+        if (ret != 0) { RomfsUnload(rom); return ret; }
+    }
 
     return ret;
 }
 
+/* PUBLIC functions */
+
+int RomfsLoad(uint8_t * img, size_t imgSize, romfs_t *rom)
+{
+    return RomfsLoadOpts(img, imgSize, NULL, rom);
+}
+
+int RomfsLoadOpts(uint8_t * img, size_t imgSize, const romfs_opts_t *opts, romfs_t *rom)
+{
+    if (NULL == img) return -EINVAL;
+
+    return Load(img, imgSize, NULL, NULL, -1, opts, rom);
+}
+
+int RomfsLoadDev(romfs_devread_t read, void *ctx, size_t size, const romfs_opts_t *opts, romfs_t *rom)
+{
+    if (NULL == read) return -EINVAL;
+
+    return Load(NULL, size, read, ctx, -1, opts, rom);
+}
+
+int RomfsLoadFd(int fd, size_t size, const romfs_opts_t *opts, romfs_t *rom)
+{
+    if (fd < 0) return -EBADF;
+
+    return Load(NULL, size, NULL, NULL, fd, opts, rom);
+}
+
 void RomfsUnload(romfs_t *romfs)
 {
-    if (NULL != romfs) RomfsFree(*romfs);
+    if (NULL == romfs) return;
+
+    if (NULL != *romfs) {
+        // worker reads through the cache and calls back, it goes first
+        RomfsAsyncFree(&(*romfs)->dev);
+        RomfsIndexFree(&(*romfs)->index);
+        RomfsBloomFree(&(*romfs)->bloom);
+        RomfsVerifyFree(&(*romfs)->verify);
+        RomfsVerityFree(&(*romfs)->verity);
+        RomfsDevFree(&(*romfs)->dev);
+        RomfsLinkTableFree(&(*romfs)->links);
+        RomfsMapFree(&(*romfs)->inos);
+        RomfsNodeTableFree(&(*romfs)->nodes);
+        RomfsDcacheFree(&(*romfs)->dcache);
+        RomfsFdTableFree(&(*romfs)->fdt);
+        RomfsFree(*romfs);
+    }
     *romfs = NULL;
 }
 
 int RomfsOpenAt(romfs_t t, int fd, const char *path, int flags)
 {
-    int ret, f;
+    return RomfsOpenAtN(t, fd, path, MAX_PATH_LEN, flags);
+}
 
-    fd = fd - RESVD_FDS;
+int RomfsOpenAtN(romfs_t t, int fd, const char *path, size_t pathLen, int flags)
+{
+    nodehdr_t node;
+    fildes_t *f;
+    int ret;
 
     if (NULL == t) return -EINVAL;
 
-    if (fd < 0) return -EBADF;
+    f = RomfsFdGet(&t->fdt, fd - RESVD_FDS);
+    if (NULL == f) {
+        return -EBADF;
+    }
+
+    ret = RomfsFindEntryN(t, f->file.ino, path, pathLen, &node);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return RomfsOpenNode(t, &node, flags);
+}
+
+int RomfsOpenIno(romfs_t t, uint32_t ino, int flags)
+{
+    nodehdr_t node;
+    int ret;
 
-    f = FindFirstClosedFd(t->fildes);
-    if (f < 0) return f;
+    if (NULL == t) return -EINVAL;
 
-    ret = RomfsFindEntry(t, t->fildes[fd].node.off, path, &t->fildes[f].node);
+    ret = RomfsFindIno(t, ino, &node);
     if (ret < 0) {
         return ret;
     }
 
-    t->fildes[f].opened = YES;
-    t->fildes[f].cur = (void *)(t->img + t->fildes[f].node.dataOff);
+    return RomfsOpenNode(t, &node, flags);
+}
+
+int RomfsOpenAtCompiled(romfs_t t, int fd, romfs_path_t cp, int flags)
+{
+    nodehdr_t node;
+    fildes_t *f;
+    int ret;
+
+    if (NULL == t || NULL == cp) return -EINVAL;
+
+    f = RomfsFdGet(&t->fdt, fd - RESVD_FDS);
+    if (NULL == f) {
+        return -EBADF;
+    }
+
+    ret = RomfsFindEntryCompiled(t, f->file.ino, cp, &node);
+    if (ret < 0) {
+        return ret;
+    }
 
-    return f + RESVD_FDS; // map file descriptor to number higher than reserved fds
+    return RomfsOpenNode(t, &node, flags);
 }
 
 int RomfsOpenRoot(romfs_t t, const char *path, int flags) {
@@ -97,175 +242,198 @@ int RomfsOpenRoot(romfs_t t, const char *path, int flags) {
 
 int RomfsClose(romfs_t t, int fd)
 {
-    fd = fd - RESVD_FDS;
-
-    if (fd < 0 || fd > MAX_OPEN || !t->fildes[fd].opened) {
+    if (NULL == RomfsFdGet(&t->fdt, fd - RESVD_FDS)) {
         return -EBADF;
     }
 
-    t->fildes[fd].opened = NO;
+    RomfsFdRelease(&t->fdt, fd - RESVD_FDS);
 
     return 0;
 }
 
 int RomfsFdStat(romfs_t t, int fd, romfs_stat_t *stat)
 {
-    fd = fd - RESVD_FDS;
+    fildes_t *f;
 
-    if (fd < 0 || fd > MAX_OPEN || !t->fildes[fd].opened) {
+    f = RomfsFdGet(&t->fdt, fd - RESVD_FDS);
+    if (NULL == f) {
         return -EBADF;
     }
 
-    if (stat != NULL) {
-        stat->ino    = t->fildes[fd].node.off;
-        stat->chksum = t->fildes[fd].node.chksum;
-        stat->size   = t->fildes[fd].node.size;
-        stat->mode   = t->fildes[fd].node.mode;
-    }
-
-    return t->fildes[fd].node.mode;
+    return RomfsFileStat(t, &f->file, stat);
 }
 
 int RomfsFdStatAt(romfs_t t, int fd, const char *path, romfs_stat_t *stat) {
+    return RomfsFdStatAtN(t, fd, path, MAX_PATH_LEN, stat);
+}
+
+int RomfsFdStatAtN(romfs_t t, int fd, const char *path, size_t pathLen, romfs_stat_t *stat) {
+    fildes_t *f;
     int ret;
     nodehdr_t node;
 
     if (NULL == t) return -EINVAL;
 
-    fd = fd - RESVD_FDS;
-    if (fd < 0 || fd > MAX_OPEN || !t->fildes[fd].opened) {
+    f = RomfsFdGet(&t->fdt, fd - RESVD_FDS);
+    if (NULL == f) {
         return -EBADF;
     }
 
-    ret = RomfsFindEntry(t, t->fildes[fd].node.off, path, &node);
+    ret = RomfsFindEntryN(t, f->file.ino, path, pathLen, &node);
     if (ret < 0) {
         return ret;
     }
 
     if (stat != NULL) {
-        stat->ino    = node.off;
-        stat->chksum = node.chksum;
-        stat->size   = node.size;
-        stat->mode   = node.mode;
+        FillStat(stat, &node);
     }
 
     return node.mode;
 }
 
-int RomfsRead(romfs_t t, int fd, void *buf, size_t nbyte)
+int RomfsStatIno(romfs_t t, uint32_t ino, romfs_stat_t *stat)
 {
-    size_t toRead;
+    nodehdr_t node;
+    int ret;
 
     if (NULL == t) return -EINVAL;
 
-    if (buf == NULL) {
-        return -EINVAL;
+    ret = RomfsFindIno(t, ino, &node);
+    if (ret < 0) {
+        return ret;
     }
 
-    fd = fd - RESVD_FDS;
-    if (fd < 0 || fd > MAX_OPEN || !t->fildes[fd].opened) {
-        return -EBADF;
+    if (stat != NULL) {
+        FillStat(stat, &node);
     }
 
-    if (IS_DIRECTORY(t->fildes[fd].node.mode)) {
-        return -EISDIR;
+    return node.mode;
+}
+
+int RomfsStatAtCompiled(romfs_t t, int fd, romfs_path_t cp, romfs_stat_t *stat)
+{
+    fildes_t *f;
+    nodehdr_t node;
+    int ret;
+
+    if (NULL == t || NULL == cp) return -EINVAL;
+
+    f = RomfsFdGet(&t->fdt, fd - RESVD_FDS);
+    if (NULL == f) {
+        return -EBADF;
     }
 
-    toRead = (unsigned long)(t->img + t->fildes[fd].node.dataOff + t->fildes[fd].node.size) - (unsigned long)t->fildes[fd].cur;
-    if (nbyte > toRead) {
-        nbyte = toRead;
+    ret = RomfsFindEntryCompiled(t, f->file.ino, cp, &node);
+    if (ret < 0) {
+        return ret;
     }
 
-    if (nbyte == 0) {
-        return 0;
+    if (stat != NULL) {
+        FillStat(stat, &node);
     }
 
-    memcpy(buf, t->fildes[fd].cur, nbyte);
+    return node.mode;
+}
 
-    t->fildes[fd].cur += nbyte;
+int RomfsRead(romfs_t t, int fd, void *buf, size_t nbyte)
+{
+    fildes_t *f;
 
-    return nbyte;
+    if (NULL == t) return -EINVAL;
+
+    if (buf == NULL) {
+        return -EINVAL;
+    }
+
+    f = RomfsFdGet(&t->fdt, fd - RESVD_FDS);
+    if (NULL == f) {
+        return -EBADF;
+    }
+
+    return RomfsFileRead(t, &f->file, buf, nbyte);
 }
 
-int RomfsSeek(romfs_t t, int fd, long off, romfs_seek_t whence)
+int RomfsReadv(romfs_t t, int fd, const romfs_iovec_t *iov, int iovcnt)
 {
+    fildes_t *f;
+
     if (NULL == t) return -EINVAL;
 
-    fd = fd - RESVD_FDS;
-    if (fd < 0 || fd > MAX_OPEN || !t->fildes[fd].opened) {
+    f = RomfsFdGet(&t->fdt, fd - RESVD_FDS);
+    if (NULL == f) {
         return -EBADF;
     }
 
-    if (!IS_FILE(t->fildes[fd].node.mode)) {
+    return RomfsFileReadv(t, &f->file, iov, iovcnt);
+}
+
+int RomfsPread(romfs_t t, int fd, void *buf, size_t nbyte, uint32_t off)
+{
+    fildes_t *f;
+
+    if (NULL == t) return -EINVAL;
+
+    if (buf == NULL) {
+        return -EINVAL;
+    }
+
+    f = RomfsFdGet(&t->fdt, fd - RESVD_FDS);
+    if (NULL == f) {
         return -EBADF;
     }
 
-    if (ABS(off) > t->fildes[fd].node.size) {
-        return -EINVAL;
+    return RomfsFilePread(t, &f->file, buf, nbyte, off);
+}
+
+int RomfsPreadv(romfs_t t, int fd, const romfs_iovec_t *iov, int iovcnt, uint32_t off)
+{
+    fildes_t *f;
+
+    if (NULL == t) return -EINVAL;
+
+    f = RomfsFdGet(&t->fdt, fd - RESVD_FDS);
+    if (NULL == f) {
+        return -EBADF;
     }
 
-    ROMFS_TRACE("%p", t->fildes[fd].cur);
-
-    switch (whence)
-    {
-    case ROMFS_SEEK_SET:
-        if (off < 0) {
-            return -EINVAL;
-        }
-        t->fildes[fd].cur = (void *)(t->img + (t->fildes[fd].node.dataOff + off));
-        break;
-    case ROMFS_SEEK_CUR:
-        ROMFS_TRACE("%ld %p == %p --> %p", off, fildes[fd].cur + off,  romfs.img + fildes[fd].node.dataOff, romfs.img + fildes[fd].node.dataOff + fildes[fd].node.size);
-        if ( (t->fildes[fd].cur + off > (void *)(t->img + t->fildes[fd].node.dataOff + t->fildes[fd].node.size)) ||
-             (t->fildes[fd].cur + off < (void *)(t->img + t->fildes[fd].node.dataOff)) ) {
-            return -EINVAL;
-        }
-        t->fildes[fd].cur += off;
-        break;
-    case ROMFS_SEEK_END:
-        if (off > 0) {
-            return -EINVAL;
-        }
-        t->fildes[fd].cur = (void *)(t->img + (t->fildes[fd].node.dataOff + t->fildes[fd].node.size + off));
-        break;
-    default:
-        return -EINVAL;
-        break;
+    return RomfsFilePreadv(t, &f->file, iov, iovcnt, off);
+}
+
+int RomfsSeek(romfs_t t, int fd, long off, romfs_seek_t whence)
+{
+    fildes_t *f;
+
+    if (NULL == t) return -EINVAL;
+
+    f = RomfsFdGet(&t->fdt, fd - RESVD_FDS);
+    if (NULL == f) {
+        return -EBADF;
     }
 
-    return 0;
+    return RomfsFileSeek(t, &f->file, off, whence);
 }
 
 int RomfsTell(romfs_t t, int fd, long *off)
 {
+    fildes_t *f;
+
     if (NULL == t) return -EINVAL;
 
     if (NULL == off) {
         return -EINVAL;
     }
 
-    fd = fd - RESVD_FDS;
-    if (fd < 0 || fd > MAX_OPEN || !t->fildes[fd].opened) {
+    f = RomfsFdGet(&t->fdt, fd - RESVD_FDS);
+    if (NULL == f) {
         return -EBADF;
     }
 
-    if (!IS_FILE(t->fildes[fd].node.mode)) {
-        return -EBADF;
-    }
-
-    *off = (long)(t->fildes[fd].cur - (void *)(t->img + t->fildes[fd].node.dataOff));
-
-    return 0;
+    return RomfsFileTell(t, &f->file, off);
 }
 
-/* TODO:
-    - follow hardlinks
-    - cookie can be bad
-*/
 int RomfsReadDir(romfs_t t, int fd, romfs_dirent_t *buf, size_t bufLen, uint32_t *cookie, size_t *bufUsed)
 {
-    nodehdr_t curNode;
-    int ret;
+    fildes_t *f;
 
     if (NULL == t) return -EINVAL;
 
@@ -273,79 +441,108 @@ int RomfsReadDir(romfs_t t, int fd, romfs_dirent_t *buf, size_t bufLen, uint32_t
         return -EINVAL;
     }
 
-    fd = fd - RESVD_FDS;
-    if (fd < 0 || fd > MAX_OPEN || !t->fildes[fd].opened) {
+    f = RomfsFdGet(&t->fdt, fd - RESVD_FDS);
+    if (NULL == f) {
         return -EBADF;
     }
 
-    if (!IS_DIRECTORY(t->fildes[fd].node.mode)) {
-        return -ENOTDIR;
-    }
+    return RomfsFileReadDir(t, &f->file, buf, bufLen, cookie, bufUsed);
+}
 
-    if (*cookie == ROMFS_COOKIE_LAST) {
-        *bufUsed = 0;
-        return 0;
-    }
+int RomfsReadDirPlus(romfs_t t, int fd, romfs_direntplus_t *buf, size_t bufLen, uint32_t *cookie, size_t *bufUsed)
+{
+    fildes_t *f;
 
-    if (*cookie == 0) {
-        *cookie = t->fildes[fd].node.info;
-    }
+    if (NULL == t) return -EINVAL;
 
-    ret = RomfsGetNodeHdr(t, *cookie, &curNode);
-    if (ret < 0) {
+    if (buf == NULL || bufUsed == NULL || cookie == NULL) {
         return -EINVAL;
     }
 
-    for (*bufUsed = 0; *bufUsed < bufLen; (*bufUsed)++) {
-        buf[*bufUsed].name    = curNode.name;
-        buf[*bufUsed].nameLen = strlen(curNode.name);
-        buf[*bufUsed].inode   = curNode.off;
-        buf[*bufUsed].next    = curNode.next;
-        buf[*bufUsed].type    = curNode.mode;
-
-        if (curNode.next) {
-            *cookie = curNode.next;
-
-            ret = RomfsGetNodeHdr(t, curNode.next, &curNode);
-            if (ret < 0) {
-                break;
-            }
-        }
-        else {
-            *cookie = ROMFS_COOKIE_LAST;
-            (*bufUsed)++;
-            break;
-        }
+    f = RomfsFdGet(&t->fdt, fd - RESVD_FDS);
+    if (NULL == f) {
+        return -EBADF;
     }
 
-    ROMFS_TRACE("last cookie = 0x%x", *cookie);
-
-    return 0;
+    return RomfsFileReadDirPlus(t, &f->file, buf, bufLen, cookie, bufUsed);
 }
 
 int RomfsMapFile(romfs_t t, void **addr, size_t *len, int fd, uint32_t off)
 {
+    fildes_t *f;
+
     if (NULL == t) return -EINVAL;
 
     if (NULL == addr || NULL == len) {
         return -EINVAL;
     }
 
-    fd = fd - RESVD_FDS;
-    if (fd < 0 || fd > MAX_OPEN || !t->fildes[fd].opened) {
+    f = RomfsFdGet(&t->fdt, fd - RESVD_FDS);
+    if (NULL == f) {
         return -EBADF;
     }
 
-    if (!IS_FILE(t->fildes[fd].node.mode)) {
-        return -EACCES;
-    }
-
-    if (off >= t->fildes[fd].node.size) {
-        return -EINVAL;
-    }
+    return RomfsFileMap(t, &f->file, addr, len, off);
+}
 
-    *addr = t->img + (t->fildes[fd].node.dataOff + off);
-    *len = t->fildes[fd].node.size - off;
+int RomfsGetStats(romfs_t t, romfs_stats_t *stats)
+{
+    if (NULL == t || NULL == stats) return -EINVAL;
+
+    memset(stats, 0, sizeof(romfs_stats_t));
+
+    RomfsLock(&t->index.lock);
+    stats->indexBytes     = t->index.bytes + RomfsMapBytes(&t->index.dirs) + RomfsMapBytes(&t->index.skip);
+    stats->indexDirs      = t->index.dirs.count;
+    stats->indexBuildUs   = t->index.buildUs;
+    stats->indexEvictions = t->index.evictions;
+    stats->indexSkipped   = t->index.skip.count;
+    RomfsUnlock(&t->index.lock);
+
+    RomfsLock(&t->bloom.lock);
+    stats->bloomBytes          = t->bloom.bytes + RomfsMapBytes(&t->bloom.dirs);
+    stats->bloomDirs           = t->bloom.dirs.count;
+    stats->bloomNegatives      = t->bloom.negatives;
+    stats->bloomFalsePositives = t->bloom.falsePositives;
+    RomfsUnlock(&t->bloom.lock);
+
+    stats->nodeTableBytes = t->nodes.bytes;
+    stats->nodeCount      = t->nodes.count;
+
+    stats->linkTableBytes = RomfsMapBytes(&t->links);
+    stats->linkCount      = t->links.count;
+
+    RomfsLock(&t->dcache.lock);
+    stats->pathCacheHits      = t->dcache.hits;
+    stats->pathCacheMisses    = t->dcache.misses;
+    stats->pathCacheEntries   = t->dcache.used;
+    stats->pathCacheEvictions = t->dcache.evictions;
+    RomfsUnlock(&t->dcache.lock);
+
+    RomfsLock(&t->verify.lock);
+    stats->verifiedNodes  = t->verify.nodes;
+    stats->verifyFailures = t->verify.failures;
+    RomfsUnlock(&t->verify.lock);
+
+    RomfsLock(&t->verity.lock);
+    stats->verityBytes    = t->verity.bytes + RomfsMapBytes(&t->verity.files);
+    stats->verityFiles    = t->verity.files.count;
+    stats->verityHashed   = t->verity.hashed;
+    stats->verityFailures = t->verity.failures;
+    RomfsUnlock(&t->verity.lock);
+
+    RomfsLock(&t->dev.lock);
+    stats->devReads       = t->dev.reads;
+    stats->devRounds      = t->dev.rounds;
+    if (t->dev.aio != NULL) RomfsAioStats(t->dev.aio, stats);
+    stats->devHeaderBytes = t->dev.arenaBytes + RomfsMapBytes(&t->dev.hdrs);
+    stats->devCacheHits   = t->dev.hits;
+    stats->devCacheMisses = t->dev.misses;
+    stats->devReadaheadBytes  = t->dev.raBytes;
+    stats->devReadaheadWasted = t->dev.raWasted;
+    RomfsUnlock(&t->dev.lock);
+
+    RomfsAsyncStats(t, stats);
 
     return 0;
 }
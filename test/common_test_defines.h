@@ -22,3 +22,9 @@ extern unsigned int advanced_romfs_len;
 #define A_FILE_OFFSET         0xF0
 #define B_FILE_OFFSET         0xA0
 #define DIR_IN_DIR_OFFSET     0xD0
+
+#define BIG_BLOCKS  147     // two level verity tree: 2 blocks of leaf hashes, 1 above them
+#define BIG_SIZE    (BIG_BLOCKS * 4096 - 100)
+#define BIG_DATA    0x60    ///> Data offset of "big"
+
+uint8_t *BigImage(void);
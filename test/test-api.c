@@ -1,5 +1,9 @@
 #include "common_test_defines.h"
 
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+
 /* GLOBALS */
 romfs_t r;
 int openedFd;
@@ -42,9 +46,11 @@ TEST(load, LoadAndCheckContextIsClean)
     int ret = RomfsLoad(empty_romfs, empty_romfs_len, &r);
     TEST_ASSERT_EQUAL_INT(0, ret);
     TEST_ASSERT_NOT_NULL(r);
-    TEST_ASSERT_EQUAL(0, r->fildes[1].opened);
+    TEST_ASSERT_NULL(RomfsFdGet(&r->fdt, 1));
 
-    r->fildes[1].opened = 1;
+    ret = RomfsOpenAt(r, 3, ".", 0);
+    TEST_ASSERT_EQUAL_INT(4, ret);
+    TEST_ASSERT_NOT_NULL(RomfsFdGet(&r->fdt, 1));
 
     RomfsUnload(&r);
     TEST_ASSERT_NULL(r);
@@ -52,7 +58,7 @@ TEST(load, LoadAndCheckContextIsClean)
     ret = RomfsLoad(empty_romfs, empty_romfs_len, &r);
     TEST_ASSERT_EQUAL_INT(0, ret);
     TEST_ASSERT_NOT_NULL(r);
-    TEST_ASSERT_EQUAL(0, r->fildes[1].opened);
+    TEST_ASSERT_NULL(RomfsFdGet(&r->fdt, 1));
 
     RomfsUnload(&r);
     TEST_ASSERT_NULL(r);
@@ -183,6 +189,88 @@ TEST(open, OpenAtRelativePath)
     TEST_ASSERT_MESSAGE(IS_FILE(mode), "Opened file should be a regular file");
 }
 
+TEST(open, OpenAtNLengthDelimitedPath)
+{
+    const char buf[] = { 'd', 'i', 'r', '/', 'b', 'x', 'y' };
+    romfs_stat_t stat;
+
+    int ret = RomfsOpenAtN(r, ROOT_FD, buf, 5, 0);
+    TEST_ASSERT_EQUAL_INT(4, ret);
+
+    RomfsFdStat(r, ret, &stat);
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stat.ino);
+
+    ret = RomfsOpenAtN(r, ROOT_FD, buf, 3, 0);
+    TEST_ASSERT_EQUAL_INT(5, ret);
+    TEST_ASSERT(IS_DIRECTORY(RomfsFdStat(r, ret, NULL)));
+
+    ret = RomfsOpenAtN(r, ROOT_FD, buf, 6, 0);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, ret);
+
+    ret = RomfsFdStatAtN(r, ROOT_FD, buf, 5, &stat);
+    TEST_ASSERT(IS_FILE(ret));
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stat.ino);
+}
+
+TEST(open, OpenAtClosedFd)
+{
+    int ret = RomfsOpenAt(r, ROOT_FD + 1, "a", 0);
+    TEST_ASSERT_EQUAL_INT(-EBADF, ret);
+}
+
+TEST(open, OpenInoFileAndRead)
+{
+    char buf[4];
+
+    int fd = RomfsOpenIno(r, A_FILE_OFFSET, 0);
+    TEST_ASSERT_EQUAL_INT(4, fd);
+
+    int ret = RomfsRead(r, fd, buf, 3);
+    TEST_ASSERT_EQUAL_INT(3, ret);
+    TEST_ASSERT_EQUAL_STRING_LEN("aaa", buf, 3);
+}
+
+TEST(open, OpenInoFollowsHardlink)
+{
+    romfs_stat_t stat;
+
+    // '..' in root is a hardlink to the root directory
+    int fd = RomfsOpenIno(r, ROOT_OFFSET + 0x20, 0);
+    TEST_ASSERT_EQUAL_INT(4, fd);
+
+    int ret = RomfsFdStat(r, fd, &stat);
+    TEST_ASSERT_MESSAGE(IS_DIRECTORY(ret), "type is not dir");
+    TEST_ASSERT_EQUAL_HEX(ROOT_OFFSET, stat.ino);
+}
+
+TEST(open, OpenInoInvalid)
+{
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsOpenIno(NULL, A_FILE_OFFSET, 0));
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsOpenIno(r, 0, 0));
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsOpenIno(r, A_FILE_OFFSET + 1, 0));
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsOpenIno(r, 0x10000000, 0));
+    TEST_ASSERT_EQUAL_INT(-ENOENT, RomfsOpenIno(r, A_FILE_OFFSET + 0x10, 0));
+
+    // reachable headers were collected once, later calls only look them up
+    TEST_ASSERT(r->inos.count > 0);
+}
+
+TEST(open, OpenInoWithNodeTable)
+{
+    romfs_opts_t opts = { .flags = ROMFS_OPT_NODE_TABLE };
+    romfs_stat_t stat;
+
+    RomfsUnload(&r);
+    RomfsLoadOpts(basic_romfs, basic_romfs_len, &opts, &r);
+
+    int fd = RomfsOpenIno(r, B_FILE_OFFSET, 0);
+    TEST_ASSERT_EQUAL_INT(4, fd);
+    RomfsFdStat(r, fd, &stat);
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stat.ino);
+
+    TEST_ASSERT_EQUAL_INT(-ENOENT, RomfsOpenIno(r, B_FILE_OFFSET + 0x10, 0));
+}
+
 TEST_GROUP_RUNNER(open)
 {
     RUN_TEST_CASE(open, OpenAtErrorAccessingFileFromBadFD);
@@ -195,6 +283,12 @@ TEST_GROUP_RUNNER(open)
     RUN_TEST_CASE(open, OpenAtDirAndFile);
     RUN_TEST_CASE(open, OpenAtPathWithHardlinks);
     RUN_TEST_CASE(open, OpenAtRelativePath);
+    RUN_TEST_CASE(open, OpenAtNLengthDelimitedPath);
+    RUN_TEST_CASE(open, OpenAtClosedFd);
+    RUN_TEST_CASE(open, OpenInoFileAndRead);
+    RUN_TEST_CASE(open, OpenInoFollowsHardlink);
+    RUN_TEST_CASE(open, OpenInoInvalid);
+    RUN_TEST_CASE(open, OpenInoWithNodeTable);
 }
 
 /***************************************/
@@ -232,11 +326,60 @@ TEST(close, CloseFile)
     TEST_ASSERT_EQUAL_INT(-EBADF, ret);
 }
 
+TEST(close, CloseReusesLowestFd)
+{
+    int second = RomfsOpenAt(r, ROOT_FD, "dir/b", 0);
+    TEST_ASSERT_EQUAL_INT(openedFd + 1, second);
+
+    TEST_ASSERT_EQUAL_INT(0, RomfsClose(r, openedFd));
+    TEST_ASSERT_EQUAL_INT(openedFd, RomfsOpenAt(r, ROOT_FD, "dir", 0));
+    TEST_ASSERT_EQUAL_INT(second + 1, RomfsOpenAt(r, ROOT_FD, "a", 0));
+}
+
+TEST(close, OpenGrowsFdTable)
+{
+    romfs_stat_t stat;
+    int fd = 0;
+
+    if (MAX_OPEN < 4 * FD_SEG_SIZE) TEST_IGNORE_MESSAGE("MAX_OPEN holds less than four segments");
+
+    // several segments worth of descriptors
+    for (int i = 1; i < 3 * FD_SEG_SIZE; i++) {
+        fd = RomfsOpenAt(r, ROOT_FD, "dir/b", 0);
+        TEST_ASSERT_EQUAL_INT(openedFd + i, fd);
+    }
+
+    RomfsFdStat(r, fd, &stat);
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stat.ino);
+
+    TEST_ASSERT_EQUAL_INT(0, RomfsClose(r, openedFd + FD_SEG_SIZE));
+    TEST_ASSERT_EQUAL_INT(openedFd + FD_SEG_SIZE, RomfsOpenAt(r, ROOT_FD, "a", 0));
+
+    TEST_ASSERT_EQUAL_INT(-EBADF, RomfsFdStat(r, MAX_OPEN + ROOT_FD, NULL));
+    TEST_ASSERT_EQUAL_INT(-EBADF, RomfsClose(r, MAX_OPEN + ROOT_FD));
+}
+
+TEST(close, OpenStopsAtMaxOpen)
+{
+    int fd;
+
+    // table never grows past the compile time cap, root included
+    for (fd = openedFd + 1; fd < MAX_OPEN + RESVD_FDS; fd++) {
+        TEST_ASSERT_EQUAL_INT(fd, RomfsOpenAt(r, ROOT_FD, "a", 0));
+    }
+
+    TEST_ASSERT_EQUAL_INT(-EMFILE, RomfsOpenAt(r, ROOT_FD, "a", 0));
+    TEST_ASSERT_EQUAL_INT(0, RomfsClose(r, fd - 1));
+    TEST_ASSERT_EQUAL_INT(fd - 1, RomfsOpenAt(r, ROOT_FD, "a", 0));
+}
 
 TEST_GROUP_RUNNER(close)
 {
     RUN_TEST_CASE(close, CloseFile);
     RUN_TEST_CASE(close, CloseClosedFile);
+    RUN_TEST_CASE(close, CloseReusesLowestFd);
+    RUN_TEST_CASE(close, OpenGrowsFdTable);
+    RUN_TEST_CASE(close, OpenStopsAtMaxOpen);
 }
 
 /***************************************/
@@ -298,6 +441,18 @@ TEST(stat, StatAtCheckMoreStats)
     TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stat.ino);
 }
 
+TEST(stat, StatIno)
+{
+    romfs_stat_t stat;
+
+    int ret = RomfsStatIno(r, DIR_OFFSET, &stat);
+    TEST_ASSERT_MESSAGE(IS_DIRECTORY(ret), "type is not dir");
+    TEST_ASSERT_EQUAL_HEX(DIR_OFFSET, stat.ino);
+
+    ret = RomfsStatIno(r, DIR_OFFSET + 4, &stat);
+    TEST_ASSERT_EQUAL_INT(-EINVAL, ret);
+}
+
 TEST_GROUP_RUNNER(stat)
 {
     RUN_TEST_CASE(stat, StatCheckBadFd);
@@ -305,6 +460,7 @@ TEST_GROUP_RUNNER(stat)
     RUN_TEST_CASE(stat, StatCheckRootFd);
     RUN_TEST_CASE(stat, StatCheckMoreStats);
     RUN_TEST_CASE(stat, StatAtCheckMoreStats);
+    RUN_TEST_CASE(stat, StatIno);
 }
 
 /***************************************/
@@ -397,6 +553,73 @@ TEST(readFile, TryToReadFromDir)
     TEST_ASSERT_EQUAL_MEMORY("\0\0", buf, 2);
 }
 
+TEST(readFile, PreadDoesNotMoveCursor)
+{
+    char buf[4];
+    long off;
+
+    int ret = RomfsPread(r, openedFd, buf, 2, 2);
+    TEST_ASSERT_EQUAL_INT(2, ret);
+    TEST_ASSERT_EQUAL_STRING_LEN("a\n", buf, 2);
+
+    RomfsTell(r, openedFd, &off);
+    TEST_ASSERT_EQUAL_INT(0, off);
+
+    ret = RomfsPread(r, openedFd, buf, sizeof(buf), 3);
+    TEST_ASSERT_EQUAL_INT(1, ret);
+
+    ret = RomfsPread(r, openedFd, buf, sizeof(buf), 4);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    ret = RomfsPread(r, openedFd, buf, sizeof(buf), 100);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    TEST_ASSERT_EQUAL_INT(-EBADF, RomfsPread(r, openedFd + 1, buf, 1, 0));
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsPread(r, openedFd, NULL, 1, 0));
+    TEST_ASSERT_EQUAL_INT(-EISDIR, RomfsPread(r, ROOT_FD, buf, 1, 0));
+}
+
+TEST(readFile, PreadvFillsBuffersInOrder)
+{
+    char a[1], b[2], c[8];
+    romfs_iovec_t iov[] = { { a, sizeof(a) }, { b, sizeof(b) }, { c, sizeof(c) } };
+
+    int ret = RomfsPreadv(r, openedFd, iov, 3, 0);
+    TEST_ASSERT_EQUAL_INT(4, ret);
+    TEST_ASSERT_EQUAL_STRING_LEN("a", a, 1);
+    TEST_ASSERT_EQUAL_STRING_LEN("aa", b, 2);
+    TEST_ASSERT_EQUAL_STRING_LEN("\n", c, 1);
+
+    ret = RomfsPreadv(r, openedFd, iov, 0, 0);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsPreadv(r, openedFd, iov, -1, 0));
+}
+
+TEST(readFile, ReadvAdvancesCursor)
+{
+    char hdr[1], body[2], tail[4];
+    romfs_iovec_t iov[] = { { hdr, sizeof(hdr) }, { body, sizeof(body) } };
+    romfs_iovec_t rest = { tail, sizeof(tail) };
+    long off;
+
+    int ret = RomfsReadv(r, openedFd, iov, 2);
+    TEST_ASSERT_EQUAL_INT(3, ret);
+    TEST_ASSERT_EQUAL_STRING_LEN("a", hdr, 1);
+    TEST_ASSERT_EQUAL_STRING_LEN("aa", body, 2);
+
+    RomfsTell(r, openedFd, &off);
+    TEST_ASSERT_EQUAL_INT(3, off);
+
+    ret = RomfsReadv(r, openedFd, &rest, 1);
+    TEST_ASSERT_EQUAL_INT(1, ret);
+    TEST_ASSERT_EQUAL_STRING_LEN("\n", tail, 1);
+
+    ret = RomfsReadv(r, openedFd, &rest, 1);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsReadv(r, openedFd, NULL, 1));
+    TEST_ASSERT_EQUAL_INT(-EBADF, RomfsReadv(r, openedFd + 1, &rest, 1));
+}
+
 TEST_GROUP_RUNNER(readFile)
 {
     RUN_TEST_CASE(readFile, ReadBadFile);
@@ -405,6 +628,9 @@ TEST_GROUP_RUNNER(readFile)
     RUN_TEST_CASE(readFile, ReadFileBiggerThanFileSize);
     RUN_TEST_CASE(readFile, ReadFileOnceThenTryToOverflow);
     RUN_TEST_CASE(readFile, TryToReadFromDir);
+    RUN_TEST_CASE(readFile, PreadDoesNotMoveCursor);
+    RUN_TEST_CASE(readFile, PreadvFillsBuffersInOrder);
+    RUN_TEST_CASE(readFile, ReadvAdvancesCursor);
 }
 
 /***************************************/
@@ -727,6 +953,38 @@ TEST(readDir, ReadDirUsingCookie)
     TEST_ASSERT_EQUAL_STRING_LEN("a", dirBuf[1].name, 1);
 }
 
+TEST(readDir, ReadDirPlusResolvesEntries)
+{
+    romfs_direntplus_t plus[4];
+    uint32_t cookie = ROMFS_COOKIE_START;
+    int fd, ret;
+
+    ret = RomfsReadDirPlus(r, ROOT_FD, NULL, 4, &cookie, &dirBufUsed);
+    TEST_ASSERT_EQUAL_INT(-EINVAL, ret);
+
+    fd = RomfsOpenAt(r, ROOT_FD, "dir", 0);
+    ret = RomfsReadDirPlus(r, fd, plus, 4, &cookie, &dirBufUsed);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_INT(3, dirBufUsed);
+
+    // '..' is a hardlink, its stat describes the root directory
+    TEST_ASSERT_EQUAL_STRING("..", plus[0].ent.name);
+    TEST_ASSERT_MESSAGE(IS_HARDLINK(plus[0].ent.type), "type is not hardlink");
+    TEST_ASSERT_MESSAGE(IS_DIRECTORY(plus[0].stat.mode), "target is not directory");
+    TEST_ASSERT_EQUAL_HEX(ROOT_OFFSET, plus[0].stat.ino);
+
+    TEST_ASSERT_EQUAL_STRING("b", plus[1].ent.name);
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, plus[1].ent.inode);
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, plus[1].stat.ino);
+    TEST_ASSERT_EQUAL_INT(4, plus[1].stat.size);
+    TEST_ASSERT_EQUAL_HEX(0x9DFFFF2A, plus[1].stat.chksum);
+    TEST_ASSERT_EQUAL_STRING_LEN("bbb\n", (char *)basic_romfs + plus[1].dataOff, 4);
+
+    TEST_ASSERT_EQUAL_STRING(".", plus[2].ent.name);
+    TEST_ASSERT_EQUAL_HEX(DIR_OFFSET, plus[2].stat.ino);
+    TEST_ASSERT_EQUAL_HEX(ROMFS_COOKIE_LAST, cookie);
+}
+
 TEST_GROUP_RUNNER(readDir)
 {
     RUN_TEST_CASE(readDir, ReadDirInvalidParams);
@@ -735,6 +993,7 @@ TEST_GROUP_RUNNER(readDir)
     RUN_TEST_CASE(readDir, ReadDirRootDir);
     RUN_TEST_CASE(readDir, ReadDirInDir);
     RUN_TEST_CASE(readDir, ReadDirUsingCookie);
+    RUN_TEST_CASE(readDir, ReadDirPlusResolvesEntries);
 }
 
 /***************************************/
@@ -799,3 +1058,1019 @@ TEST_GROUP_RUNNER(mapFile)
     RUN_TEST_CASE(mapFile, BasicMap);
     RUN_TEST_CASE(mapFile, MapWithOffset);
 }
+
+/***************************************/
+TEST_GROUP(compiled);
+/***************************************/
+
+static romfs_path_t cp;
+
+TEST_SETUP(compiled)
+{
+    RomfsLoad(basic_romfs, basic_romfs_len, &r);
+    cp = NULL;
+}
+
+TEST_TEAR_DOWN(compiled)
+{
+    RomfsPathFree(&cp);
+    RomfsUnload(&r);
+}
+
+TEST(compiled, CompileErrors)
+{
+    char longName[MAX_NAME_LEN + 2];
+
+    memset(longName, 'x', sizeof(longName) - 1);
+    longName[sizeof(longName) - 1] = '\0';
+
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsPathCompile(NULL, MAX_PATH_LEN, &cp));
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsPathCompile("a", 1, NULL));
+    TEST_ASSERT_EQUAL_INT(-ENAMETOOLONG, RomfsPathCompile(longName, sizeof(longName), &cp));
+    TEST_ASSERT_NULL(cp);
+}
+
+TEST(compiled, OpenAndStatCompiled)
+{
+    romfs_stat_t stat;
+    char path[] = "dir/b";
+
+    int ret = RomfsPathCompile(path, sizeof(path), &cp);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    // compiled object does not reference the caller's string
+    memset(path, 0, sizeof(path));
+
+    ret = RomfsStatAtCompiled(r, ROOT_FD, cp, &stat);
+    TEST_ASSERT_MESSAGE(IS_FILE(ret), "type is not file");
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stat.ino);
+
+    ret = RomfsOpenAtCompiled(r, ROOT_FD, cp, 0);
+    TEST_ASSERT_EQUAL_INT(4, ret);
+}
+
+TEST(compiled, ReuseUnderDifferentFds)
+{
+    romfs_stat_t stat;
+    int dirFd, ret;
+
+    RomfsPathCompile("../a", MAX_PATH_LEN, &cp);
+
+    dirFd = RomfsOpenAt(r, ROOT_FD, "dir", 0);
+    TEST_ASSERT_EQUAL_INT(4, dirFd);
+
+    ret = RomfsStatAtCompiled(r, dirFd, cp, &stat);
+    TEST_ASSERT_MESSAGE(IS_FILE(ret), "type is not file");
+    TEST_ASSERT_EQUAL_HEX(A_FILE_OFFSET, stat.ino);
+
+    // root's '..' links back to root
+    ret = RomfsStatAtCompiled(r, ROOT_FD, cp, &stat);
+    TEST_ASSERT_EQUAL_HEX(A_FILE_OFFSET, stat.ino);
+
+    ret = RomfsStatAtCompiled(r, dirFd + 1, cp, &stat);
+    TEST_ASSERT_EQUAL_INT(-EBADF, ret);
+}
+
+TEST(compiled, CompiledWithIndexAndCache)
+{
+    romfs_opts_t opts = { .flags = ROMFS_OPT_DIR_INDEX | ROMFS_OPT_NODE_TABLE, .pathCacheSize = 4 };
+    romfs_stats_t stats;
+    romfs_stat_t stat;
+    int ret;
+
+    RomfsUnload(&r);
+    RomfsLoadOpts(basic_romfs, basic_romfs_len, &opts, &r);
+
+    RomfsPathCompile("/dir/b", MAX_PATH_LEN, &cp);
+
+    ret = RomfsStatAtCompiled(r, ROOT_FD, cp, &stat);
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stat.ino);
+
+    // shares the cache with plain lookups
+    ret = RomfsFdStatAt(r, ROOT_FD, "/dir/b", &stat);
+    TEST_ASSERT_MESSAGE(IS_FILE(ret), "type is not file");
+
+    RomfsGetStats(r, &stats);
+    TEST_ASSERT_EQUAL_INT(1, stats.pathCacheHits);
+    TEST_ASSERT_EQUAL_INT(1, stats.pathCacheEntries);
+
+    RomfsPathFree(&cp);
+    RomfsPathCompile("dir/nope", MAX_PATH_LEN, &cp);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, RomfsOpenAtCompiled(r, ROOT_FD, cp, 0));
+}
+
+TEST_GROUP_RUNNER(compiled)
+{
+    RUN_TEST_CASE(compiled, CompileErrors);
+    RUN_TEST_CASE(compiled, OpenAndStatCompiled);
+    RUN_TEST_CASE(compiled, ReuseUnderDifferentFds);
+    RUN_TEST_CASE(compiled, CompiledWithIndexAndCache);
+}
+
+/***************************************/
+TEST_GROUP(file);
+/***************************************/
+
+TEST_SETUP(file)
+{
+    RomfsLoad(basic_romfs, basic_romfs_len, &r);
+}
+
+TEST_TEAR_DOWN(file)
+{
+    RomfsUnload(&r);
+}
+
+TEST(file, FileOpenAndRead)
+{
+    romfs_file_t f, g;
+    char buf[4];
+    long off;
+
+    int ret = RomfsFileOpen(r, NULL, "a", 0, &f);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_HEX(A_FILE_OFFSET, f.ino);
+
+    ret = RomfsFileRead(r, &f, buf, 2);
+    TEST_ASSERT_EQUAL_INT(2, ret);
+    TEST_ASSERT_EQUAL_STRING_LEN("aa", buf, 2);
+
+    // copy is an independent handle
+    g = f;
+    ret = RomfsFileRead(r, &g, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_INT(2, ret);
+    TEST_ASSERT_EQUAL_STRING_LEN("a\n", buf, 2);
+
+    RomfsFileTell(r, &f, &off);
+    TEST_ASSERT_EQUAL_INT(2, off);
+
+    ret = RomfsFileSeek(r, &f, -1, ROMFS_SEEK_END);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    ret = RomfsFileRead(r, &f, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_INT(1, ret);
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsFileSeek(r, &f, 1, ROMFS_SEEK_CUR));
+
+    // descriptor table is not touched
+    TEST_ASSERT_NULL(RomfsFdGet(&r->fdt, 1));
+}
+
+TEST(file, FileOpenRelativeToDir)
+{
+    romfs_dirent_t ents[4];
+    romfs_stat_t stat;
+    romfs_file_t dir, f;
+    uint32_t cookie = ROMFS_COOKIE_START;
+    size_t used;
+
+    TEST_ASSERT_EQUAL_INT(0, RomfsFileOpen(r, NULL, "dir", 0, &dir));
+    TEST_ASSERT_EQUAL_INT(0, RomfsFileOpen(r, &dir, "b", 0, &f));
+
+    int ret = RomfsFileStat(r, &f, &stat);
+    TEST_ASSERT_MESSAGE(IS_FILE(ret), "type is not file");
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stat.ino);
+    TEST_ASSERT_EQUAL_HEX(0x9DFFFF2A, stat.chksum);
+
+    ret = RomfsFileReadDir(r, &dir, ents, 4, &cookie, &used);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_INT(3, used);
+    TEST_ASSERT_EQUAL_HEX(ROMFS_COOKIE_LAST, cookie);
+
+    TEST_ASSERT_EQUAL_INT(-EISDIR, RomfsFileRead(r, &dir, ents, 1));
+    TEST_ASSERT_EQUAL_INT(-ENOTDIR, RomfsFileReadDir(r, &f, ents, 4, &cookie, &used));
+    TEST_ASSERT_EQUAL_INT(-ENOENT, RomfsFileOpen(r, &dir, "a", 0, &f));
+}
+
+TEST(file, FileMap)
+{
+    romfs_file_t f;
+    uint8_t *addr;
+    size_t len;
+
+    RomfsFileOpen(r, NULL, "dir/b", 0, &f);
+
+    int ret = RomfsFileMap(r, &f, (void **)&addr, &len, 1);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_INT(3, len);
+
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsFileMap(r, &f, (void **)&addr, &len, 4));
+}
+
+TEST_GROUP_RUNNER(file)
+{
+    RUN_TEST_CASE(file, FileOpenAndRead);
+    RUN_TEST_CASE(file, FileOpenRelativeToDir);
+    RUN_TEST_CASE(file, FileMap);
+}
+
+/***************************************/
+TEST_GROUP(batch);
+/***************************************/
+
+TEST_SETUP(batch)
+{
+    RomfsLoad(basic_romfs, basic_romfs_len, &r);
+}
+
+TEST_TEAR_DOWN(batch)
+{
+    RomfsUnload(&r);
+}
+
+TEST(batch, StatManyKeepsCallerOrder)
+{
+    const char *paths[] = { "dir/b", "a", "dir/nope", "dir", NULL, "nope/x", "nope/y", "dir/./b" };
+    romfs_stat_t stats[8];
+    int results[8];
+
+    int ret = RomfsStatMany(r, ROOT_FD, paths, 8, stats, results);
+    TEST_ASSERT_EQUAL_INT(4, ret);
+
+    TEST_ASSERT_MESSAGE(IS_FILE(results[0]), "type is not file");
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stats[0].ino);
+    TEST_ASSERT_EQUAL_HEX(0x9DFFFF2A, stats[0].chksum);
+    TEST_ASSERT_MESSAGE(IS_FILE(results[1]), "type is not file");
+    TEST_ASSERT_EQUAL_HEX(A_FILE_OFFSET, stats[1].ino);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, results[2]);
+    TEST_ASSERT_MESSAGE(IS_DIRECTORY(results[3]), "type is not directory");
+    TEST_ASSERT_EQUAL_HEX(DIR_OFFSET, stats[3].ino);
+    TEST_ASSERT_EQUAL_INT(-EINVAL, results[4]);
+
+    // failed prefix fails every path below it
+    TEST_ASSERT_EQUAL_INT(-ENOENT, results[5]);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, results[6]);
+
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stats[7].ino);
+}
+
+TEST(batch, StatManyRelativeToDir)
+{
+    const char *paths[] = { "b", "../a", "a" };
+    int results[3];
+    int dirFd;
+
+    dirFd = RomfsOpenAt(r, ROOT_FD, "dir", 0);
+
+    // stats are optional
+    int ret = RomfsStatMany(r, dirFd, paths, 3, NULL, results);
+    TEST_ASSERT_EQUAL_INT(2, ret);
+    TEST_ASSERT_MESSAGE(IS_FILE(results[0]), "type is not file");
+    TEST_ASSERT_MESSAGE(IS_FILE(results[1]), "type is not file");
+    TEST_ASSERT_EQUAL_INT(-ENOENT, results[2]);
+}
+
+TEST(batch, OpenMany)
+{
+    const char *paths[] = { "dir/b", "nope", "a" };
+    char buf[4];
+    int fds[3];
+
+    int ret = RomfsOpenMany(r, ROOT_FD, paths, 3, 0, fds);
+    TEST_ASSERT_EQUAL_INT(2, ret);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, fds[1]);
+
+    ret = RomfsRead(r, fds[2], buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_INT(4, ret);
+    TEST_ASSERT_EQUAL_STRING_LEN("aaa\n", buf, 4);
+
+    ret = RomfsFdStat(r, fds[0], NULL);
+    TEST_ASSERT_MESSAGE(IS_FILE(ret), "type is not file");
+
+    TEST_ASSERT_EQUAL_INT(0, RomfsClose(r, fds[0]));
+    TEST_ASSERT_EQUAL_INT(0, RomfsClose(r, fds[2]));
+}
+
+TEST(batch, BadArguments)
+{
+    const char *paths[] = { "a" };
+    int results[1];
+
+    TEST_ASSERT_EQUAL_INT(-EBADF, RomfsStatMany(r, 100, paths, 1, NULL, results));
+    TEST_ASSERT_EQUAL_INT(-EBADF, RomfsOpenMany(r, 0, paths, 1, 0, results));
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsStatMany(r, ROOT_FD, NULL, 1, NULL, results));
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsStatMany(r, ROOT_FD, paths, 1, NULL, NULL));
+    TEST_ASSERT_EQUAL_INT(0, RomfsStatMany(r, ROOT_FD, paths, 0, NULL, results));
+}
+
+TEST(batch, ReadManyKeepsCallerOrder)
+{
+    char a[4], b[4], b2[2], d[4], tail[4];
+    int fdA, fdDir;
+
+    fdA = RomfsOpenAt(r, ROOT_FD, "a", 0);
+    fdDir = RomfsOpenAt(r, ROOT_FD, "dir", 0);
+
+    // a lies after b in the image, overlapping reads of b share one run
+    romfs_readreq_t reqs[] = {
+        { fdA, 0, 0, a, sizeof(a), 0 },
+        { -1, B_FILE_OFFSET, 0, b, sizeof(b), 0 },
+        { -1, B_FILE_OFFSET, 2, b2, sizeof(b2), 0 },
+        { fdDir, 0, 0, d, sizeof(d), 0 },
+        { 100, 0, 0, d, sizeof(d), 0 },
+        { -1, A_FILE_OFFSET, 3, tail, sizeof(tail), 0 },
+        { -1, A_FILE_OFFSET, 4, tail, sizeof(tail), 0 },
+    };
+
+    int ret = RomfsReadMany(r, reqs, 7);
+    TEST_ASSERT_EQUAL_INT(5, ret);
+
+    TEST_ASSERT_EQUAL_INT(4, reqs[0].ret);
+    TEST_ASSERT_EQUAL_STRING_LEN("aaa\n", a, 4);
+    TEST_ASSERT_EQUAL_INT(4, reqs[1].ret);
+    TEST_ASSERT_EQUAL_STRING_LEN("bbb\n", b, 4);
+    TEST_ASSERT_EQUAL_INT(2, reqs[2].ret);
+    TEST_ASSERT_EQUAL_STRING_LEN("b\n", b2, 2);
+    TEST_ASSERT_EQUAL_INT(-EISDIR, reqs[3].ret);
+    TEST_ASSERT_EQUAL_INT(-EBADF, reqs[4].ret);
+    TEST_ASSERT_EQUAL_INT(1, reqs[5].ret);
+    TEST_ASSERT_EQUAL_INT(0, reqs[6].ret);
+
+    // descriptor position is not used
+    ret = RomfsRead(r, fdA, a, sizeof(a));
+    TEST_ASSERT_EQUAL_INT(4, ret);
+
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsReadMany(r, NULL, 1));
+    TEST_ASSERT_EQUAL_INT(0, RomfsReadMany(r, reqs, 0));
+}
+
+TEST_GROUP_RUNNER(batch)
+{
+    RUN_TEST_CASE(batch, StatManyKeepsCallerOrder);
+    RUN_TEST_CASE(batch, StatManyRelativeToDir);
+    RUN_TEST_CASE(batch, OpenMany);
+    RUN_TEST_CASE(batch, BadArguments);
+    RUN_TEST_CASE(batch, ReadManyKeepsCallerOrder);
+}
+
+/***************************************/
+TEST_GROUP(dev);
+/***************************************/
+
+typedef struct {
+    const uint8_t *img;
+    uint32_t calls;
+    uint32_t failFrom;      ///> Reads touching [failFrom, failTo) fail
+    uint32_t failTo;
+    int      hold;          ///> Reads wait while set
+    int      held;          ///> Reads that waited
+    uint32_t callerCalls;   ///> Calls made on the thread running the test
+} devctx_t;
+
+static devctx_t devCtx;
+static __thread int testThread;
+
+static int DevRead(void *ctx, uint32_t off, void *buf, size_t len)
+{
+    devctx_t *d = (devctx_t *)ctx;
+
+    if (__atomic_load_n(&d->hold, __ATOMIC_ACQUIRE)) {
+        __atomic_fetch_add(&d->held, 1, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&d->hold, __ATOMIC_ACQUIRE)) usleep(1000);
+    }
+
+    d->calls++;
+    if (testThread) d->callerCalls++;
+    if (off < d->failTo && off + len > d->failFrom) return -EIO;
+
+    memcpy(buf, d->img + off, len);
+
+    return 0;
+}
+
+TEST_SETUP(dev)
+{
+    testThread = 1;
+    memset(&devCtx, 0, sizeof(devCtx));
+    devCtx.img = advanced_romfs;
+}
+
+TEST_TEAR_DOWN(dev)
+{
+    RomfsUnload(&r);
+}
+
+TEST(dev, MatchesMemoryImage)
+{
+    romfs_opts_t opts = { .devBlockSize = 64, .devCacheBlocks = 4 };
+    romfs_dirent_t ent[16];
+    romfs_stats_t stats;
+    uint32_t cookie = 0;
+    uint8_t buf[0x80];
+    char data[16];
+    void *addr;
+    size_t used, len;
+    int fd, ret;
+
+    ret = RomfsLoadDev(DevRead, &devCtx, advanced_romfs_len, &opts, &r);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    ret = RomfsReadDir(r, ROOT_FD, ent, 16, &cookie, &used);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_INT(10, used);
+
+    fd = RomfsOpenAt(r, ROOT_FD, "dir1/link", 0);
+    TEST_ASSERT(fd >= 0);
+    TEST_ASSERT_EQUAL_INT(10, RomfsRead(r, fd, data, sizeof(data)));
+    TEST_ASSERT_EQUAL_MEMORY("value = a\n", data, 10);
+    TEST_ASSERT_EQUAL_INT(-ENOTSUP, RomfsMapFile(r, &addr, &len, fd, 0));
+    TEST_ASSERT(IS_DIRECTORY(RomfsFdStatAt(r, ROOT_FD, "dir2/..", NULL)));
+
+    // names stay valid after the blocks they came from were evicted
+    TEST_ASSERT_EQUAL_STRING("dir2", ent[2].name);
+    TEST_ASSERT_EQUAL_HEX(0x60, ent[2].inode);
+    TEST_ASSERT_EQUAL_STRING("dir1", ent[9].name);
+
+    RomfsGetStats(r, &stats);
+    TEST_ASSERT_EQUAL_INT(devCtx.calls, stats.devReads);
+    TEST_ASSERT(stats.devHeaderBytes > 0);
+
+    // whole blocks not in the cache are read in one go
+    ret = devCtx.calls;
+    TEST_ASSERT_EQUAL_INT(0, RomfsDevRead(r, 0x100, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_MEMORY(advanced_romfs + 0x100, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_INT(ret + 1, devCtx.calls);
+    TEST_ASSERT_EQUAL_INT(-EFAULT, RomfsDevRead(r, advanced_romfs_len - 4, buf, 8));
+}
+
+TEST(dev, ReadErrorsReachCaller)
+{
+    romfs_opts_t opts = { .devBlockSize = 16 };
+    char data[16];
+    int fd;
+
+    // data of a
+    devCtx.failFrom = 0x1c0;
+    devCtx.failTo = 0x1ca;
+
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadDev(DevRead, &devCtx, advanced_romfs_len, &opts, &r));
+
+    fd = RomfsOpenAt(r, ROOT_FD, "a", 0);
+    TEST_ASSERT(fd >= 0);
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsRead(r, fd, data, sizeof(data)));
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsPread(r, fd, data, 1, 9));
+
+    fd = RomfsOpenAt(r, ROOT_FD, "b", 0);
+    TEST_ASSERT_EQUAL_INT(10, RomfsRead(r, fd, data, sizeof(data)));
+
+    // header of dir1
+    RomfsUnload(&r);
+    devCtx.failFrom = 0x210;
+    devCtx.failTo = 0x211;
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadDev(DevRead, &devCtx, advanced_romfs_len, &opts, &r));
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsOpenAt(r, ROOT_FD, "dir1/link", 0));
+}
+
+TEST(dev, SmallCacheKeepsPendingBlocks)
+{
+    romfs_opts_t opts = { .flags = ROMFS_OPT_DEV_NO_READAHEAD, .devBlockSize = 16, .devCacheBlocks = 4 };
+    uint8_t buf[64];
+
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadDev(DevRead, &devCtx, advanced_romfs_len, &opts, &r));
+
+    // hits on 33-35 go in between the claims of 32 and 36, 32 must not be evicted for 36
+    for (uint32_t blk = 33; blk <= 35; blk++) {
+        TEST_ASSERT_EQUAL_INT(0, RomfsDevRead(r, blk * 16, buf, 1));
+    }
+    TEST_ASSERT_EQUAL_INT(0, RomfsDevRead(r, 520, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_MEMORY(advanced_romfs + 520, buf, sizeof(buf));
+}
+
+TEST(dev, LoadOptions)
+{
+    romfs_opts_t opts = { .flags = ROMFS_OPT_VERIFY | ROMFS_OPT_DIR_INDEX | ROMFS_OPT_NODE_TABLE | ROMFS_OPT_LINK_TABLE };
+    uint8_t *img;
+
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadDev(DevRead, &devCtx, advanced_romfs_len, &opts, &r));
+    TEST_ASSERT(IS_FILE(RomfsFdStatAt(r, ROOT_FD, "dir1/link", NULL)));
+    TEST_ASSERT_EQUAL_INT(-ENOENT, RomfsFdStatAt(r, ROOT_FD, "dir2/nope", NULL));
+    RomfsUnload(&r);
+
+    // header checksums are summed through the device too
+    img = malloc(advanced_romfs_len);
+    memcpy(img, advanced_romfs, advanced_romfs_len);
+    img[0x20f] ^= 1;
+    devCtx.img = img;
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsLoadDev(DevRead, &devCtx, advanced_romfs_len, &opts, &r));
+    free(img);
+
+    opts.devBlockSize = 100;
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsLoadDev(DevRead, &devCtx, advanced_romfs_len, &opts, &r));
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsLoadDev(NULL, &devCtx, advanced_romfs_len, NULL, &r));
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsLoadOpts(NULL, advanced_romfs_len, NULL, &r));
+}
+
+TEST(dev, ReadaheadFollowsSequentialReads)
+{
+    romfs_opts_t opts = { .devBlockSize = 512, .devCacheBlocks = 64 };
+    uint8_t *img = BigImage();
+    romfs_stats_t stats;
+    uint8_t buf[255];
+    uint32_t calls;
+    int fd, ret = 0;
+
+    devCtx.img = img;
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadDev(DevRead, &devCtx, BIG_DATA + BIG_SIZE, &opts, &r));
+    fd = RomfsOpenAt(r, ROOT_FD, "big", 0);
+    TEST_ASSERT(fd >= 0);
+
+    // 64 KiB in small chunks, windows grow to a quarter of the cache, 8 KiB
+    calls = devCtx.calls;
+    for (uint32_t pos = 0; pos < 0x10000; pos += ret) {
+        ret = RomfsRead(r, fd, buf, sizeof(buf));
+        TEST_ASSERT_EQUAL_INT(sizeof(buf), ret);
+        TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + pos, buf, sizeof(buf));
+    }
+    TEST_ASSERT(devCtx.calls - calls < 14);
+
+    RomfsGetStats(r, &stats);
+    TEST_ASSERT(stats.devReadaheadBytes >= 0x10000 - 512);
+    TEST_ASSERT(stats.devCacheHits > 10 * stats.devCacheMisses);
+    TEST_ASSERT_EQUAL_INT(0, stats.devReadaheadWasted);
+
+    // jumping around reads nothing ahead, blocks read ahead before get evicted unused
+    for (uint32_t i = 0; i < 100; i++) {
+        RomfsSeek(r, fd, 0x20000 + i * 3000, ROMFS_SEEK_SET);
+        TEST_ASSERT_EQUAL_INT(16, RomfsRead(r, fd, buf, 16));
+    }
+
+    RomfsGetStats(r, &stats);
+    TEST_ASSERT(stats.devReadaheadBytes < 0x10000 + 0x2000);
+    TEST_ASSERT(stats.devReadaheadWasted > 0);
+    RomfsUnload(&r);
+
+    // without readahead every block is a call of its own
+    opts.flags = ROMFS_OPT_DEV_NO_READAHEAD;
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadDev(DevRead, &devCtx, BIG_DATA + BIG_SIZE, &opts, &r));
+    fd = RomfsOpenAt(r, ROOT_FD, "big", 0);
+    calls = devCtx.calls;
+    for (uint32_t pos = 0; pos < 0x10000; pos += sizeof(buf)) {
+        RomfsRead(r, fd, buf, sizeof(buf));
+    }
+    TEST_ASSERT(devCtx.calls - calls >= 0x10000 / 512);
+
+    free(img);
+}
+
+/* Image in an unlinked temporary file, for RomfsLoadFd. */
+static int ImageFile(const uint8_t *img, size_t len)
+{
+    char name[] = "/tmp/romfs-test-XXXXXX";
+    int fd = mkstemp(name);
+
+    TEST_ASSERT(fd >= 0);
+    unlink(name);
+    TEST_ASSERT_EQUAL_INT(len, write(fd, img, len));
+
+    return fd;
+}
+
+static void ReadFileImage(int flags)
+{
+    romfs_opts_t opts = { .flags = flags, .devBlockSize = 512, .devCacheBlocks = 64, .fdQueueDepth = 4 };
+    uint8_t *img = BigImage(), *buf = malloc(BIG_SIZE);
+    romfs_readreq_t reqs[40];
+    romfs_stats_t stats;
+    int fd, file, ret;
+
+    fd = ImageFile(img, BIG_DATA + BIG_SIZE);
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadFd(fd, 0, &opts, &r));
+    file = RomfsOpenAt(r, ROOT_FD, "big", 0);
+    TEST_ASSERT(file >= 0);
+
+    // scattered requests on a cold cache, ten times more reads than the queue holds
+    for (int i = 0; i < 40; i++) {
+        reqs[i] = (romfs_readreq_t){ .fd = file, .off = i * 13001 + 100, .buf = buf + i * 1500, .len = 1500 };
+    }
+
+    TEST_ASSERT_EQUAL_INT(40, RomfsReadMany(r, reqs, 40));
+    for (int i = 0; i < 40; i++) {
+        TEST_ASSERT_EQUAL_INT(1500, reqs[i].ret);
+        TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + reqs[i].off, reqs[i].buf, 1500);
+    }
+
+    RomfsGetStats(r, &stats);
+    TEST_ASSERT(stats.devReads >= 4 * stats.devRounds);
+    if (flags & ROMFS_OPT_FD_NO_URING) TEST_ASSERT_EQUAL_INT(0, stats.fdUring);
+
+    for (uint32_t pos = 0; pos < BIG_SIZE; pos += ret) {
+        ret = RomfsRead(r, file, buf + pos, 1000);
+        TEST_ASSERT(ret > 0);
+    }
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA, buf, BIG_SIZE);
+
+    RomfsUnload(&r);
+    close(fd);
+    free(buf);
+    free(img);
+}
+
+TEST(dev, ReadManyReadsRunsOnce)
+{
+    romfs_opts_t opts = { .flags = ROMFS_OPT_DEV_NO_READAHEAD, .devBlockSize = 512, .devCacheBlocks = 64 };
+    uint8_t *img = BigImage(), *a = malloc(4096), *b = malloc(4096), *c = malloc(16);
+    romfs_stats_t stats;
+    uint32_t reads;
+    int file;
+
+    devCtx.img = img;
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadDev(DevRead, &devCtx, BIG_DATA + BIG_SIZE, &opts, &r));
+    file = RomfsOpenAt(r, ROOT_FD, "big", 0);
+
+    // a and b overlap, the blocks they share are read once, not once for each
+    romfs_readreq_t reqs[] = {
+        { file, 0, 1024, b, 4096, 0 },
+        { file, 0, 0, a, 4096, 0 },
+        { file, 0, 100000, c, 16, 0 },
+    };
+
+    RomfsGetStats(r, &stats);
+    reads = stats.devReads;
+    TEST_ASSERT_EQUAL_INT(3, RomfsReadMany(r, reqs, 3));
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + 1024, b, 4096);
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA, a, 4096);
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + 100000, c, 16);
+
+    RomfsGetStats(r, &stats);
+    TEST_ASSERT_EQUAL_INT(3, stats.devReads - reads);
+
+    free(c);
+    free(b);
+    free(a);
+    free(img);
+}
+
+TEST(dev, FileReader)
+{
+    ReadFileImage(0);
+}
+
+TEST(dev, FileReaderPreadPool)
+{
+    ReadFileImage(ROMFS_OPT_FD_NO_URING);
+}
+
+TEST(dev, FileShorterThanImage)
+{
+    uint8_t *img = BigImage();
+    uint8_t buf[16];
+    int fd, file;
+
+    TEST_ASSERT_EQUAL_INT(-EBADF, RomfsLoadFd(-1, 0, NULL, &r));
+
+    fd = ImageFile(img, BIG_DATA + BIG_SIZE);
+    TEST_ASSERT_EQUAL_INT(0, ftruncate(fd, BIG_DATA + 8192));
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadFd(fd, BIG_DATA + BIG_SIZE, NULL, &r));
+
+    file = RomfsOpenAt(r, ROOT_FD, "big", 0);
+    TEST_ASSERT_EQUAL_INT(16, RomfsPread(r, file, buf, 16, 4000));
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + 4000, buf, 16);
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsPread(r, file, buf, 16, 20000));
+
+    RomfsUnload(&r);
+    close(fd);
+    free(img);
+}
+
+TEST(dev, FileReaderDirect)
+{
+    romfs_opts_t opts = { .flags = ROMFS_OPT_FD_DIRECT };
+    uint8_t *img = BigImage(), *buf = malloc(BIG_SIZE);
+    romfs_stats_t stats;
+    uint64_t bounced;
+    int fd, file, ret;
+
+    fd = ImageFile(img, BIG_DATA + BIG_SIZE);
+    ret = RomfsLoadFd(fd, 0, &opts, &r);
+    if (ret == -EINVAL) {
+        close(fd);
+        free(buf);
+        free(img);
+        TEST_IGNORE_MESSAGE("no O_DIRECT for files in /tmp");
+    }
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    RomfsGetStats(r, &stats);
+    TEST_ASSERT(stats.fdDirectAlign >= 512);
+    TEST_ASSERT_EQUAL_INT(0, stats.fdDirectAlign & (stats.fdDirectAlign - 1));
+
+    // block fills are aligned, they need no bounce
+    file = RomfsOpenAt(r, ROOT_FD, "big", 0);
+    RomfsGetStats(r, &stats);
+    bounced = stats.fdBounceBytes;
+    TEST_ASSERT_EQUAL_INT(16, RomfsPread(r, file, buf, 16, 300000));
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + 300000, buf, 16);
+    RomfsGetStats(r, &stats);
+    TEST_ASSERT_EQUAL_INT(bounced, stats.fdBounceBytes);
+
+    // short last block of the file
+    TEST_ASSERT_EQUAL_INT(16, RomfsPread(r, file, buf, 16, BIG_SIZE - 16));
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + BIG_SIZE - 16, buf, 16);
+
+    for (uint32_t pos = 0; pos < BIG_SIZE; pos += ret) {
+        ret = RomfsRead(r, file, buf + pos, 1000);
+        TEST_ASSERT(ret > 0);
+    }
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA, buf, BIG_SIZE);
+
+    RomfsGetStats(r, &stats);
+    TEST_ASSERT(stats.fdBounceBytes > bounced);
+
+    // misaligned buffer longer than the bounce buffer, read in pieces
+    memset(buf, 0, BIG_SIZE);
+    TEST_ASSERT_EQUAL_INT(BIG_SIZE - 1, RomfsPread(r, file, buf + 1, BIG_SIZE - 1, 1));
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + 1, buf + 1, BIG_SIZE - 1);
+    RomfsUnload(&r);
+
+    // reads past the end of the file fail, they don't come back short
+    TEST_ASSERT_EQUAL_INT(0, ftruncate(fd, BIG_DATA + 8192));
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadFd(fd, BIG_DATA + BIG_SIZE, &opts, &r));
+    file = RomfsOpenAt(r, ROOT_FD, "big", 0);
+    TEST_ASSERT_EQUAL_INT(16, RomfsPread(r, file, buf, 16, 8000));
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsPread(r, file, buf, 16, 8190));
+
+    RomfsUnload(&r);
+    close(fd);
+    free(buf);
+    free(img);
+}
+
+/* Waits for a background fetch to finish and clears the eventfd. */
+static int WaitFetch(int efd)
+{
+    struct pollfd p = { efd, POLLIN, 0 };
+    uint64_t v;
+
+    if (poll(&p, 1, 5000) != 1) return -1;
+
+    return read(efd, &v, sizeof(v)) == sizeof(v) ? 0 : -1;
+}
+
+typedef struct {
+    uint32_t ino;
+    int      err;
+    int      calls;
+} readyctx_t;
+
+static void Ready(void *ctx, uint32_t ino, int err)
+{
+    readyctx_t *c = (readyctx_t *)ctx;
+
+    __atomic_store_n(&c->ino, ino, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->err, err, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->calls, 1, __ATOMIC_RELEASE);
+}
+
+TEST(dev, NonblockingReads)
+{
+    romfs_opts_t opts = { .devBlockSize = 512, .devCacheBlocks = 64 };
+    uint8_t *img = BigImage(), *buf = malloc(BIG_SIZE);
+    romfs_stats_t stats;
+    uint32_t again = 0;
+    int efd, fd, ret;
+
+    devCtx.img = img;
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadDev(DevRead, &devCtx, BIG_DATA + BIG_SIZE, &opts, &r));
+
+    efd = RomfsEventFd(r);
+    if (efd == -ENOTSUP) {
+        free(buf);
+        free(img);
+        TEST_IGNORE_MESSAGE("no background fetches, non-blocking reads block");
+    }
+    TEST_ASSERT(efd >= 0);
+    TEST_ASSERT_EQUAL_INT(efd, RomfsEventFd(r));
+
+    fd = RomfsOpenAt(r, ROOT_FD, "big", ROMFS_O_FLAGS_NONBLOCK);
+    TEST_ASSERT(fd >= 0);
+
+    // nothing cached there, the read is queued and comes back once the fetch is done
+    TEST_ASSERT_EQUAL_INT(-EAGAIN, RomfsPread(r, fd, buf, 16, 300000));
+    TEST_ASSERT_EQUAL_INT(0, WaitFetch(efd));
+    TEST_ASSERT_EQUAL_INT(16, RomfsPread(r, fd, buf, 16, 300000));
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + 300000, buf, 16);
+
+    // whole file through the cursor, short reads and retries included
+    for (uint32_t pos = 0; pos < BIG_SIZE; ) {
+        ret = RomfsRead(r, fd, buf + pos, 3000);
+        if (ret == -EAGAIN) {
+            again++;
+            TEST_ASSERT_EQUAL_INT(0, WaitFetch(efd));
+            continue;
+        }
+        TEST_ASSERT(ret > 0 && ret <= 3000);
+        pos += (uint32_t)ret;
+    }
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA, buf, BIG_SIZE);
+    TEST_ASSERT_EQUAL_INT(0, RomfsRead(r, fd, buf, 16));
+
+    RomfsGetStats(r, &stats);
+    TEST_ASSERT_EQUAL_INT(again + 1, stats.asyncAgain);
+    TEST_ASSERT(stats.asyncFetches > again);
+    TEST_ASSERT(stats.devReadaheadBytes > 0);
+    RomfsUnload(&r);
+
+    // images in memory have nothing to wait for
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoad(img, BIG_DATA + BIG_SIZE, &r));
+    TEST_ASSERT_EQUAL_INT(-ENOTSUP, RomfsEventFd(r));
+    fd = RomfsOpenAt(r, ROOT_FD, "big", ROMFS_O_FLAGS_NONBLOCK);
+    TEST_ASSERT_EQUAL_INT(3000, RomfsRead(r, fd, buf, 3000));
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA, buf, 3000);
+
+    free(buf);
+    free(img);
+}
+
+TEST(dev, NonblockingReadErrors)
+{
+    readyctx_t ready = { 0 };
+    romfs_opts_t opts = { .devBlockSize = 16, .ready = Ready, .readyCtx = &ready };
+    romfs_stat_t st;
+    char data[16];
+    int efd, fd;
+
+    // data of a
+    devCtx.failFrom = 0x1c0;
+    devCtx.failTo = 0x1ca;
+
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadDev(DevRead, &devCtx, advanced_romfs_len, &opts, &r));
+
+    efd = RomfsEventFd(r);
+    if (efd == -ENOTSUP) TEST_IGNORE_MESSAGE("no background fetches, non-blocking reads block");
+
+    fd = RomfsOpenAt(r, ROOT_FD, "a", ROMFS_O_FLAGS_NONBLOCK);
+    TEST_ASSERT(fd >= 0);
+    RomfsFdStat(r, fd, &st);
+
+    // failed fetch is reported to the callback and to the next read, once
+    TEST_ASSERT_EQUAL_INT(-EAGAIN, RomfsRead(r, fd, data, sizeof(data)));
+    TEST_ASSERT_EQUAL_INT(0, WaitFetch(efd));
+    TEST_ASSERT_EQUAL_INT(1, __atomic_load_n(&ready.calls, __ATOMIC_ACQUIRE));
+    TEST_ASSERT_EQUAL_INT(st.ino, ready.ino);
+    TEST_ASSERT_EQUAL_INT(-EIO, ready.err);
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsRead(r, fd, data, sizeof(data)));
+    TEST_ASSERT_EQUAL_INT(-EAGAIN, RomfsRead(r, fd, data, sizeof(data)));
+    TEST_ASSERT_EQUAL_INT(0, WaitFetch(efd));
+
+    fd = RomfsOpenAt(r, ROOT_FD, "b", ROMFS_O_FLAGS_NONBLOCK);
+    TEST_ASSERT_EQUAL_INT(-EAGAIN, RomfsRead(r, fd, data, sizeof(data)));
+    TEST_ASSERT_EQUAL_INT(0, WaitFetch(efd));
+    TEST_ASSERT_EQUAL_INT(3, __atomic_load_n(&ready.calls, __ATOMIC_ACQUIRE));
+    TEST_ASSERT_EQUAL_INT(0, ready.err);
+    TEST_ASSERT_EQUAL_INT(10, RomfsRead(r, fd, data, sizeof(data)));
+}
+
+TEST(dev, NonblockingReadsQueueFull)
+{
+    readyctx_t ready = { 0 };
+    romfs_opts_t opts = { .flags = ROMFS_OPT_DEV_NO_READAHEAD, .devBlockSize = 512, .devCacheBlocks = 512,
+                          .ready = Ready, .readyCtx = &ready };
+    uint8_t *img = BigImage(), buf[16];
+    int efd, fd, k;
+
+    devCtx.img = img;
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadDev(DevRead, &devCtx, BIG_DATA + BIG_SIZE, &opts, &r));
+
+    efd = RomfsEventFd(r);
+    if (efd == -ENOTSUP) {
+        free(img);
+        TEST_IGNORE_MESSAGE("no background fetches, non-blocking reads block");
+    }
+    fd = RomfsOpenAt(r, ROOT_FD, "big", ROMFS_O_FLAGS_NONBLOCK);
+    TEST_ASSERT(fd >= 0);
+
+    // worker stuck in the first fetch, the reads after it fill the queue and then some
+    __atomic_store_n(&devCtx.hold, 1, __ATOMIC_RELEASE);
+    TEST_ASSERT_EQUAL_INT(-EAGAIN, RomfsPread(r, fd, buf, sizeof(buf), 4096));
+    for (k = 0; k < 5000 && __atomic_load_n(&devCtx.held, __ATOMIC_ACQUIRE) == 0; k++) usleep(1000);
+
+    for (k = 1; k < 70; k++) {
+        TEST_ASSERT_EQUAL_INT(-EAGAIN, RomfsPread(r, fd, buf, sizeof(buf), 4096 + (uint32_t)k * 1024));
+    }
+    __atomic_store_n(&devCtx.hold, 0, __ATOMIC_RELEASE);
+
+    // every queued fetch and one for the reads that found the queue full
+    for (k = 0; k < 5000 && __atomic_load_n(&ready.calls, __ATOMIC_ACQUIRE) < 66; k++) usleep(1000);
+    usleep(10000);
+    TEST_ASSERT_EQUAL_INT(66, __atomic_load_n(&ready.calls, __ATOMIC_ACQUIRE));
+    TEST_ASSERT_EQUAL_INT(0, ready.err);
+
+    // the last one of them was fetched
+    TEST_ASSERT_EQUAL_INT(sizeof(buf), RomfsPread(r, fd, buf, sizeof(buf), 4096 + 69 * 1024));
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + 4096 + 69 * 1024, buf, sizeof(buf));
+
+    free(img);
+}
+
+TEST(dev, CacheUnlockedDuringReads)
+{
+    romfs_opts_t opts = { .flags = ROMFS_OPT_DEV_NO_READAHEAD, .devBlockSize = 512, .devCacheBlocks = 64 };
+    uint8_t *img = BigImage(), buf[16];
+    int efd, fd, nb, k, unlocked, ret = 0;
+
+    devCtx.img = img;
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadDev(DevRead, &devCtx, BIG_DATA + BIG_SIZE, &opts, &r));
+
+    efd = RomfsEventFd(r);
+    if (efd == -ENOTSUP) {
+        free(img);
+        TEST_IGNORE_MESSAGE("no background fetches, non-blocking reads block");
+    }
+    fd = RomfsOpenAt(r, ROOT_FD, "big", 0);
+    nb = RomfsOpenAt(r, ROOT_FD, "big", ROMFS_O_FLAGS_NONBLOCK);
+    TEST_ASSERT_EQUAL_INT(16, RomfsPread(r, fd, buf, sizeof(buf), 1000));
+
+    // worker stuck in the device callback
+    __atomic_store_n(&devCtx.hold, 1, __ATOMIC_RELEASE);
+    TEST_ASSERT_EQUAL_INT(-EAGAIN, RomfsPread(r, nb, buf, sizeof(buf), 100000));
+    for (k = 0; k < 5000 && __atomic_load_n(&devCtx.held, __ATOMIC_ACQUIRE) == 0; k++) usleep(1000);
+
+    // cache is free meanwhile, hits don't wait for the device
+    unlocked = RomfsTryLock(&r->dev.lock);
+    if (unlocked) {
+        RomfsUnlock(&r->dev.lock);
+        ret = RomfsPread(r, fd, buf, sizeof(buf), 1000);
+    }
+    __atomic_store_n(&devCtx.hold, 0, __ATOMIC_RELEASE);
+
+    TEST_ASSERT(unlocked);
+    TEST_ASSERT_EQUAL_INT(16, ret);
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + 1000, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_INT(0, WaitFetch(efd));
+    TEST_ASSERT_EQUAL_INT(16, RomfsPread(r, nb, buf, sizeof(buf), 100000));
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + 100000, buf, sizeof(buf));
+
+    free(img);
+}
+
+TEST(dev, NonblockingVerifiedReads)
+{
+    romfs_opts_t opts = { .flags = ROMFS_OPT_VERITY | ROMFS_OPT_DEV_NO_READAHEAD, .devBlockSize = 512,
+                          .devCacheBlocks = 64 };
+    uint8_t *img = BigImage(), *tree, root[32], buf[4096];
+    romfs_stats_t stats;
+    uint32_t calls;
+    size_t len;
+    int efd, fd;
+
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoad(img, BIG_DATA + BIG_SIZE, &r));
+    TEST_ASSERT_EQUAL_INT(0, RomfsVerityBuild(r, NULL, &len, NULL));
+    tree = malloc(len);
+    TEST_ASSERT_EQUAL_INT(0, RomfsVerityBuild(r, tree, &len, root));
+    RomfsUnload(&r);
+
+    opts.verity = tree;
+    opts.verityLen = len;
+    opts.verityRoot = root;
+    devCtx.img = img;
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadDev(DevRead, &devCtx, BIG_DATA + BIG_SIZE, &opts, &r));
+
+    efd = RomfsEventFd(r);
+    if (efd == -ENOTSUP) {
+        free(tree);
+        free(img);
+        TEST_IGNORE_MESSAGE("no background fetches, non-blocking reads block");
+    }
+    fd = RomfsOpenAt(r, ROOT_FD, "big", ROMFS_O_FLAGS_NONBLOCK);
+    TEST_ASSERT(fd >= 0);
+
+    // fetch brings the whole verity block in, the read after it hashes it from the cache
+    TEST_ASSERT_EQUAL_INT(-EAGAIN, RomfsPread(r, fd, buf, 10, 5000));
+    TEST_ASSERT_EQUAL_INT(0, WaitFetch(efd));
+    calls = devCtx.callerCalls;
+    TEST_ASSERT_EQUAL_INT(10, RomfsPread(r, fd, buf, 10, 5000));
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + 5000, buf, 10);
+
+    // stops where the next verity block isn't cached, and has it fetched
+    TEST_ASSERT_EQUAL_INT(192, RomfsPread(r, fd, buf, sizeof(buf), 8000));
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + 8000, buf, 192);
+    TEST_ASSERT_EQUAL_INT(0, WaitFetch(efd));
+    TEST_ASSERT_EQUAL_INT(sizeof(buf), RomfsPread(r, fd, buf, sizeof(buf), 8192));
+    TEST_ASSERT_EQUAL_MEMORY(img + BIG_DATA + 8192, buf, sizeof(buf));
+
+    TEST_ASSERT_EQUAL_INT(calls, devCtx.callerCalls);
+    RomfsGetStats(r, &stats);
+    TEST_ASSERT(stats.verityHashed >= 3);
+    TEST_ASSERT_EQUAL_INT(0, stats.verityFailures);
+
+    RomfsUnload(&r);
+    free(tree);
+    free(img);
+}
+
+TEST_GROUP_RUNNER(dev)
+{
+    RUN_TEST_CASE(dev, MatchesMemoryImage);
+    RUN_TEST_CASE(dev, ReadErrorsReachCaller);
+    RUN_TEST_CASE(dev, LoadOptions);
+    RUN_TEST_CASE(dev, SmallCacheKeepsPendingBlocks);
+    RUN_TEST_CASE(dev, ReadaheadFollowsSequentialReads);
+    RUN_TEST_CASE(dev, ReadManyReadsRunsOnce);
+    RUN_TEST_CASE(dev, FileReader);
+    RUN_TEST_CASE(dev, FileReaderPreadPool);
+    RUN_TEST_CASE(dev, FileShorterThanImage);
+    RUN_TEST_CASE(dev, FileReaderDirect);
+    RUN_TEST_CASE(dev, NonblockingReads);
+    RUN_TEST_CASE(dev, NonblockingReadErrors);
+    RUN_TEST_CASE(dev, NonblockingReadsQueueFull);
+    RUN_TEST_CASE(dev, NonblockingVerifiedReads);
+    RUN_TEST_CASE(dev, CacheUnlockedDuringReads);
+}
@@ -0,0 +1,1088 @@
+#include "common_test_defines.h"
+
+/* GLOBALS */
+static romfs_t ri;
+static romfs_opts_t indexOpts = { .flags = ROMFS_OPT_DIR_INDEX };
+
+/***************************************/
+TEST_GROUP(index);
+/***************************************/
+
+TEST_SETUP(index)
+{
+    RomfsLoadOpts(basic_romfs, basic_romfs_len, &indexOpts, &ri);
+}
+
+TEST_TEAR_DOWN(index)
+{
+    RomfsUnload(&ri);
+}
+
+TEST(index, IndexStats)
+{
+    romfs_stats_t stats;
+
+    int ret = RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    TEST_ASSERT_EQUAL_INT(2, stats.indexDirs);
+    TEST_ASSERT(stats.indexBytes > 0);
+
+    ret = RomfsGetStats(ri, NULL);
+    TEST_ASSERT_EQUAL_INT(-EINVAL, ret);
+}
+
+TEST(index, IndexSearchDir)
+{
+    int ret;
+    uint32_t offset = ROOT_OFFSET;
+
+    ret = RomfsSearchDir(ri, "a", &offset);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_HEX(A_FILE_OFFSET, offset);
+
+    offset = FIRST_ENTRY_IN_DIR;
+    ret = RomfsSearchDir(ri, "b", &offset);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, offset);
+
+    offset = FIRST_ENTRY_IN_DIR;
+    ret = RomfsSearchDir(ri, "a", &offset);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, ret);
+}
+
+TEST(index, IndexSearchFromMiddleOfChain)
+{
+    int ret;
+    uint32_t offset = SECOND_ENTRY_ROOT_OFF;
+
+    // not a chain head, falls back to linear search
+    ret = RomfsSearchDir(ri, "a", &offset);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_HEX(A_FILE_OFFSET, offset);
+
+    offset = SECOND_ENTRY_ROOT_OFF;
+    ret = RomfsSearchDir(ri, ".", &offset);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, ret);
+}
+
+TEST(index, IndexOpenFiles)
+{
+    romfs_stat_t stat;
+    int ret;
+
+    ret = RomfsFdStatAt(ri, 3, "dir/b", &stat);
+    TEST_ASSERT(IS_FILE(ret));
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stat.ino);
+
+    ret = RomfsFdStatAt(ri, 3, "/dir/../dir/./../a", &stat);
+    TEST_ASSERT(IS_FILE(ret));
+    TEST_ASSERT_EQUAL_HEX(A_FILE_OFFSET, stat.ino);
+
+    ret = RomfsFdStatAt(ri, 3, "dir/x", &stat);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, ret);
+}
+
+TEST(index, IndexAdvancedImage)
+{
+    romfs_t r2;
+    romfs_stats_t stats;
+    romfs_stat_t stat;
+    int ret;
+
+    ret = RomfsLoadOpts(advanced_romfs, advanced_romfs_len, &indexOpts, &r2);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    RomfsGetStats(r2, &stats);
+    TEST_ASSERT_EQUAL_INT(3, stats.indexDirs);
+
+    ret = RomfsFdStatAt(r2, 3, "dir1/link", &stat);
+    TEST_ASSERT(IS_FILE(ret));
+    TEST_ASSERT_EQUAL_HEX(0x1a0, stat.ino);
+
+    ret = RomfsFdStatAt(r2, 3, "dir2/fifo", &stat);
+    TEST_ASSERT_EQUAL_INT(ROMFS_TYPE_FIFO, ret);
+
+    RomfsUnload(&r2);
+}
+
+TEST_GROUP_RUNNER(index)
+{
+    RUN_TEST_CASE(index, IndexStats);
+    RUN_TEST_CASE(index, IndexSearchDir);
+    RUN_TEST_CASE(index, IndexSearchFromMiddleOfChain);
+    RUN_TEST_CASE(index, IndexOpenFiles);
+    RUN_TEST_CASE(index, IndexAdvancedImage);
+}
+
+/***************************************/
+TEST_GROUP(lazyIndex);
+/***************************************/
+
+static romfs_opts_t lazyOpts;
+
+TEST_SETUP(lazyIndex)
+{
+    lazyOpts.flags = ROMFS_OPT_DIR_INDEX_LAZY;
+    lazyOpts.indexMemLimit = 0;
+}
+
+TEST_TEAR_DOWN(lazyIndex)
+{
+    RomfsUnload(&ri);
+}
+
+TEST(lazyIndex, LazyNothingIndexedAtLoad)
+{
+    romfs_stats_t stats;
+
+    int ret = RomfsLoadOpts(basic_romfs, basic_romfs_len, &lazyOpts, &ri);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(0, stats.indexDirs);
+    TEST_ASSERT_EQUAL_INT(0, stats.indexBytes);
+}
+
+TEST(lazyIndex, LazyIndexOnFirstSearch)
+{
+    romfs_stats_t stats;
+    romfs_stat_t stat;
+    int ret;
+
+    RomfsLoadOpts(basic_romfs, basic_romfs_len, &lazyOpts, &ri);
+
+    ret = RomfsFdStatAt(ri, 3, "a", &stat);
+    TEST_ASSERT(IS_FILE(ret));
+    TEST_ASSERT_EQUAL_HEX(A_FILE_OFFSET, stat.ino);
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(1, stats.indexDirs);
+
+    ret = RomfsFdStatAt(ri, 3, "dir/b", &stat);
+    TEST_ASSERT(IS_FILE(ret));
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stat.ino);
+
+    ret = RomfsFdStatAt(ri, 3, "dir/c", &stat);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, ret);
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(2, stats.indexDirs);
+    TEST_ASSERT_EQUAL_INT(0, stats.indexEvictions);
+
+    // dir searched last, searches gave their references back
+    TEST_ASSERT_EQUAL_HEX(FIRST_ENTRY_IN_DIR, ri->index.mru->head);
+    TEST_ASSERT_EQUAL_PTR(ri->index.mru, ri->index.lru->prev);
+    TEST_ASSERT_EQUAL_INT(1, ri->index.mru->refs);
+    TEST_ASSERT_EQUAL_INT(1, ri->index.lru->refs);
+}
+
+TEST(lazyIndex, LazyEvictColdIndexes)
+{
+    romfs_stats_t stats;
+    dirindex_t *held;
+    size_t oneDir;
+    int ret;
+
+    RomfsLoadOpts(basic_romfs, basic_romfs_len, &lazyOpts, &ri);
+    RomfsFdStatAt(ri, 3, "a", NULL);
+    RomfsGetStats(ri, &stats);
+    oneDir = stats.indexBytes;
+    RomfsUnload(&ri);
+
+    lazyOpts.indexMemLimit = oneDir + 8;
+    RomfsLoadOpts(basic_romfs, basic_romfs_len, &lazyOpts, &ri);
+
+    ret = RomfsFdStatAt(ri, 3, "dir/b", NULL);
+    TEST_ASSERT(IS_FILE(ret));
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(1, stats.indexDirs);
+    TEST_ASSERT_EQUAL_INT(1, stats.indexEvictions);
+    TEST_ASSERT(stats.indexBytes <= lazyOpts.indexMemLimit);
+
+    // table a search is still probing outlives its eviction
+    held = ri->index.mru;
+    held->refs++;
+
+    ret = RomfsFdStatAt(ri, 3, "a", NULL);
+    TEST_ASSERT(IS_FILE(ret));
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(2, stats.indexEvictions);
+    TEST_ASSERT(ri->index.mru != held);
+    TEST_ASSERT_EQUAL_INT(1, held->refs);
+    TEST_ASSERT_EQUAL_HEX(FIRST_ENTRY_IN_DIR, held->head);
+    RomfsFree(held);
+}
+
+TEST(lazyIndex, LazyLimitTooSmall)
+{
+    romfs_stats_t stats;
+    int ret;
+
+    lazyOpts.indexMemLimit = 1;
+    RomfsLoadOpts(basic_romfs, basic_romfs_len, &lazyOpts, &ri);
+
+    ret = RomfsFdStatAt(ri, 3, "dir/b", NULL);
+    TEST_ASSERT(IS_FILE(ret));
+
+    ret = RomfsFdStatAt(ri, 3, "dir/x", NULL);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, ret);
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(0, stats.indexDirs);
+
+    // root and dir are remembered, later lookups don't build their tables again
+    TEST_ASSERT_EQUAL_INT(2, ri->index.skip.count);
+    ret = RomfsFdStatAt(ri, 3, "dir/b", NULL);
+    TEST_ASSERT(IS_FILE(ret));
+    TEST_ASSERT_EQUAL_INT(2, ri->index.skip.count);
+
+    // remembering them takes memory too
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(2, stats.indexSkipped);
+    TEST_ASSERT_EQUAL_INT(RomfsMapBytes(&ri->index.dirs) + RomfsMapBytes(&ri->index.skip), stats.indexBytes);
+}
+
+TEST_GROUP_RUNNER(lazyIndex)
+{
+    RUN_TEST_CASE(lazyIndex, LazyNothingIndexedAtLoad);
+    RUN_TEST_CASE(lazyIndex, LazyIndexOnFirstSearch);
+    RUN_TEST_CASE(lazyIndex, LazyEvictColdIndexes);
+    RUN_TEST_CASE(lazyIndex, LazyLimitTooSmall);
+}
+
+/***************************************/
+TEST_GROUP(nodeTable);
+/***************************************/
+
+static romfs_opts_t tableOpts = { .flags = ROMFS_OPT_NODE_TABLE };
+
+TEST_SETUP(nodeTable)
+{
+    RomfsLoadOpts(basic_romfs, basic_romfs_len, &tableOpts, &ri);
+}
+
+TEST_TEAR_DOWN(nodeTable)
+{
+    RomfsUnload(&ri);
+}
+
+TEST(nodeTable, NodeTableStats)
+{
+    romfs_stats_t stats;
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(7, stats.nodeCount);
+    TEST_ASSERT(stats.nodeTableBytes > 0);
+}
+
+TEST(nodeTable, NodeTableMatchesImage)
+{
+    const uint32_t offsets[] = { ROOT_OFFSET, SECOND_ENTRY_ROOT_OFF, DIR_OFFSET, FIRST_ENTRY_IN_DIR,
+                                 B_FILE_OFFSET, DIR_IN_DIR_OFFSET, A_FILE_OFFSET };
+    struct romfs_t raw;
+    nodehdr_t a, b;
+
+    memset(&raw, 0, sizeof(raw));
+    raw.img = basic_romfs;
+    raw.size = basic_romfs_len;
+    raw.vol = ri->vol;
+
+    for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+        TEST_ASSERT(RomfsNodeTableFind(&ri->nodes, offsets[i]) != NODE_NONE);
+
+        TEST_ASSERT_EQUAL_INT(0, RomfsGetNodeHdr(ri, offsets[i], &a));
+        TEST_ASSERT_EQUAL_INT(0, RomfsGetNodeHdr(&raw, offsets[i], &b));
+
+        TEST_ASSERT_EQUAL_HEX(b.off, a.off);
+        TEST_ASSERT_EQUAL_HEX(b.next, a.next);
+        TEST_ASSERT_EQUAL_HEX(b.info, a.info);
+        TEST_ASSERT_EQUAL_HEX(b.size, a.size);
+        TEST_ASSERT_EQUAL_HEX(b.chksum, a.chksum);
+        TEST_ASSERT_EQUAL_HEX(b.dataOff, a.dataOff);
+        TEST_ASSERT_EQUAL_HEX(b.mode, a.mode);
+        TEST_ASSERT_EQUAL_PTR(b.name, a.name);
+
+        // table headers carry their index, steps from them skip the map
+        TEST_ASSERT_EQUAL_INT(RomfsNodeTableFind(&ri->nodes, offsets[i]) + 1, a.slot);
+        TEST_ASSERT_EQUAL_INT(0, b.slot);
+    }
+}
+
+TEST(nodeTable, NodeTableLookups)
+{
+    romfs_stat_t stat;
+    int ret;
+
+    ret = RomfsFdStatAt(ri, 3, "/dir/../dir/./b", &stat);
+    TEST_ASSERT(IS_FILE(ret));
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stat.ino);
+    TEST_ASSERT_EQUAL_HEX(0x9DFFFF2A, stat.chksum);
+
+    ret = RomfsFdStatAt(ri, 3, "dir/a", &stat);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, ret);
+
+    ret = RomfsFdStatAt(ri, 3, "di", &stat);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, ret);
+}
+
+TEST(nodeTable, NodeTableWithIndex)
+{
+    romfs_opts_t opts = { .flags = ROMFS_OPT_NODE_TABLE | ROMFS_OPT_DIR_INDEX };
+    romfs_stats_t stats;
+    romfs_t r2;
+    int ret;
+
+    ret = RomfsLoadOpts(advanced_romfs, advanced_romfs_len, &opts, &r2);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    RomfsGetStats(r2, &stats);
+    TEST_ASSERT_EQUAL_INT(16, stats.nodeCount);
+    TEST_ASSERT_EQUAL_INT(3, stats.indexDirs);
+
+    ret = RomfsFdStatAt(r2, 3, "dir1/link", NULL);
+    TEST_ASSERT(IS_FILE(ret));
+
+    RomfsUnload(&r2);
+}
+
+TEST(nodeTable, NodeTableLongName)
+{
+    size_t len = 0x50 + ROMFS_ALIGNUP(0x10001 + 1);
+    uint8_t *img = calloc(1, len);
+    romfs_stat_t stat;
+    romfs_t r2;
+
+    // file named 0x10001 times 'a' next to root's '.'
+    memcpy(img, "-rom1fs-", 8);
+    img[8] = (uint8_t)(len >> 24); img[9] = (uint8_t)(len >> 16); img[10] = (uint8_t)(len >> 8); img[11] = (uint8_t)len;
+    img[0x23] = 0x40 | ROMFS_TYPE_DIRECTORY;
+    img[0x27] = 0x20;
+    img[0x30] = '.';
+    img[0x43] = ROMFS_TYPE_FILE;
+    memset(img + 0x50, 'a', 0x10001);
+
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadOpts(img, len, &tableOpts, &r2));
+    TEST_ASSERT_EQUAL_INT(0x10001, r2->nodes.nameLen[RomfsNodeTableFind(&r2->nodes, 0x40)]);
+
+    // length is not cut to 16 bits, "a" is not mistaken for it
+    TEST_ASSERT_EQUAL_INT(-ENOENT, RomfsFdStatAt(r2, 3, "a", &stat));
+
+    RomfsUnload(&r2);
+    free(img);
+}
+
+TEST_GROUP_RUNNER(nodeTable)
+{
+    RUN_TEST_CASE(nodeTable, NodeTableStats);
+    RUN_TEST_CASE(nodeTable, NodeTableMatchesImage);
+    RUN_TEST_CASE(nodeTable, NodeTableLookups);
+    RUN_TEST_CASE(nodeTable, NodeTableWithIndex);
+    RUN_TEST_CASE(nodeTable, NodeTableLongName);
+}
+
+/***************************************/
+TEST_GROUP(pathCache);
+/***************************************/
+
+static romfs_opts_t cacheOpts = { .pathCacheSize = 2 };
+
+TEST_SETUP(pathCache)
+{
+    RomfsLoadOpts(basic_romfs, basic_romfs_len, &cacheOpts, &ri);
+}
+
+TEST_TEAR_DOWN(pathCache)
+{
+    RomfsUnload(&ri);
+}
+
+TEST(pathCache, PathCacheHitAndMiss)
+{
+    romfs_stats_t stats;
+    romfs_stat_t stat;
+    int ret;
+
+    ret = RomfsFdStatAt(ri, 3, "dir/b", &stat);
+    TEST_ASSERT(IS_FILE(ret));
+
+    ret = RomfsFdStatAt(ri, 3, "dir/b", &stat);
+    TEST_ASSERT(IS_FILE(ret));
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stat.ino);
+    TEST_ASSERT_EQUAL_HEX(0x9DFFFF2A, stat.chksum);
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(1, stats.pathCacheHits);
+    TEST_ASSERT_EQUAL_INT(1, stats.pathCacheMisses);
+    TEST_ASSERT_EQUAL_INT(1, stats.pathCacheEntries);
+}
+
+TEST(pathCache, PathCacheKeyedByStart)
+{
+    romfs_stats_t stats;
+    int fd, ret;
+
+    fd = RomfsOpenAt(ri, 3, "dir", 0);
+    TEST_ASSERT_EQUAL_INT(4, fd);
+
+    ret = RomfsFdStatAt(ri, 3, "b", NULL);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, ret);
+
+    ret = RomfsFdStatAt(ri, fd, "b", NULL);
+    TEST_ASSERT(IS_FILE(ret));
+
+    ret = RomfsFdStatAt(ri, 3, "b", NULL);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, ret);
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(0, stats.pathCacheHits);
+    TEST_ASSERT_EQUAL_INT(2, stats.pathCacheEntries);
+}
+
+TEST(pathCache, PathCacheHardlinksResolved)
+{
+    romfs_stat_t stat;
+    int ret;
+
+    for (int i = 0; i < 2; i++) {
+        ret = RomfsFdStatAt(ri, 3, "dir/..", &stat);
+        TEST_ASSERT(IS_DIRECTORY(ret));
+        TEST_ASSERT_EQUAL_HEX(ROOT_OFFSET, stat.ino);
+    }
+}
+
+TEST(pathCache, PathCacheEvictsLeastRecentlyUsed)
+{
+    romfs_stats_t stats;
+
+    RomfsFdStatAt(ri, 3, "a", NULL);
+    RomfsFdStatAt(ri, 3, "dir", NULL);
+    RomfsFdStatAt(ri, 3, "a", NULL);
+    RomfsFdStatAt(ri, 3, "dir/b", NULL);  // evicts "dir"
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(2, stats.pathCacheEntries);
+    TEST_ASSERT_EQUAL_INT(1, stats.pathCacheEvictions);
+    TEST_ASSERT_EQUAL_INT(1, stats.pathCacheHits);
+
+    RomfsFdStatAt(ri, 3, "a", NULL);
+    RomfsFdStatAt(ri, 3, "dir/b", NULL);
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(3, stats.pathCacheHits);
+
+    RomfsFdStatAt(ri, 3, "dir", NULL);
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(3, stats.pathCacheHits);
+    TEST_ASSERT_EQUAL_INT(2, stats.pathCacheEvictions);
+}
+
+TEST_GROUP_RUNNER(pathCache)
+{
+    RUN_TEST_CASE(pathCache, PathCacheHitAndMiss);
+    RUN_TEST_CASE(pathCache, PathCacheKeyedByStart);
+    RUN_TEST_CASE(pathCache, PathCacheHardlinksResolved);
+    RUN_TEST_CASE(pathCache, PathCacheEvictsLeastRecentlyUsed);
+}
+
+/***************************************/
+TEST_GROUP(bloom);
+/***************************************/
+
+static romfs_opts_t bloomOpts;
+
+TEST_SETUP(bloom)
+{
+    bloomOpts.flags = ROMFS_OPT_DIR_BLOOM;
+    bloomOpts.bloomBits = 0;
+}
+
+TEST_TEAR_DOWN(bloom)
+{
+    RomfsUnload(&ri);
+}
+
+static
+int VisitSearch(const struct romfs_t *rm, const nodehdr_t *nd, uint32_t head, void *ctx)
+{
+    uint32_t offset = head;
+
+    (*(int *)ctx)++;
+
+    return RomfsSearchDir(rm, nd->name, &offset);
+}
+
+TEST(bloom, BloomBuiltAtLoad)
+{
+    romfs_stats_t stats;
+
+    int ret = RomfsLoadOpts(basic_romfs, basic_romfs_len, &bloomOpts, &ri);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(2, stats.bloomDirs);
+    TEST_ASSERT(stats.bloomBytes > 0);
+}
+
+TEST(bloom, BloomMissesCounted)
+{
+    romfs_stats_t stats;
+    romfs_stat_t stat;
+    int ret;
+
+    RomfsLoadOpts(basic_romfs, basic_romfs_len, &bloomOpts, &ri);
+
+    ret = RomfsFdStatAt(ri, 3, "dir/b", &stat);
+    TEST_ASSERT(IS_FILE(ret));
+    TEST_ASSERT_EQUAL_HEX(B_FILE_OFFSET, stat.ino);
+
+    TEST_ASSERT_EQUAL_INT(-ENOENT, RomfsFdStatAt(ri, 3, "not_a_file", NULL));
+    TEST_ASSERT_EQUAL_INT(-ENOENT, RomfsFdStatAt(ri, 3, "dir/not_a_file", NULL));
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(2, stats.bloomNegatives + stats.bloomFalsePositives);
+}
+
+TEST(bloom, BloomNoFalseNegatives)
+{
+    int visited = 0;
+
+    // smallest filters, most collisions
+    bloomOpts.flags |= ROMFS_OPT_NODE_TABLE;
+    bloomOpts.bloomBits = 1;
+    RomfsLoadOpts(advanced_romfs, advanced_romfs_len, &bloomOpts, &ri);
+
+    int ret = RomfsTreeWalk(ri, VisitSearch, &visited);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_INT(16, visited);
+}
+
+TEST(bloom, BloomLazy)
+{
+    romfs_stats_t stats;
+    int ret;
+
+    bloomOpts.flags = ROMFS_OPT_DIR_BLOOM_LAZY | ROMFS_OPT_DIR_INDEX_LAZY;
+    RomfsLoadOpts(basic_romfs, basic_romfs_len, &bloomOpts, &ri);
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(0, stats.bloomDirs);
+
+    ret = RomfsFdStatAt(ri, 3, "a", NULL);
+    TEST_ASSERT(IS_FILE(ret));
+
+    ret = RomfsFdStatAt(ri, 3, "not_a_file", NULL);
+    TEST_ASSERT_EQUAL_INT(-ENOENT, ret);
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(1, stats.bloomDirs);
+    TEST_ASSERT_EQUAL_INT(1, stats.bloomNegatives + stats.bloomFalsePositives);
+}
+
+TEST_GROUP_RUNNER(bloom)
+{
+    RUN_TEST_CASE(bloom, BloomBuiltAtLoad);
+    RUN_TEST_CASE(bloom, BloomMissesCounted);
+    RUN_TEST_CASE(bloom, BloomNoFalseNegatives);
+    RUN_TEST_CASE(bloom, BloomLazy);
+}
+
+/***************************************/
+TEST_GROUP(links);
+/***************************************/
+
+static romfs_opts_t linkOpts = { .flags = ROMFS_OPT_LINK_TABLE };
+
+TEST_SETUP(links)
+{
+}
+
+TEST_TEAR_DOWN(links)
+{
+    RomfsUnload(&ri);
+}
+
+TEST(links, LinkTableBuiltAtLoad)
+{
+    romfs_stats_t stats;
+    romfs_stat_t stat;
+    int ret;
+
+    ret = RomfsLoadOpts(advanced_romfs, advanced_romfs_len, &linkOpts, &ri);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT(stats.linkCount > 0);
+    TEST_ASSERT(stats.linkTableBytes > 0);
+
+    ret = RomfsFdStatAt(ri, 3, "dir1/link", &stat);
+    TEST_ASSERT(IS_FILE(ret));
+    TEST_ASSERT_EQUAL_HEX(0x1a0, stat.ino);
+
+    ret = RomfsFdStatAt(ri, 3, "dir1/../..", &stat);
+    TEST_ASSERT(IS_DIRECTORY(ret));
+    TEST_ASSERT_EQUAL_HEX(ROOT_OFFSET, stat.ino);
+}
+
+TEST(links, LinkLoopFailsLoad)
+{
+    uint8_t *img = malloc(basic_romfs_len);
+    int ret;
+
+    // point root's '..' hardlink to itself
+    memcpy(img, basic_romfs, basic_romfs_len);
+    img[0x47] = 0x40;
+
+    ret = RomfsLoadOpts(img, basic_romfs_len, &linkOpts, &ri);
+    TEST_ASSERT_EQUAL_INT(-ELOOP, ret);
+    TEST_ASSERT_NULL(ri);
+
+    // without the table the loop shows up only on lookup
+    ret = RomfsLoad(img, basic_romfs_len, &ri);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_INT(-ELOOP, RomfsFdStatAt(ri, 3, "..", NULL));
+    TEST_ASSERT(IS_FILE(RomfsFdStatAt(ri, 3, "dir/b", NULL)));
+
+    RomfsUnload(&ri);
+    free(img);
+}
+
+TEST_GROUP_RUNNER(links)
+{
+    RUN_TEST_CASE(links, LinkTableBuiltAtLoad);
+    RUN_TEST_CASE(links, LinkLoopFailsLoad);
+}
+
+/***************************************/
+TEST_GROUP(verify);
+/***************************************/
+
+static romfs_opts_t verifyOpts = { .flags = ROMFS_OPT_VERIFY };
+static romfs_opts_t verifyLazyOpts = { .flags = ROMFS_OPT_VERIFY_LAZY };
+static uint8_t *verifyImg;
+
+TEST_SETUP(verify)
+{
+    verifyImg = malloc(advanced_romfs_len);
+    memcpy(verifyImg, advanced_romfs, advanced_romfs_len);
+}
+
+TEST_TEAR_DOWN(verify)
+{
+    RomfsUnload(&ri);
+    free(verifyImg);
+}
+
+TEST(verify, VerifyAllAtLoad)
+{
+    romfs_stats_t stats;
+
+    int ret = RomfsLoadOpts(verifyImg, advanced_romfs_len, &verifyOpts, &ri);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(16, stats.verifiedNodes);
+    TEST_ASSERT_EQUAL_INT(0, stats.verifyFailures);
+    TEST_ASSERT(IS_FILE(RomfsFdStatAt(ri, 3, "dir1/link", NULL)));
+}
+
+TEST(verify, BadHeaderFailsLoad)
+{
+    // checksum of dir1 header, past the first 512 bytes covered by the volume checksum
+    verifyImg[0x20f] ^= 1;
+
+    int ret = RomfsLoadOpts(verifyImg, advanced_romfs_len, &verifyOpts, &ri);
+    TEST_ASSERT_EQUAL_INT(-EIO, ret);
+    TEST_ASSERT_NULL(ri);
+
+    // checks are off by default
+    ret = RomfsLoad(verifyImg, advanced_romfs_len, &ri);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT(RomfsOpenAt(ri, 3, "dir1", 0) >= 0);
+}
+
+TEST(verify, BadVolumeFailsLoad)
+{
+    // data of file d, covered only by the volume checksum
+    verifyImg[0x100] ^= 1;
+
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsLoadOpts(verifyImg, advanced_romfs_len, &verifyOpts, &ri));
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsLoadOpts(verifyImg, advanced_romfs_len, &verifyLazyOpts, &ri));
+}
+
+TEST(verify, LazyVerifyOnOpen)
+{
+    romfs_stats_t stats;
+    romfs_file_t f;
+    int ret;
+
+    verifyImg[0x20f] ^= 1;
+
+    ret = RomfsLoadOpts(verifyImg, advanced_romfs_len, &verifyLazyOpts, &ri);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    // lookups through the bad header still work, only opening it fails
+    TEST_ASSERT(IS_DIRECTORY(RomfsFdStatAt(ri, 3, "dir1", NULL)));
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsOpenAt(ri, 3, "dir1", 0));
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsFileOpen(ri, NULL, "dir1", 0, &f));
+
+    ret = RomfsOpenAt(ri, 3, "dir1/link", 0);
+    TEST_ASSERT_EQUAL_INT(4, ret);
+    RomfsClose(ri, ret);
+    ret = RomfsOpenAt(ri, 3, "a", 0);
+    TEST_ASSERT_EQUAL_INT(4, ret);
+
+    // root at load, dir1 and a once each
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(3, stats.verifiedNodes);
+    TEST_ASSERT_EQUAL_INT(1, stats.verifyFailures);
+}
+
+TEST_GROUP_RUNNER(verify)
+{
+    RUN_TEST_CASE(verify, VerifyAllAtLoad);
+    RUN_TEST_CASE(verify, BadHeaderFailsLoad);
+    RUN_TEST_CASE(verify, BadVolumeFailsLoad);
+    RUN_TEST_CASE(verify, LazyVerifyOnOpen);
+}
+
+/***************************************/
+TEST_GROUP(scan);
+/***************************************/
+
+#define SCAN_MAX_REPORTS 16
+
+typedef struct {
+    int      count;
+    uint32_t ino[SCAN_MAX_REPORTS];
+    int      err[SCAN_MAX_REPORTS];
+} scanlog_t;
+
+static scanlog_t scanLog;
+static uint8_t *scanImg;
+
+static void ScanReport(void *ctx, uint32_t ino, int err)
+{
+    scanlog_t *log = (scanlog_t *)ctx;
+
+    if (log->count < SCAN_MAX_REPORTS) {
+        log->ino[log->count] = ino;
+        log->err[log->count] = err;
+    }
+    log->count++;
+}
+
+static int ScanReported(uint32_t ino, int err)
+{
+    for (int i = 0; i < scanLog.count && i < SCAN_MAX_REPORTS; i++) {
+        if (scanLog.ino[i] == ino && scanLog.err[i] == err) return 1;
+    }
+    return 0;
+}
+
+TEST_SETUP(scan)
+{
+    memset(&scanLog, 0, sizeof(scanLog));
+    scanImg = malloc(advanced_romfs_len);
+    memcpy(scanImg, advanced_romfs, advanced_romfs_len);
+}
+
+TEST_TEAR_DOWN(scan)
+{
+    RomfsUnload(&ri);
+    free(scanImg);
+}
+
+TEST(scan, GoodImage)
+{
+    RomfsLoad(scanImg, advanced_romfs_len, &ri);
+
+    TEST_ASSERT_EQUAL_INT(0, RomfsVerifyImage(ri, 1, ScanReport, &scanLog));
+    TEST_ASSERT_EQUAL_INT(0, RomfsVerifyImage(ri, 4, ScanReport, &scanLog));
+    TEST_ASSERT_EQUAL_INT(0, scanLog.count);
+
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsVerifyImage(NULL, 1, NULL, NULL));
+}
+
+TEST(scan, BadChecksums)
+{
+    scanImg[0x20f] ^= 1;    // dir1 header
+    scanImg[0x100] ^= 1;    // data of d, volume checksum
+
+    RomfsLoad(scanImg, advanced_romfs_len, &ri);
+
+    int ret = RomfsVerifyImage(ri, 4, ScanReport, &scanLog);
+    TEST_ASSERT_EQUAL_INT(2, ret);
+    TEST_ASSERT_EQUAL_INT(2, scanLog.count);
+    TEST_ASSERT(ScanReported(0, -EIO));
+    TEST_ASSERT(ScanReported(0x200, -EIO));
+
+    // report is optional
+    TEST_ASSERT_EQUAL_INT(2, RomfsVerifyImage(ri, 1, NULL, NULL));
+}
+
+TEST(scan, BrokenStructure)
+{
+    // chain of dir2 loops back to its '.' entry
+    scanImg[0xc3] = 0x80;
+    // dir1/link points past the volume
+    scanImg[0x244] = 0x10;
+
+    RomfsLoad(scanImg, advanced_romfs_len, &ri);
+
+    int ret = RomfsVerifyImage(ri, 2, ScanReport, &scanLog);
+    TEST_ASSERT(ret > 0);
+    TEST_ASSERT(ScanReported(0xc0, -ELOOP));
+    TEST_ASSERT(ScanReported(0x240, -EFAULT));
+    TEST_ASSERT_EQUAL_INT(ret, scanLog.count);
+}
+
+TEST_GROUP_RUNNER(scan)
+{
+    RUN_TEST_CASE(scan, GoodImage);
+    RUN_TEST_CASE(scan, BadChecksums);
+    RUN_TEST_CASE(scan, BrokenStructure);
+}
+
+/***************************************/
+TEST_GROUP(verity);
+/***************************************/
+
+static uint8_t *verityImg;
+static uint8_t *verityTree;
+static size_t verityLen;
+static uint8_t verityRoot[32];
+
+static void PutBE32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+/* Image with root directory and one file "big" of BIG_SIZE bytes. */
+uint8_t *BigImage(void)
+{
+    uint8_t *img = calloc(1, BIG_DATA + BIG_SIZE);
+
+    memcpy(img, "-rom1fs-", 8);
+    PutBE32(img + 8, BIG_DATA + BIG_SIZE);
+    memcpy(img + 16, "big", 3);
+
+    PutBE32(img + 0x20, 0x40 | ROMFS_TYPE_DIRECTORY);
+    PutBE32(img + 0x24, 0x20);
+    img[0x30] = '.';
+
+    PutBE32(img + 0x40, ROMFS_TYPE_FILE);
+    PutBE32(img + 0x48, BIG_SIZE);
+    memcpy(img + 0x50, "big", 3);
+
+    for (uint32_t i = 0; i < BIG_SIZE; i++) img[BIG_DATA + i] = (uint8_t)(i * 7 + i / 4096);
+
+    return img;
+}
+
+static void BuildTree(uint8_t *img, size_t len)
+{
+    romfs_t r;
+
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoad(img, len, &r));
+    TEST_ASSERT_EQUAL_INT(0, RomfsVerityBuild(r, NULL, &verityLen, NULL));
+    verityTree = malloc(verityLen);
+    TEST_ASSERT_EQUAL_INT(0, RomfsVerityBuild(r, verityTree, &verityLen, verityRoot));
+    RomfsUnload(&r);
+}
+
+static int LoadVerity(uint8_t *img, size_t len)
+{
+    romfs_opts_t opts = { .flags = ROMFS_OPT_VERITY };
+
+    opts.verity = verityTree;
+    opts.verityLen = verityLen;
+    opts.verityRoot = verityRoot;
+
+    return RomfsLoadOpts(img, len, &opts, &ri);
+}
+
+static int ReadAll(const char *path, char *buf, size_t len)
+{
+    int fd = RomfsOpenAt(ri, 3, path, 0);
+    int ret;
+
+    if (fd < 0) return fd;
+    ret = RomfsRead(ri, fd, buf, len);
+    RomfsClose(ri, fd);
+
+    return ret;
+}
+
+TEST_SETUP(verity)
+{
+    verityImg = malloc(advanced_romfs_len);
+    memcpy(verityImg, advanced_romfs, advanced_romfs_len);
+    verityTree = NULL;
+}
+
+TEST_TEAR_DOWN(verity)
+{
+    RomfsUnload(&ri);
+    free(verityImg);
+    free(verityTree);
+}
+
+TEST(verity, ReadsMatchTree)
+{
+    romfs_stats_t stats;
+    char buf[16];
+
+    BuildTree(verityImg, advanced_romfs_len);
+    // header and 6 files, all fit into one block and need no tree
+    TEST_ASSERT_EQUAL_INT(16 + 6 * 48, verityLen);
+
+    TEST_ASSERT_EQUAL_INT(0, LoadVerity(verityImg, advanced_romfs_len));
+
+    TEST_ASSERT_EQUAL_INT(10, ReadAll("a", buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_MEMORY("value = a\n", buf, 10);
+    TEST_ASSERT_EQUAL_INT(10, ReadAll("dir1/link", buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_INT(10, ReadAll("dir2/../e", buf, sizeof(buf)));
+
+    // block of a was verified once, the link reads the same file
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(2, stats.verityFiles);
+    TEST_ASSERT_EQUAL_INT(2, stats.verityHashed);
+    TEST_ASSERT_EQUAL_INT(0, stats.verityFailures);
+    TEST_ASSERT(stats.verityBytes > 0);
+
+    // buffer too small
+    verityLen--;
+    TEST_ASSERT_EQUAL_INT(-ENOSPC, RomfsVerityBuild(ri, verityTree, &verityLen, NULL));
+    TEST_ASSERT_EQUAL_INT(16 + 6 * 48, verityLen);
+}
+
+TEST(verity, CorruptDataFailsRead)
+{
+    romfs_stats_t stats;
+    char buf[16];
+    void *addr;
+    size_t len;
+    int fd;
+
+    BuildTree(verityImg, advanced_romfs_len);
+
+    // data of d
+    verityImg[0x100] ^= 1;
+
+    TEST_ASSERT_EQUAL_INT(0, LoadVerity(verityImg, advanced_romfs_len));
+
+    fd = RomfsOpenAt(ri, 3, "d", 0);
+    TEST_ASSERT(fd >= 0);
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsRead(ri, fd, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsPread(ri, fd, buf, 2, 8));
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsMapFile(ri, &addr, &len, fd, 0));
+    TEST_ASSERT_EQUAL_INT(0, RomfsPread(ri, fd, buf, 2, 10));
+    RomfsClose(ri, fd);
+
+    // other files are fine
+    TEST_ASSERT_EQUAL_INT(10, ReadAll("e", buf, sizeof(buf)));
+
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(3, stats.verityFailures);
+}
+
+TEST(verity, WrongTreeFailsLoad)
+{
+    BuildTree(verityImg, advanced_romfs_len);
+
+    verityRoot[0] ^= 1;
+    TEST_ASSERT_EQUAL_INT(-EIO, LoadVerity(verityImg, advanced_romfs_len));
+    TEST_ASSERT_NULL(ri);
+    verityRoot[0] ^= 1;
+
+    // size of a in the table
+    verityTree[16 + 4 * 48 + 7] ^= 1;
+    TEST_ASSERT_EQUAL_INT(-EIO, LoadVerity(verityImg, advanced_romfs_len));
+
+    // without the root hash the table is trusted, the file no longer matches it
+    romfs_opts_t opts = { .flags = ROMFS_OPT_VERITY, .verity = verityTree, .verityLen = verityLen };
+    char buf[16];
+
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadOpts(verityImg, advanced_romfs_len, &opts, &ri));
+    TEST_ASSERT_EQUAL_INT(-EIO, ReadAll("a", buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_INT(10, ReadAll("b", buf, sizeof(buf)));
+
+    // no tree appended to the image
+    opts.verity = NULL;
+    RomfsUnload(&ri);
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsLoadOpts(verityImg, advanced_romfs_len, &opts, &ri));
+}
+
+TEST(verity, TreeAppendedToImage)
+{
+    romfs_opts_t opts = { .flags = ROMFS_OPT_VERITY };
+    uint8_t *img;
+    char buf[16];
+
+    BuildTree(verityImg, advanced_romfs_len);
+
+    img = calloc(1, 0x280 + verityLen);
+    memcpy(img, advanced_romfs, 0x280);
+    memcpy(img + 0x280, verityTree, verityLen);
+    opts.verityRoot = verityRoot;
+
+    TEST_ASSERT_EQUAL_INT(0, RomfsLoadOpts(img, 0x280 + verityLen, &opts, &ri));
+    TEST_ASSERT_EQUAL_INT(10, ReadAll("c", buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_MEMORY("value = c\n", buf, 10);
+
+    RomfsUnload(&ri);
+    free(img);
+}
+
+TEST(verity, MultiLevelTree)
+{
+    romfs_stats_t stats;
+    uint8_t *img = BigImage();
+    uint8_t buf[64];
+    int fd;
+
+    BuildTree(img, BIG_DATA + BIG_SIZE);
+    TEST_ASSERT_EQUAL_INT(16 + 48 + 3 * 4096, verityLen);
+
+    TEST_ASSERT_EQUAL_INT(0, LoadVerity(img, BIG_DATA + BIG_SIZE));
+    fd = RomfsOpenAt(ri, 3, "big", 0);
+    TEST_ASSERT(fd >= 0);
+
+    // top block, first leaf block, data block
+    TEST_ASSERT_EQUAL_INT(10, RomfsPread(ri, fd, buf, 10, 0));
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(3, stats.verityHashed);
+
+    // second leaf block and one data block, top is known good
+    TEST_ASSERT_EQUAL_INT(64, RomfsPread(ri, fd, buf, 64, 130 * 4096));
+    TEST_ASSERT_EQUAL_HEX8((uint8_t)(130 * 4096 * 7 + 130), buf[0]);
+    // spans the last two blocks, short last block included
+    TEST_ASSERT_EQUAL_INT(64, RomfsPread(ri, fd, buf, 64, (BIG_BLOCKS - 1) * 4096 - 32));
+    RomfsGetStats(ri, &stats);
+    TEST_ASSERT_EQUAL_INT(7, stats.verityHashed);
+    TEST_ASSERT_EQUAL_INT(0, stats.verityFailures);
+    RomfsUnload(&ri);
+
+    // second leaf block of the tree
+    verityTree[16 + 48 + 4096 + 5] ^= 1;
+    TEST_ASSERT_EQUAL_INT(0, LoadVerity(img, BIG_DATA + BIG_SIZE));
+    fd = RomfsOpenAt(ri, 3, "big", 0);
+    TEST_ASSERT_EQUAL_INT(10, RomfsPread(ri, fd, buf, 10, 127 * 4096));
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsPread(ri, fd, buf, 10, 128 * 4096));
+    TEST_ASSERT_EQUAL_INT(-EIO, RomfsPread(ri, fd, buf, 10, 4096 + 127 * 4096 + 1));
+
+    free(img);
+}
+
+TEST_GROUP_RUNNER(verity)
+{
+    RUN_TEST_CASE(verity, ReadsMatchTree);
+    RUN_TEST_CASE(verity, CorruptDataFailsRead);
+    RUN_TEST_CASE(verity, WrongTreeFailsLoad);
+    RUN_TEST_CASE(verity, TreeAppendedToImage);
+    RUN_TEST_CASE(verity, MultiLevelTree);
+}
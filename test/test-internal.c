@@ -22,15 +22,20 @@ TEST(volume, VolumeConfigureBadImg)
     uint8_t buf[10] = { 0 };
     volume_t vol;
 
-    int ret = RomfsVolumeConfigure(buf, &vol);
+    int ret = RomfsVolumeConfigure(buf, sizeof(buf), &vol);
     TEST_ASSERT_EQUAL_INT(-EINVAL, ret);
+
+    // volume name runs to the end of the image
+    uint8_t cut[20] = "-rom1fs-\0\0\0\0\0\0\0\0name";
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsVolumeConfigure(cut, sizeof(cut), &vol));
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsVolumeConfigure(cut, 4, &vol));
 }
 
 TEST(volume, VolumeConfigureGoodImg)
 {
     volume_t vol;
 
-    int ret = RomfsVolumeConfigure(empty_romfs, &vol);
+    int ret = RomfsVolumeConfigure(empty_romfs, empty_romfs_len, &vol);
     TEST_ASSERT_EQUAL_INT(0, ret);
     TEST_ASSERT_EQUAL_STRING_LEN("empyt", vol.name, 5);
     TEST_ASSERT_EQUAL_INT(96, vol.size);
@@ -315,3 +320,142 @@ TEST_GROUP_RUNNER(find)
     RUN_TEST_CASE(find, FindEntryDirAbsolutePath);
     RUN_TEST_CASE(find, FindEntryDirRelativePath);
 }
+
+/***************************************/
+TEST_GROUP(names);
+/***************************************/
+
+TEST_SETUP(names)
+{
+}
+
+TEST_TEAR_DOWN(names)
+{
+}
+
+TEST(names, NameLenBounded)
+{
+    char buf[80];
+
+    memset(buf, 'x', sizeof(buf));
+    TEST_ASSERT_EQUAL_INT(sizeof(buf), RomfsNameLen(buf, sizeof(buf)));
+
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        memset(buf, 'x', sizeof(buf));
+        buf[i] = '\0';
+        TEST_ASSERT_EQUAL_INT(i, RomfsNameLen(buf, sizeof(buf)));
+    }
+
+    TEST_ASSERT_EQUAL_INT(5, RomfsNameLen("abcdef", 5));
+}
+
+TEST(names, NameKeyCompare)
+{
+    // node names as stored in image, NUL padded to 16 bytes
+    char node[64];
+    namekey_t key;
+
+    for (size_t len = 0; len < MAX_NAME_LEN; len++) {
+        char name[MAX_NAME_LEN];
+
+        memset(name, 'n', sizeof(name));
+        memset(node, 0, sizeof(node));
+        memcpy(node, name, len);
+
+        RomfsNameKeyInit(&key, name, len);
+        TEST_ASSERT_EQUAL_INT(1, RomfsNameKeyEq(&key, node, sizeof(node)));
+
+        // longer node name
+        node[len] = 'n';
+        TEST_ASSERT_EQUAL_INT(0, RomfsNameKeyEq(&key, node, sizeof(node)));
+        node[len] = '\0';
+
+        // shorter node name
+        if (len > 0) {
+            node[len - 1] = '\0';
+            TEST_ASSERT_EQUAL_INT(0, RomfsNameKeyEq(&key, node, sizeof(node)));
+            node[len - 1] = 'x';
+            TEST_ASSERT_EQUAL_INT(0, RomfsNameKeyEq(&key, node, sizeof(node)));
+        }
+
+        // name doesn't fit into what's left of image
+        TEST_ASSERT_EQUAL_INT(0, RomfsNameKeyEq(&key, node, len));
+    }
+}
+
+TEST(names, GetNodeHdrNameNotTerminated)
+{
+    struct romfs_t rm;
+    uint8_t img[48];
+    nodehdr_t node;
+
+    memset(&rm, 0, sizeof(rm));
+    memset(img, 'x', sizeof(img));
+    rm.img = img;
+    rm.size = sizeof(img);
+    rm.vol.size = sizeof(img);
+
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsGetNodeHdr(&rm, 16, &node));
+    TEST_ASSERT_EQUAL_INT(-EINVAL, RomfsGetNodeHdr(&rm, 32, &node));
+
+    img[47] = '\0';
+    TEST_ASSERT_EQUAL_INT(0, RomfsGetNodeHdr(&rm, 16, &node));
+    TEST_ASSERT_EQUAL_HEX(48, node.dataOff);
+}
+
+TEST(names, ChecksumMatchesScalar)
+{
+    uint8_t buf[101];
+    uint32_t want;
+
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = (uint8_t)(i * 37 + 11);
+
+    // every length and misalignment, vector body plus scalar tail
+    for (size_t off = 0; off < 4; off++) {
+        for (size_t len = 0; off + len <= sizeof(buf); len++) {
+            want = 0;
+            for (size_t i = 0; i < len; i++) want += (uint32_t)buf[off + i] << (24 - 8 * (i & 3));
+            TEST_ASSERT_EQUAL_HEX(want, RomfsChecksum(buf + off, len));
+        }
+    }
+
+    // images carry a checksum that makes the first 512 bytes sum to zero
+    TEST_ASSERT_EQUAL_HEX(0, RomfsChecksum(basic_romfs, 512));
+}
+
+TEST(names, Sha256KnownVectors)
+{
+    static const uint8_t abc[SHA256_LEN] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+    };
+    static const uint8_t twoBlocks[SHA256_LEN] = {
+        0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+        0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1,
+    };
+    const char *msg = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    uint8_t out[SHA256_LEN];
+    sha256_t c;
+
+    RomfsSha256Init(&c);
+    RomfsSha256Update(&c, "abc", 3);
+    RomfsSha256Final(&c, out);
+    TEST_ASSERT_EQUAL_MEMORY(abc, out, SHA256_LEN);
+
+    // padding spills into a second block, fed in uneven pieces
+    RomfsSha256Init(&c);
+    RomfsSha256Update(&c, msg, 5);
+    RomfsSha256Update(&c, msg + 5, 50);
+    RomfsSha256Update(&c, msg + 55, strlen(msg) - 55);
+    RomfsSha256Final(&c, out);
+    TEST_ASSERT_EQUAL_MEMORY(twoBlocks, out, SHA256_LEN);
+}
+
+TEST_GROUP_RUNNER(names)
+{
+    RUN_TEST_CASE(names, NameLenBounded);
+    RUN_TEST_CASE(names, NameKeyCompare);
+    RUN_TEST_CASE(names, GetNodeHdrNameNotTerminated);
+    RUN_TEST_CASE(names, ChecksumMatchesScalar);
+    RUN_TEST_CASE(names, Sha256KnownVectors);
+}
@@ -163,6 +163,68 @@ TEST(path, CheckPathCountTheElementsInPath)
     TEST_ASSERT_EQUAL_INT(4, ret);
 }
 
+TEST(path, PathWalkComponents)
+{
+    const char *path = "//a/bb///ccc/";
+    path_walk_t w;
+
+    TEST_ASSERT_EQUAL_INT(0, UtilsPathWalkInit(&w, path, strlen(path)));
+
+    TEST_ASSERT_EQUAL_INT(1, UtilsPathWalkNext(&w));
+    TEST_ASSERT_EQUAL_INT(1, w.len);
+    TEST_ASSERT_EQUAL_STRING_LEN(".", w.name, 1);
+
+    TEST_ASSERT_EQUAL_INT(1, UtilsPathWalkNext(&w));
+    TEST_ASSERT_EQUAL_INT(1, w.len);
+    TEST_ASSERT_EQUAL_PTR(path + 2, w.name);
+
+    TEST_ASSERT_EQUAL_INT(1, UtilsPathWalkNext(&w));
+    TEST_ASSERT_EQUAL_INT(2, w.len);
+    TEST_ASSERT_EQUAL_PTR(path + 4, w.name);
+
+    TEST_ASSERT_EQUAL_INT(1, UtilsPathWalkNext(&w));
+    TEST_ASSERT_EQUAL_INT(3, w.len);
+    TEST_ASSERT_EQUAL_PTR(path + 9, w.name);
+
+    TEST_ASSERT_EQUAL_INT(0, UtilsPathWalkNext(&w));
+    TEST_ASSERT_EQUAL_INT(0, UtilsPathWalkNext(&w));
+}
+
+TEST(path, PathWalkLengthDelimited)
+{
+    const char buf[] = { 'a', '/', 'b', 'c', 'd', 'e' };
+    path_walk_t w;
+
+    TEST_ASSERT_EQUAL_INT(0, UtilsPathWalkInit(&w, buf, 4));
+
+    TEST_ASSERT_EQUAL_INT(1, UtilsPathWalkNext(&w));
+    TEST_ASSERT_EQUAL_STRING_LEN("a", w.name, w.len);
+    TEST_ASSERT_EQUAL_INT(1, UtilsPathWalkNext(&w));
+    TEST_ASSERT_EQUAL_INT(2, w.len);
+    TEST_ASSERT_EQUAL_STRING_LEN("bc", w.name, w.len);
+    TEST_ASSERT_EQUAL_INT(0, UtilsPathWalkNext(&w));
+
+    // NUL inside the buffer ends the path
+    TEST_ASSERT_EQUAL_INT(0, UtilsPathWalkInit(&w, "x\0y", 3));
+    TEST_ASSERT_EQUAL_INT(1, UtilsPathWalkNext(&w));
+    TEST_ASSERT_EQUAL_INT(1, w.len);
+    TEST_ASSERT_EQUAL_INT(0, UtilsPathWalkNext(&w));
+}
+
+TEST(path, PathWalkErrors)
+{
+    char path[MAX_PATH_LEN + 1];
+    path_walk_t w;
+
+    TEST_ASSERT_EQUAL_INT(-EINVAL, UtilsPathWalkInit(&w, NULL, 1));
+
+    memset(path, 'a', sizeof(path));
+    TEST_ASSERT_EQUAL_INT(-ENAMETOOLONG, UtilsPathWalkInit(&w, path, sizeof(path)));
+
+    TEST_ASSERT_EQUAL_INT(0, UtilsPathWalkInit(&w, path, MAX_NAME_LEN));
+    TEST_ASSERT_EQUAL_INT(-ENAMETOOLONG, UtilsPathWalkNext(&w));
+}
+
 TEST_GROUP_RUNNER(path)
 {
     RUN_TEST_CASE(path, ParsePathGetNextEmpty);
@@ -173,4 +235,7 @@ TEST_GROUP_RUNNER(path)
     RUN_TEST_CASE(path, CheckPathPathTooLong);
     RUN_TEST_CASE(path, CheckPathNameTooLong);
     RUN_TEST_CASE(path, CheckPathCountTheElementsInPath);
+    RUN_TEST_CASE(path, PathWalkComponents);
+    RUN_TEST_CASE(path, PathWalkLengthDelimited);
+    RUN_TEST_CASE(path, PathWalkErrors);
 }